@@ -4,12 +4,74 @@
 // Read from a binary file and store intructions in memory allocated on the heap
 // The Machine class goes through the instruction pipeline
 
+#include <algorithm> // fill
+#include <array>
+#include <atomic>  // atomic, atomic_signal_fence
+#include <bitset>
+#include <chrono>  // steady_clock
+#include <condition_variable>
+#include <csignal> // sig_atomic_t
 #include <cstdint> // [u]int_leastN_t
-#include <cstdio>  // putchar, getchar
+#include <cstdio>  // fwrite, getchar
+#include <cstring> // memcpy
+#include <deque>
 #include <fstream> // ifstream
 #include <iomanip> 
 #include <iostream> 
+#include <iterator> // istreambuf_iterator
+#include <limits>   // numeric_limits
+#include <map>
+#include <memory>  // unique_ptr
+#include <mutex>
 #include <sstream> // ostringstream
+#include <string>
+#include <thread>
+#include <type_traits> // make_unsigned
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// guarded memory needs mmap and a SIGSEGV handler
+#if defined(__unix__)
+#define MACHINE_GUARD 1
+#include <fcntl.h>    // open
+#include <signal.h>   // sigaction
+#include <sys/mman.h> // mmap, mprotect, mincore
+#include <unistd.h>   // close, dup, pwrite, ftruncate
+#else
+#define MACHINE_GUARD 0
+#endif
+
+// the JIT writes x86-64 code and needs mmap to make it executable
+#if defined(__x86_64__) && defined(__unix__)
+#define MACHINE_JIT 1
+#else
+#define MACHINE_JIT 0
+#endif
+
+// the bulk pre-decoder does 8 words at a time with AVX2, if the host has it
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MACHINE_AVX2 1
+#include <immintrin.h>
+#else
+#define MACHINE_AVX2 0
+#endif
+
+// --bench counts L1 data cache misses with perf_event_open where it can
+#if defined(__linux__)
+#define MACHINE_PERF 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>   // ioctl
+#include <sys/syscall.h> // SYS_perf_event_open
+#else
+#define MACHINE_PERF 0
+#endif
+
+// counters of what retired, by kind (--counters), build with
+// -DMACHINE_COUNTERS=0 to leave them out altogether
+#ifndef MACHINE_COUNTERS
+#define MACHINE_COUNTERS 1
+#endif
 
 using u8  = std::uint_least8_t;
 using i8  = std:: int_least8_t;
@@ -20,6 +82,438 @@ using i32 = std:: int_least32_t;
 using u64 = std::uint_least64_t;
 using i64 = std:: int_least64_t;
 
+// Executable memory for the JIT. Code is copied in while the buffer is
+// writable and then the whole buffer is flipped back to executable.
+class CodeBuffer
+{
+public:
+    explicit CodeBuffer(i64 size);
+    ~CodeBuffer();
+    CodeBuffer(const CodeBuffer&) = delete;
+    CodeBuffer& operator=(const CodeBuffer&) = delete;
+
+    // returns where the code went, or nullptr if it doesn't fit
+    const u8* Add(const std::vector<u8>& code);
+    // forget everything that was added
+    void Reset();
+
+private:
+    u8* _base;
+    i64 _size;
+    i64 _used;
+};
+
+// Guest memory, split into 4 KiB pages that are only allocated the first
+// time they are touched, so a large address space costs nothing until used.
+// Checked memory finds pages through a two-level page table. Guarded memory
+// is one mmap'd range followed by a PROT_NONE guard region, so the machine
+// can load and store straight into it and let the hardware catch accesses
+// that run off the end.
+class PagedMemory
+{
+public:
+    static constexpr i32 PAGE_BITS = 12;
+    static constexpr i64 PAGE_SIZE = 1ll << PAGE_BITS;
+    static constexpr i64 GUARD_SIZE = 1ll << 32; // reserved after guarded memory
+
+    // size is rounded up to whole pages, guarded falls back to checked
+    // memory on hosts without mmap
+    explicit PagedMemory(i64 size, bool guarded = false);
+    ~PagedMemory();
+    PagedMemory(const PagedMemory&) = delete;
+    PagedMemory& operator=(const PagedMemory&) = delete;
+
+    i64 Size() const;
+    i64 ResidentPages() const;
+
+    // host address of the page holding address, allocated on first touch
+    // nullptr if address is outside the address space
+    char* Page(i64 address);
+
+    // copy bytes in and out, for loading programs and checking results
+    void Write(i64 address, const char* data, i64 numBytes);
+    void Read(i64 address, char* data, i64 numBytes);
+
+    // lowest address where the two memories differ, -1 if they don't
+    i64 FirstDifference(const PagedMemory& other) const;
+
+    // guest address 0 on the host if the memory is guarded, otherwise nullptr
+    char* Flat() const;
+
+    // Make the page holding address read-only, so a store to it faults,
+    // or writable again. Guarded memory only.
+    void Protect(i64 address, bool readOnly);
+    // put the guard back over [address, address+numBytes) after a fault in it
+    void Reguard(i64 address, i64 numBytes);
+
+    // Map numBytes of an open file starting at offset to address,
+    // copy-on-write, instead of copying them in. Pages nobody writes stay
+    // shared with the page cache. Guarded memory only, and address and
+    // offset have to be the same distance into a page. Returns false if the
+    // file couldn't be mapped.
+    bool MapFile(i64 address, int fd, i64 offset, i64 numBytes);
+
+    // Set when an access to guarded memory faulted on this thread. The
+    // SIGSEGV handler makes the page accessible so the access can finish,
+    // and whoever made the access clears this and sorts it out.
+    static thread_local volatile std::sig_atomic_t faulted;
+
+private:
+    static constexpr i32 TABLE_BITS = 10; // pages per second-level table
+    static constexpr i32 MAX_GUARDED = 64; // guarded memories alive at once
+
+    // the page if it has been touched, without allocating it
+    const char* Peek(i64 page) const;
+
+#if MACHINE_GUARD
+    static void GuardHandler(int sig, siginfo_t* info, void* context);
+    static std::atomic<PagedMemory*> s_guarded[MAX_GUARDED]; // for the handler
+    // the last bytes of memory, saved when a fault opens the first guard
+    // page, since a store running off the end also writes the part before it
+    static thread_local char s_edge[8];
+    static thread_local char* s_edgeAt;
+#endif
+
+    i64 _size;
+    std::vector<char**> _tables; // second-level tables, nullptr until needed
+    i64 _resident;
+    char* _flat;                 // guarded memory, nullptr if checked
+    std::mutex _tablesLock;      // harts share the memory and can all touch new pages
+};
+
+// The host side of the console ecalls. Output collects in a buffer that
+// is written out when it fills up, before waiting for input and when the
+// program quits, instead of costing a libc call per character.
+class Console
+{
+public:
+    static const i64 BUFFER_SIZE = 1 << 16;
+
+    Console();
+    ~Console(); // flushes
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+    // send output to a string instead of stdout (nullptr for stdout)
+    void Capture(std::string* to);
+    // take input from a string instead of stdin (nullptr for stdin)
+    void Feed(const std::string* from);
+
+    void Put(char c);
+    void Write(const char* data, i64 numBytes);
+    void Flush();
+
+    // the next input character, or EOF, after flushing any output
+    i32 Get();
+    // Read up to and including the next newline, but no more than
+    // numBytes. Returns how many bytes were read, 0 at the end of input.
+    i64 ReadLine(char* data, i64 numBytes);
+
+    // everything the program has written so far
+    i64 BytesOut() const;
+
+private:
+    std::vector<char> _buffer;
+    i64 _used;
+    std::string* _capture; // captured output, or nullptr
+    i64 _bytesOut;
+    const std::string* _input; // fed input, or nullptr
+    size_t _inputAt;
+
+    // the next input character, from whichever source
+    i32 Next();
+};
+
+// Set-associative caches in front of memory, to count hits and misses.
+// Only the tags are kept, the data stays in memory. L1I and L1D both miss
+// into L2, if there is one, and L2 into memory.
+class Caches
+{
+public:
+    enum Replacement { LRU, PLRU, RANDOM };
+    struct Config
+    {
+        i64 size;       // bytes, 0 for no cache
+        i64 ways;
+        i64 lineSize;
+        Replacement replacement;
+        bool writeBack; // write-back and allocate on a store miss, or write-through and don't
+    };
+    static const Config DEFAULT_L1I;
+    static const Config DEFAULT_L1D;
+    static const Config DEFAULT_L2;
+
+    Caches(const Config& l1i, const Config& l1d, const Config& l2);
+
+    // what's wrong with the config, or nullptr if nothing
+    static const char* Check(const Config& config);
+
+    // an instruction fetched from pc, and a load or store by the one at pc
+    void Fetch(i64 pc);
+    void Load(i64 pc, i64 address, i64 numBytes);
+    void Store(i64 pc, i64 address, i64 numBytes);
+
+    // hits and misses for each cache, and the pcs that missed the most
+    void PrintStats(std::ostream& out, i32 top) const;
+
+private:
+    enum { L1I, L1D, L2, LEVELS };
+    static const i32 PC_PAGE_BITS = 10; // instructions per page of PcStats
+
+    struct Level
+    {
+        Config config;
+        i32 lineBits;
+        u64 sets;
+        std::vector<u64> tags;  // line number + 1 for each way, set after set, 0 if empty
+        std::vector<u8> dirty;
+        std::vector<u64> used;  // LRU: clock when each way was last touched
+        std::vector<u64> tree;  // PLRU: a bit per tree node for each set
+        u64 clock;
+        u64 random;             // xorshift state for RANDOM
+        u64 lastLine;           // the line touched last and its way, which
+        u64 lastWay;            // most accesses go straight back to
+        i64 reads;
+        i64 readMisses;
+        i64 writes;
+        i64 writeMisses;
+        i64 writebacks;
+    };
+    struct PcStats
+    {
+        i64 fetches;
+        i64 fetchMisses;
+        i64 fetchL2Misses; // ... that missed L2 as well
+        i64 accesses;      // loads and stores
+        i64 misses;
+        i64 l2Misses;
+    };
+
+    // Look address up in one cache, filling it on a miss from the level
+    // below and writing back what it evicts. Returns true on a hit.
+    bool Access(i32 level, u64 address, bool write);
+    // Fetch when the instruction isn't in the line fetched from last
+    void FetchLine(PcStats& ps, i64 pc);
+    u64 Victim(Level& c, u64 set);
+    void Touch(Level& c, u64 set, u64 way);
+    // L1D accesses for [address, address+numBytes), which can span two lines
+    void Data(i64 pc, i64 address, i64 numBytes, bool write);
+    void DataLines(PcStats& ps, i64 address, i64 numBytes, bool write);
+    PcStats& AtPc(i64 pc);
+    PcStats& AtNewPage(i64 pc);
+    i64 L2Misses() const;
+
+    Level _levels[LEVELS];
+    std::vector<std::unique_ptr<PcStats[]>> _pcPages; // by pc, allocated a page at a time
+    u64 _lastPcPage;                                  // the page AtPc found last
+    PcStats* _lastPcStats;
+};
+
+// Guesses at Fetch where each branch and jump goes, for the pipeline
+// engine. Conditional branches go by the scheme, returns by the return
+// address stack (if it has one) and other JALRs by the last target seen
+// at that pc. Targets of branches and JALs come from the instruction word,
+// as if the instruction cache held them predecoded.
+class BranchPredictor
+{
+public:
+    // NOT_TAKEN always fetches pc + 4 and leaves even JALs to Decode,
+    // STATIC takes backward branches (loops), BIMODAL keeps a 2-bit counter
+    // per branch, GSHARE indexes the counters by pc and global history, and
+    // TAGE puts tagged tables of longer and longer history in front of them
+    enum Scheme { NOT_TAKEN, STATIC, BIMODAL, GSHARE, TAGE };
+    enum Kind { BRANCH, JUMP, INDIRECT }; // conditional, JAL, JALR
+
+    // rasEntries 0 leaves returns to the indirect targets
+    BranchPredictor(Scheme scheme, i32 rasEntries);
+
+    // Where fetch goes after the branch or jump at pc. target is where a
+    // BRANCH or JUMP goes if taken, call and ret say whether it links
+    // through ra (or t0) or returns through it.
+    i64 Predict(i64 pc, Kind kind, i64 target, bool call, bool ret);
+    // where it really went, to learn from and count
+    void Train(i64 pc, Kind kind, i64 next, i64 predicted);
+    // cycles flushed because the guess at pc was wrong
+    void Charge(i64 pc, i64 cycles);
+
+    // accuracy for each kind and the top branches by cycles flushed
+    void PrintStats(std::ostream& out, i32 top) const;
+
+private:
+    static const i32 COUNTER_BITS = 12;  // 4096 2-bit counters
+    static const i32 TARGET_BITS = 9;    // 512 indirect targets
+    static const i32 TAGE_TABLES = 4;
+    static const i32 TAGE_BITS = 10;     // 1024 entries per tagged table
+    static const i32 TAGE_HISTORY[TAGE_TABLES];
+    static const i64 TAGE_AGING = 1 << 18; // branches between halving useful
+
+    struct TageEntry
+    {
+        u16 tag;
+        i8 counter; // -4 to 3, taken if >= 0
+        u8 useful;  // 0 to 3
+    };
+    struct Site
+    {
+        Kind kind;
+        i64 runs;
+        i64 mispredicted;
+        i64 cycles;
+    };
+
+    // xor bits-wide chunks of the low length bits of the history together
+    static u32 Fold(u64 history, i32 length, i32 bits);
+    u32 TageIndex(i64 pc, i32 table) const;
+    u16 TageTag(i64 pc, i32 table) const;
+    bool PredictTaken(i64 pc, i64 target);
+    void TrainTaken(i64 pc, bool taken);
+
+    Scheme _scheme;
+    std::vector<u8> _counters;
+    std::vector<i64> _targets;    // by pc, for JALRs
+    std::vector<i64> _ras;        // circular, overwrites the oldest
+    i64 _rasTop;                  // calls pushed minus returns popped
+    u64 _history;                 // outcomes of the last 64 branches, newest in bit 0
+    std::vector<TageEntry> _tage; // TAGE_TABLES tables, shortest history first
+    i32 _provider;                // the table the last TAGE guess came from, -1 for the counters
+    bool _providerTaken;
+    bool _altTaken;               // what the next table down (or the counters) said
+    i64 _tageBranches;
+
+    std::unordered_map<i64, Site> _sites;
+};
+
+// Samples the guest pc every so many instructions, along with the calls
+// that led there. Calls and returns are followed by the same ra/t0 link
+// hints the return address stack goes by, and named from the program's
+// symbols when there are any.
+class Profiler
+{
+public:
+    // a sample every interval instructions, starting in the code at entry
+    Profiler(i64 interval, i64 entry);
+
+    // name the code from address up to the next symbol
+    void AddSymbol(i64 address, const std::string& name);
+
+    // the instruction at pc retired and the pc went on to next
+    void Retire(i64 pc, u32 instruction, i64 next);
+
+    // samples by function and the pcs sampled the most
+    void PrintFlat(std::ostream& out, i32 top) const;
+    // one "outer;...;inner samples" line per call stack, which is what
+    // flamegraph.pl, inferno and speedscope read
+    void WriteCollapsed(std::ostream& out) const;
+
+private:
+    static const size_t MAX_DEPTH = 1024; // frames kept, deeper calls are only counted
+
+    struct Frame
+    {
+        i64 entry; // where the call went
+        i64 ret;   // where it comes back to, -1 for the outermost frame
+    };
+
+    void Sample(i64 pc);
+    // a JAL or JALR, which may call or return
+    void Jump(i64 pc, u32 instruction, i64 next);
+    // the symbol address is under, or -1 if there is none
+    i64 Function(i64 address) const;
+    // the symbol's name, or the address in hex if there is no symbol
+    std::string Name(i64 address) const;
+    // the function a sample was in: the pc's symbol, or without one the
+    // innermost call
+    std::string Leaf(const std::vector<i64>& key) const;
+
+    i64 _interval;
+    i64 _countdown;
+    i64 _samples;
+    std::vector<Frame> _stack;
+    i64 _lost;                               // calls past MAX_DEPTH not returned from yet
+    std::map<i64, std::string> _symbols;     // by address
+    std::unordered_map<i64, i64> _flat;      // samples by pc
+    std::map<std::vector<i64>, i64> _stacks; // samples by frame entries, outermost
+                                             // first, then the function of the pc
+};
+
+// Streams a compact binary trace of the instructions a hart retires to a
+// file, for --trace. Records are delta encoded into one buffer while a
+// writer thread compresses and writes the other, so the hart only waits
+// when the disk can't keep up. Only what can't be worked out from the
+// registers is recorded: DecodeTrace runs everything else again to turn a
+// trace back into text.
+class TraceWriter
+{
+public:
+    enum Compression { NONE, LZ };
+
+    // A trace is MAGIC, the 32 registers the hart started with, then blocks
+    // of records, each a byte for the compression, the raw and stored sizes
+    // (4 bytes each) and the data. A record is a byte of flags and then,
+    // in this order, what they say is there: the pc as a varint from where
+    // the last instruction went (only for the first, or if the hart was
+    // moved), the instruction word if the pc's slot in a table of the last
+    // words seen holds a different one, and the value it left in rd (a0
+    // for ecalls) as a varint from the last value recorded, for loads,
+    // AMOs, CSR reads and ecalls. Addresses, stored data, branches and what
+    // the other instructions write all follow from the registers. Varints
+    // are LEB128 of the zigzagged difference.
+    enum Flags { MOVED = 1, NEW_WORD = 2, VALUE = 4 };
+    static const char MAGIC[8];
+    static const i32 WORD_BITS = 12;       // 4096 words, direct mapped by pc
+    static const i64 BLOCK_SIZE = 1 << 20; // raw bytes per block, at most
+
+    // starts the trace in fileName, with the registers the hart starts with
+    TraceWriter(const char* fileName, Compression compression, const i64* regs);
+    ~TraceWriter();
+
+    // the instruction at pc retired and went to next, leaving value in
+    // register rd, if rd isn't 0
+    void Record(i64 pc, u32 instruction, i64 next, u32 rd, i64 value);
+
+    // write out what's left and stop the writer, false if anything failed
+    bool Finish();
+
+    // LZ4-style sequences: a token with the number of literals (high
+    // nibble) and match length - 4 (low), either 15 meaning more length
+    // bytes follow, then the literals and the match's 2-byte offset. The
+    // last sequence is only literals.
+    static void Compress(const u8* in, i64 size, std::vector<u8>& out);
+    static bool Decompress(const u8* in, i64 size, i64 rawSize, std::vector<u8>& out);
+
+    static u64 Zigzag(i64 value);
+    static i64 Unzigzag(u64 value);
+
+private:
+    static const i64 MAX_RECORD = 32;
+
+    void Put(i64 difference);
+    // give the buffer that is filling to the writer, once it is done with the other one
+    void Hand();
+    // the writer thread
+    void Write();
+
+    std::ofstream _out;
+    Compression _compression;
+    std::vector<u8> _buffers[2];
+    i32 _filling;        // the buffer records go into
+    u8* _at;
+    u8* _end;            // MAX_RECORD before the end of the buffer
+    i64 _expected;       // where the last instruction went
+    std::vector<u32> _words;
+    i64 _value;          // the last value recorded
+
+    std::mutex _lock;
+    std::condition_variable _changed;
+    i64 _handed;         // bytes in the buffer the writer has, -1 if it has none
+    bool _stopping;
+    bool _failed;
+    std::thread _writer;
+};
+
+class Harts;
+class Lockstep;
+
 class Machine
 {
 public:
@@ -28,15 +522,49 @@ public:
         LOAD, STORE, BRANCH, JALR,
         JAL, OP_IMM, OP, AUIPC, LUI,
         OP_IMM_32, OP_32, SYSTEM,
-        UNIMPL
+        MISC_MEM, AMO, UNIMPL
     };
     enum Alu 
     {
         ADD, SUB, MUL, DIV,
         REM, SLL, SRL, SRA,
         AND, OR,  XOR, NOT,
+        SLT, SLTU,
+        MULH, MULHSU, MULHU, DIVU, REMU,
+        SH1ADD, SH2ADD, SH3ADD, ANDN, ORN, XNOR,
+        CLZ, CLZW, CTZ, CTZW, CPOP,
+        MAX, MAXU, MIN, MINU, SEXT_B, SEXT_H, ZEXT_H,
+        ROL, ROLW, ROR, RORW, ORC_B, REV8,
+        BCLR, BEXT, BINV, BSET,
         NO_OP
     };
+    // Every concrete instruction (RV64IMA, Zba, Zbb and Zbs), used by the fast core.
+    // Scoped because most of the names are already taken by Opcodes and Alu.
+    enum class Inst : u8
+    {
+        LB, LH, LW, LD, LBU, LHU, LWU,
+        SB, SH, SW, SD,
+        BEQ, BNE, BLT, BGE, BLTU, BGEU,
+        JALR, JAL, AUIPC, LUI,
+        ADDI, SLTI, SLTIU, XORI, ORI, ANDI, SLLI, SRLI, SRAI,
+        ADD, SUB, SLL, SLT, SLTU, XOR, SRL, SRA, OR, AND,
+        MUL, MULH, MULHSU, MULHU, DIV, DIVU, REM, REMU,
+        ADDIW, SLLIW, SRLIW, SRAIW,
+        ADDW, SUBW, SLLW, SRLW, SRAW,
+        MULW, DIVW, DIVUW, REMW, REMUW,
+        SH1ADD, SH2ADD, SH3ADD, ADD_UW, SH1ADD_UW, SH2ADD_UW, SH3ADD_UW, SLLI_UW,
+        ANDN, ORN, XNOR, CLZ, CLZW, CTZ, CTZW, CPOP, CPOPW,
+        MAX, MAXU, MIN, MINU, SEXT_B, SEXT_H, ZEXT_H,
+        ROL, ROLW, ROR, RORI, RORIW, RORW, ORC_B, REV8,
+        BCLR, BCLRI, BEXT, BEXTI, BINV, BINVI, BSET, BSETI,
+        ECALL, CSRRW, CSRRS, CSRRC, CSRRWI, CSRRSI, CSRRCI,
+        FENCE, FENCE_I, PAUSE,
+        LR_W, SC_W, AMOSWAP_W, AMOADD_W, AMOXOR_W, AMOAND_W, AMOOR_W,
+        AMOMIN_W, AMOMAX_W, AMOMINU_W, AMOMAXU_W,
+        LR_D, SC_D, AMOSWAP_D, AMOADD_D, AMOXOR_D, AMOAND_D, AMOOR_D,
+        AMOMIN_D, AMOMAX_D, AMOMINU_D, AMOMAXU_D,
+        ILLEGAL
+    };
 
     struct FetchOut 
     {
@@ -54,6 +582,7 @@ public:
         i64 offset;   // Offsets for BRANCH and STORE
         i64 leftVal;  // typically the value of rs1
         i64 rightVal; // typically the value of rs2 or immediate
+        Inst inst;    // the concrete instruction, for the ones Memory does itself
 
         // usage: std::cout << DebugDecodeOut();
         friend std::ostream& operator<<(std::ostream& out, const DecodeOut& dec);
@@ -61,7 +590,16 @@ public:
     struct ExecuteOut 
     {
         i64 result;
-        u8  n, z, c, v;
+        // The ALU only records what it did. The NZCV flags are worked
+        // out from these when something asks, which is only debug output.
+        Alu cmd;
+        i64 left;
+        i64 right;
+
+        u8 N() const;
+        u8 Z() const;
+        u8 C() const;
+        u8 V() const;
 
         // usage: std::cout << DebugExecuteOut();
         friend std::ostream& operator<<(std::ostream& out, const ExecuteOut& eo);
@@ -72,8 +610,31 @@ public:
 
         friend std::ostream& operator<<(std::ostream& out, const MemoryOut& mo); 
     };
+    // What the fast core's handlers run from, 8 bytes, so a block's
+    // worth of them takes a few cache lines
+    struct PackedOp
+    {
+        Inst inst;
+        u8  rd;
+        u8  rs1;        // leftVal comes from rs1 (x0 for U and J types)
+        u8  rs2;
+        i32 imm;        // the offset for stores and branches
+    };
+    // Everything Decode() can work out from the instruction word alone.
+    // Register values are not stored, only the register numbers, so an
+    // entry stays valid until the instruction word itself is overwritten.
+    struct DecodedInst : PackedOp
+    {
+        i64 pc;         // address of the instruction, -1 if the entry is empty
+        u32 instruction;
+        Opcodes op;
+        u8  funct3;
+        u8  funct7;
+        bool rightImm;  // rightVal is imm instead of rs2
+    };
 
-    Machine(char* mem, i64 size);
+    // the stack pointer starts at the top of the address space
+    explicit Machine(PagedMemory& mem);
 
     // get and set the program counter
     i64 GetPC() const;
@@ -96,13 +657,132 @@ public:
     ExecuteOut& DebugExecuteOut();
     MemoryOut& DebugMemoryOut();
 
+    // turn the pre-decoded instruction cache on or off (on by default)
+    void SetDecodeCache(bool enabled);
+
+    // The program's code decoded in one pass when it is loaded, one entry
+    // per word from base, as a structure of arrays. A decode cache miss
+    // takes its fields from here instead of decoding the word again, as
+    // long as the word in memory is still the one that was decoded.
+    struct DecodedImage
+    {
+        i64 base;
+        std::vector<u32> words;
+        std::vector<i32> imm;    // the immediate, or the offset for stores and branches
+        std::vector<u8> inst;
+        std::vector<u8> op;
+        std::vector<u8> format;
+        std::vector<u8> rd;
+        std::vector<u8> rs1;
+        std::vector<u8> rs2;
+        std::vector<u8> funct3;
+        std::vector<u8> funct7;
+    };
+    // decode words, starting at address base, into image
+    static void Predecode(i64 base, std::vector<u32> words, DecodedImage& image);
+    // take decode cache misses from image (nullptr to stop), which has to
+    // outlive the machine
+    void SetDecodedImage(const DecodedImage* image);
+
+    // Run fetches, loads and stores through a model of L1I, L1D and L2.
+    // Only the stage, fast and pipeline engines tell it about them.
+    void SetCaches(const Caches::Config& l1i, const Caches::Config& l1d, const Caches::Config& l2);
+    // hits and misses for each cache, and the pcs that missed the most
+    void PrintCacheStats(std::ostream& out) const;
+
+    // Show profiler every instruction retired (nullptr to stop). Only the
+    // stage, fast and pipeline engines do.
+    void SetProfiler(Profiler* profiler);
+
+    // Record every instruction retired in trace (nullptr to stop), starting
+    // with the registers as they are now. Only the stage, fast and pipeline
+    // engines do.
+    void SetTrace(TraceWriter* trace);
+    // Run instruction at the pc the way the fast engine does, if all it
+    // touches is the registers and the pc (ALU instructions, LUI, AUIPC,
+    // jumps and branches), for DecodeTrace to fill in what a trace leaves
+    // out. Returns false without running anything else.
+    bool Replay(u32 instruction);
+
+#if MACHINE_COUNTERS
+    // Count what retires, by instruction and by opcode, ALU command, load
+    // and store width and branch outcome, and ecalls by a7. Only the stage,
+    // fast and pipeline engines count, but ecalls are counted by all.
+    void SetCounters(bool enabled);
+    // the counters as a JSON object, with instret and cycle
+    void WriteCounters(std::ostream& out) const;
+#endif
+
+    // What RunPipelined's cycles went to. Each cycle WriteBack retires an
+    // instruction or a bubble, so cycles = instructions + all the bubbles.
+    struct PipelineStats
+    {
+        i64 cycles;
+        i64 instructions;
+        i64 fill;        // bubbles ahead of the first instruction
+        i64 loadUse;     // the next instruction needed what a load (or AMO or CSR) read
+        i64 data;        // waiting for WriteBack, with forwarding off
+        i64 branch;      // wrong path fetched behind a taken branch or a JALR
+        i64 jump;        // ... behind a JAL
+        i64 branches;    // conditional branches, and how many were taken
+        i64 taken;
+    };
+
+    // Run the loaded program like the stage engine, but time it on a classic
+    // in-order pipeline: a stage per cycle, branches guessed at Fetch by the
+    // predictor, branches and JALR resolved in Execute, JAL in Decode, and a
+    // load-use stall. Returns the number of instructions executed.
+    i64 RunPipelined(i64 endPC);
+    // forward from EX/MEM and MEM/WB into Execute (on by default), without
+    // it instructions wait in Decode until what they read is written back
+    void SetForwarding(bool enabled);
+    // how Fetch guesses branches (not taken, no return stack by default)
+    void SetPredictor(BranchPredictor::Scheme scheme, i32 rasEntries);
+    const PipelineStats& GetPipelineStats() const;
+    // cycles, CPI, where the stalls came from and how the predictor did
+    void PrintPipelineStats(std::ostream& out) const;
+
+    // Run until the program quits or the pc reaches endPC, going straight
+    // from the decoded instruction to its handler instead of through the
+    // five stages. Returns the number of instructions executed.
+    i64 RunFast(i64 endPC);
+
+    // Same as RunFast, but translates straight-line code up to the next
+    // BRANCH, JAL, JALR or SYSTEM into a block once, and jumps from block
+    // to block through links instead of looking the next one up.
+    i64 RunBlocks(i64 endPC);
+
+    // block count, average block length and chain hit rate for RunBlocks
+    void PrintBlockStats(std::ostream& out) const;
+
+    // Let RunBlocks compile a block to x86-64 once it has been entered
+    // threshold times. Does nothing on hosts the JIT doesn't support.
+    void SetJit(bool enabled, i64 threshold = 16);
+
+    // send console output to a string instead of stdout (nullptr for stdout)
+    void CaptureOutput(std::string* to);
+    // take console input from a string instead of stdin (nullptr for stdin)
+    void FeedInput(const std::string* from);
+    // bytes the program has written to the console
+    i64 OutputBytes() const;
+
+    // which hart this is (mhartid), and the harts it can start and join
+    // (nullptr if it can't)
+    void SetHart(i64 id, Harts* harts);
+
 private:
+    // runs the fast core's handlers on machines it holds the registers for
+    friend class Lockstep;
+
     // Read from the internal memory
     // Usage:
     // int  myintval  = memory_read<int>(0);  // Read the first 4 bytes
     // char mycharval = memory_read<char>(8); // Read byte index 8
     template <typename T>
     T MemoryRead(i64 address) const;
+    // MemoryRead for fetching instructions, which the data cache doesn't see
+    template <typename T>
+    T MemoryPeek(i64 address) const;
 
     // Write to the internal memory
     // Usage:
@@ -111,44 +791,672 @@ private:
     template <typename T>
     void MemoryWrite(i64 address, T value);
 
+    // Run an A extension instruction on the T at address, which has to be
+    // aligned, straight on the host with the matching atomic. Returns what
+    // goes in rd.
+    template <typename T>
+    i64 Amo(Inst inst, i64 address, T value);
+
     // sign extend a value with sign bit at index
     i64 SignExtend(u64 value, u32 index) const;
 
-    // decode different instruction types
-    void DecodeR();
-    void DecodeI();
-    void DecodeS();
-    void DecodeB();
-    void DecodeU();
-    void DecodeJ();
+    static const i32 NUM_INSTS = static_cast<i32>(Inst::ILLEGAL) + 1;
+
+    // decode an instruction word into everything but the register values
+    void DecodeInstruction(u32 instruction, DecodedInst& di) const;
+
+    // How the register numbers and the immediate are laid out in a word.
+    // NONE is for major opcodes nothing is implemented under.
+    enum class Format { NONE, R, I, S, B, U, J };
+    // One row of the instruction spec: the bits of a word that pick out
+    // the instruction (mask) and what they have to be (match), its format,
+    // the instruction the fast core runs and the command the stages give
+    // the ALU. The first row a word matches wins.
+    struct InstSpec
+    {
+        u32 mask;
+        u32 match;
+        Opcodes op;
+        Format format;
+        Inst inst;
+        Alu alu;
+    };
+    // What the decode table says about all the words with the same major
+    // opcode, funct3 and funct7. narrow means some row also looks at
+    // other bits, so the rows have to be checked one by one.
+    struct DecodeEntry
+    {
+        u8 inst;
+        u8 op;
+        u8 format;
+        bool narrow;
+    };
+    static const i32 DECODE_KEYS = 1 << 15; // opcode[6:2], funct3 and funct7
+    static const u32 DECODE_KEY_MASK = 0xfe00707c;
+    using DecodeTable = std::array<DecodeEntry, DECODE_KEYS>;
+    using AluTable = std::array<Alu, NUM_INSTS>;
+    static const InstSpec SPECS[];              // defined outside of class
+    static const DecodeTable DECODE_TABLE;
+    static const AluTable INST_ALU;             // the alu of each Inst's row
+
+    static constexpr i32 DecodeKey(u32 instruction);
+    // built at compile time from SPECS
+    static constexpr DecodeTable BuildDecodeTable();
+    static constexpr AluTable BuildInstAlu();
+
+    // the immediate of a format, sign extended
+    template <Format F>
+    static constexpr i64 Immediate(u32 instruction);
+    // fill in the fields of di from di.instruction, one per Format
+    template <Format F>
+    static void DecodeFields(DecodedInst& di);
+    using FieldDecoder = void (*)(DecodedInst& di);
+    static const FieldDecoder FIELD_DECODERS[7]; // by Format
+    // the inst for a word whose decode table entry is narrow
+    static Inst NarrowInst(u32 instruction);
+
+    // fill in di from the decoded image, if it has the word at pc and the
+    // word is still instruction
+    bool Predecoded(i64 pc, u32 instruction, DecodedInst& di) const;
+    // decode the image's words from first on, one at a time
+    static void PredecodeScalar(DecodedImage& image, i64 first);
+#if MACHINE_AVX2
+    // decode the image's words 8 at a time, as far as whole groups of 8
+    // go, and return how many that was
+    static i64 PredecodeAvx2(DecodedImage& image);
+#endif
+
+    // drop cached instructions overlapping [address, address+numBytes)
+    void InvalidateDecodeCache(i64 address, i64 numBytes);
+
+    // Stores only go through the write TLB to pages that hold no decoded
+    // instructions, so stores to code always take the slow path in
+    // MemoryWrite and invalidate what was decoded from it. With guarded
+    // memory the page is made read-only instead and the store faults.
+    void MarkCode(i64 pc);
+
+    // A guarded access faulted. If it ran into the guard it is reported
+    // like any other bad address and this returns false, otherwise it was
+    // a store to code and CodeWritten has to catch up.
+    bool GuardFault(i64 address, i64 numBytes, bool write) const;
+    // A page that faulted once stays writable from then on, so a loop
+    // storing to data next to its code doesn't fault on every store, and
+    // its stores are checked in software like on checked memory.
+    void CodeWritten(i64 address, i64 numBytes);
+    // drop what was decoded or translated from [address, address+numBytes)
+    void CodeStored(i64 address, i64 numBytes);
+    // the store was to a page CodeWritten left writable
+    bool WritableCode(i64 address, i64 numBytes) const
+    {
+        return _writableCode[static_cast<u64>(address) >> PagedMemory::PAGE_BITS]
+               || _writableCode[static_cast<u64>(address + numBytes - 1) >> PagedMemory::PAGE_BITS];
+    }
+
+    // why a pipeline slot holds a bubble
+    enum class Stall { NONE, FILL, LOAD_USE, DATA, BRANCH, JUMP };
+    // An instruction in a pipeline latch, with what each of its stages
+    // produced. Instructions run through the stage functions as they are
+    // fetched, in program order, so a slot carries its results along and
+    // the latches only decide when things happen.
+    struct Slot
+    {
+        bool valid;     // false for a bubble
+        Stall cause;    // ... and where it came from
+        i64 pc;
+        i64 next;       // where it really went
+        i64 predicted;  // where fetch went after it
+        u8 rs1;         // registers it reads, 0 if it doesn't
+        u8 rs2;
+        bool late;      // its result comes out of Memory, not Execute
+        FetchOut fo;
+        DecodeOut dec;
+        ExecuteOut eo;
+        MemoryOut mo;
+    };
+    // fill a slot with the instruction at the pc, run through all five stages
+    bool Issue(Slot& slot);
 
     // perform an operation in the alu
     ExecuteOut ALU(Alu cmd, i64 left, i64 right) const;
 
-    static const Opcodes OC_MAP[4][8]; // defined outside of class
+    // talk to the operating system, returns false when the program quits
+    bool Ecall();
+
+    // read a CSR for one of the CSR instructions, which also writes it
+    // unless it is CSRRS or CSRRC with x0 (or a zero immediate)
+    i64 Csr(u32 csr, bool write);
+
+    // FENCE orders this hart's loads and stores against the other harts'.
+    // FENCE.I also drops everything decoded so far, so code stored since
+    // (by any hart) is seen.
+    void Fence(bool instructions);
+
+    // fast core: decoded instruction at the pc, and one handler per Inst
+    // handlers return false when the program quits
+    using Handler = bool (*)(Machine& m, const PackedOp& op);
+    const DecodedInst& FetchDecoded();
+    i64 RunFastWatched(i64 endPC);
+    void DecodeAt(i64 pc, DecodedInst& di);
+    static const Handler* FastHandlers();
+
+    // Native code for (part of) a block. Runs with the guest registers,
+    // the guest memory, the pc to update and the machine for helper calls,
+    // and returns how many instructions it retired.
+    using JitFn = i64 (*)(i64* regs, i64* pc, Machine* m);
+
+    // a run of instructions that ends at the first BRANCH, JAL, JALR or SYSTEM
+    struct Block
+    {
+        i64 pc;                       // where the block starts
+        std::vector<PackedOp> ops;    // the instructions, in order
+        std::vector<DecodedInst> insts; // ... in full, for the JIT
+        bool indirect;                // ends in JALR, so exits are learned as we go
+        i64 exitPC[2];                // where the block can go next (-1 if nowhere)
+        Block* exit[2];               // the block at exitPC once it has been looked up
+        i64 runs;                     // times entered, to find hot blocks
+        JitFn jit;                    // native code for the first jitOps ops, or nullptr
+        i64 jitOps;
+    };
+    struct BlockStats
+    {
+        i64 translated;   // blocks built, including ones since flushed
+        i64 translatedOps;
+        i64 entered;      // times any block started running
+        i64 chained;      // ... of those, how many came through a link
+        i64 flushes;
+        i64 dropped;      // blocks dropped on their own because a store hit them
+    };
+    Block* TranslateBlock(i64 endPC);
+    // a store hit code: queue up the blocks translated from the bytes it
+    // wrote, if there are any, for the dispatcher to drop
+    void StaleBlocks(i64 address, i64 numBytes);
+    // drop the stale blocks, or all of them if _flushAllBlocks is set
+    void FlushBlocks();
+
+    // translate as much of the block as the JIT knows to x86-64
+    void CompileBlock(Block& block);
+    // stores from JIT code go through here, returns true if blocks must be flushed
+    static bool JitStore(Machine* m, i64 address, i64 value, i32 numBytes);
+    // loads that miss the TLB in JIT code, inst says which load it is
+    static i64 JitLoad(Machine* m, i64 address, i32 inst);
+
     static const i32 NUM_REGS = 32; // 32 registers
+    static const i64 DECODE_CACHE_SIZE = 1 << 14; // entries, direct mapped by pc
+    static const i32 TLB_SIZE = 64; // entries in each TLB, direct mapped by page
+    static const i64 MAX_BLOCK_OPS = 64;
+    static const i64 JIT_BUFFER_SIZE = 4 << 20;
+
+#if MACHINE_COUNTERS
+    struct Counters
+    {
+        bool enabled;
+        i64 insts[NUM_INSTS];      // retired, by instruction
+        i64 taken;                 // conditional branches that went somewhere
+        i64 notTaken;              // other than the next instruction, and the rest
+        std::map<i64, i64> ecalls; // by a7
+    };
+    // inst retired, and the pc went somewhere other than the next instruction
+    void Count(Inst inst, bool jumped);
+#endif
+    // the instruction at pc retired, which was op, and the pc is where it went
+    void Trace(i64 pc, u32 instruction, Opcodes op);
 
-    char* _memory;       // The memory
-    i64 _memorySize;     // The size of the memory (should be MEM_SIZE)
-    i64 _pc;             // The program counter
-    i64 _regs[NUM_REGS]; // The register file
+    PagedMemory* _memory; // The memory
+    i64 _memorySize;      // The size of the address space
+    char* _flat;          // guarded memory on the host, or nullptr
+    u64 _flatLimit;       // addresses below this go straight to _flat
+
+    // host-side TLBs in front of the page table: page number -> host page
+    struct TlbEntry
+    {
+        u64 page; // -1 if empty
+        char* host;
+    };
+    mutable TlbEntry _readTlb[TLB_SIZE];
+    TlbEntry _writeTlb[TLB_SIZE];
+    std::unordered_set<u64> _codePages; // pages instructions were decoded from
+    u64 _lastCodePage;                  // the page MarkCode saw last
+    // guarded memory: 1 for each code page left writable after a store
+    // to it faulted, empty until the first one
+    std::vector<u8> _writableCode;
+    // what every instruction touches, on one cache line of its own and
+    // the next four for the registers
+    struct alignas(64) Context
+    {
+        i64 regs[NUM_REGS]; // The register file
+        i64 pc;             // The program counter
+        // instructions retired, for the instret CSR. The engines that run
+        // instructions in a loop store their count here before each one.
+        i64 instret;
+    };
+    Context _ctx;
 
     FetchOut _FO; // Result of the fetch() method
     DecodeOut _DO; // Result of the decode() method
     ExecuteOut _EO; // Result of the execute() method
     MemoryOut _MO;
+
+    bool _decodeCacheEnabled;
+    std::vector<DecodedInst> _decodeCache;
+    DecodedInst _uncached; // used by the fast core when the cache is off
+    const DecodedImage* _image; // nullptr unless SetDecodedImage was called
+
+    std::unordered_map<i64, std::unique_ptr<Block>> _blocks; // by starting pc
+    bool _flushBlocks;          // blocks have to be dropped before running on
+    bool _flushAllBlocks;       // ... all of them, not just _staleBlocks
+    std::vector<i64> _staleBlocks; // starting pcs of blocks a store wrote over
+    // page -> the words on it some block was translated from
+    std::unordered_map<u64, std::bitset<PagedMemory::PAGE_SIZE / 4>> _translatedWords;
+    BlockStats _blockStats;
+
+    bool _jitEnabled;
+    i64 _jitThreshold;
+    std::unique_ptr<CodeBuffer> _jitCode; // made the first time something is compiled
+
+    bool _forwarding;
+    PipelineStats _pipelineStats;
+    std::unique_ptr<BranchPredictor> _predictor; // made by RunPipelined if not set
+    std::unique_ptr<Caches> _caches;             // nullptr unless SetCaches was called
+    Profiler* _profiler;                         // nullptr unless SetProfiler was called
+    TraceWriter* _trace;                         // nullptr unless SetTrace was called
+
+    Console _console;
+
+    // LR's reservation. SC succeeds if memory still holds what LR read,
+    // swapping with a compare-and-swap, so harts never wait on each other
+    // (it can't tell if someone stored the same value in between, which
+    // lock-free code built on LR/SC doesn't care about).
+    i64 _reservedAt; // -1 if there is none
+    i64 _reservedBytes;
+    i64 _reservedValue;
+
+    i64 _hartId;
+    Harts* _harts;
+
+#if MACHINE_COUNTERS
+    Counters _counters;
+#endif
+};
+
+// STAGE runs every instruction through Fetch/Decode/Execute/Memory/WriteBack
+// and is the reference, FAST dispatches each instruction straight to a handler,
+// BLOCK runs translated basic blocks, JIT also compiles hot blocks to x86-64
+// LOCKSTEP runs instances of one program side by side (see Lockstep), and
+// PIPELINE is STAGE timed on an in-order pipeline
+enum Engine { STAGE, FAST, BLOCK, JIT, LOCKSTEP, PIPELINE };
+
+// The secondary harts of a program, each a Machine on its own host thread
+// sharing hart 0's memory. Guest code starts and joins them with ecalls.
+class Harts
+{
+public:
+    // up to maxHarts harts, counting hart 0, which main() runs itself
+    Harts(PagedMemory& memory, Engine engine, i64 endPC, bool decodeCache, i64 maxHarts);
+    ~Harts(); // waits for the harts still running
+    Harts(const Harts&) = delete;
+    Harts& operator=(const Harts&) = delete;
+
+    // Start a hart at pc with sp and a0 = arg, and ra = endPC, so returning
+    // from the function it starts in stops it. Returns its id, or -1 if
+    // there are already maxHarts.
+    i64 Start(i64 pc, i64 sp, i64 arg);
+    // wait for hart id to stop, returns its a0 or -1 if there is no such hart
+    // (or it has already been joined)
+    i64 Join(i64 id);
+    // the decoded image harts started from now on decode from
+    void SetDecodedImage(const Machine::DecodedImage* image);
+
+    // wait for every hart to stop and print how many instructions each ran
+    void PrintStats(std::ostream& out);
+    // wait for every hart to stop, returns the instructions they ran between them
+    i64 Instructions();
+
+private:
+    struct Hart
+    {
+        std::unique_ptr<Machine> machine; // dropped when it stops, flushing its output
+        std::thread thread;
+        i64 instructions;
+        i64 result; // a0 when it stopped
+        bool stopped;
+        bool joined;
+    };
+
+    PagedMemory* _memory;
+    Engine _engine;
+    i64 _endPC;
+    bool _decodeCache;
+    const Machine::DecodedImage* _image;
+    i64 _maxHarts;
+    std::vector<std::unique_ptr<Hart>> _harts; // hart 1 first
+    std::mutex _lock; // guards _harts and everything in them but the machine
+    std::condition_variable _stopped;
+
+    void WaitForAll(std::unique_lock<std::mutex>& lock);
+};
+
+// Runs up to LANES machines with the same program as one, while they are
+// at the same pc. Each instruction is decoded once, and ALU instructions
+// run for every lane at once on registers kept lane by lane, through
+// kernels the compiler turns into AVX2 or AVX-512 code. Anything else goes
+// through the fast core's handler once per lane, with that lane's memory.
+// When a branch or JALR sends lanes different ways they split into groups,
+// and the group with the lowest pc runs next so they catch up and merge.
+// The code is decoded from the first lane's memory, so programs that
+// change their own code differently in different lanes need another engine.
+class Lockstep
+{
+public:
+    static const i32 LANES = 8;
+
+    // up to LANES machines, set up to run the same program from the same pc
+    explicit Lockstep(const std::vector<Machine*>& machines);
+
+    // Run every machine until it quits or the pc reaches endPC. Returns the
+    // instructions each one ran.
+    std::vector<i64> Run(i64 endPC);
+
+private:
+    // lanes at the same pc, with their registers side by side
+    struct Group
+    {
+        i64 pc;
+        i32 count;         // lanes in use
+        i32 lane[LANES];   // the machine in each column
+        i64 steps;         // instructions since lanes last joined or left
+        alignas(64) i64 regs[32][LANES];
+    };
+
+    // out[i] = left[i] cmd right[i] for every lane, the way the fast core
+    // does it (shifts use the low 6 bits of right, arithmetic wraps). The
+    // loops are written for the vectorizer: 8 lanes are one AVX-512 or two
+    // AVX2 registers when built with -march=native
+    static void AluLanes(Machine::Alu cmd, const i64* __restrict left, const i64* __restrict right,
+                         i64* __restrict out);
+
+    // run one group up to the next instruction that can change the pc
+    void Step(Group& group, i64 endPC);
+    // one instruction through the handler, for each lane
+    void Scalar(Group& group, const Machine::DecodedInst& di, i64* next);
+    // Regroup lanes by where they go next, dropping any with next == -1.
+    // Returns true if they all go to the same place, which is the usual case.
+    bool Split(Group& group, const i64* next);
+    // credit the group's lanes with its steps
+    void Retire(Group& group);
+    // hand registers and the pc back to a lane's machine
+    void Unload(const Group& group, i32 column, i64 pc);
+
+    std::vector<Machine*> _machines;
+    std::vector<i64> _instructions;
+    std::vector<std::unique_ptr<Group>> _groups;
+};
+
+// The instruction spec, which the decode table is built from. Adding an
+// instruction is adding a row (and an Inst and its handler).
+constexpr Machine::InstSpec Machine::SPECS[] = {
+    // mask       match       op         format     inst              alu
+    { 0x0000707f, 0x00000003, LOAD,      Format::I, Inst::LB,         ADD   },
+    { 0x0000707f, 0x00001003, LOAD,      Format::I, Inst::LH,         ADD   },
+    { 0x0000707f, 0x00002003, LOAD,      Format::I, Inst::LW,         ADD   },
+    { 0x0000707f, 0x00003003, LOAD,      Format::I, Inst::LD,         ADD   },
+    { 0x0000707f, 0x00004003, LOAD,      Format::I, Inst::LBU,        ADD   },
+    { 0x0000707f, 0x00005003, LOAD,      Format::I, Inst::LHU,        ADD   },
+    { 0x0000707f, 0x00006003, LOAD,      Format::I, Inst::LWU,        ADD   },
+
+    { 0x0000707f, 0x00000023, STORE,     Format::S, Inst::SB,         ADD   },
+    { 0x0000707f, 0x00001023, STORE,     Format::S, Inst::SH,         ADD   },
+    { 0x0000707f, 0x00002023, STORE,     Format::S, Inst::SW,         ADD   },
+    { 0x0000707f, 0x00003023, STORE,     Format::S, Inst::SD,         ADD   },
+
+    { 0x0000707f, 0x00000063, BRANCH,    Format::B, Inst::BEQ,        SUB   },
+    { 0x0000707f, 0x00001063, BRANCH,    Format::B, Inst::BNE,        SUB   },
+    { 0x0000707f, 0x00004063, BRANCH,    Format::B, Inst::BLT,        SUB   },
+    { 0x0000707f, 0x00005063, BRANCH,    Format::B, Inst::BGE,        SUB   },
+    { 0x0000707f, 0x00006063, BRANCH,    Format::B, Inst::BLTU,       SUB   },
+    { 0x0000707f, 0x00007063, BRANCH,    Format::B, Inst::BGEU,       SUB   },
+
+    { 0x0000007f, 0x00000067, JALR,      Format::I, Inst::JALR,       ADD   },
+    { 0x0000007f, 0x0000006f, JAL,       Format::J, Inst::JAL,        ADD   },
+    { 0x0000007f, 0x00000017, AUIPC,     Format::U, Inst::AUIPC,      ADD   },
+    { 0x0000007f, 0x00000037, LUI,       Format::U, Inst::LUI,        ADD   },
+
+    // Zba, Zbb and Zbs, ahead of the base shifts whose masks would take
+    // the immediate forms. rs1 is the one that is zero extended in .uw.
+    { 0xfe00707f, 0x20002033, OP,        Format::R, Inst::SH1ADD,     SH1ADD },
+    { 0xfe00707f, 0x20004033, OP,        Format::R, Inst::SH2ADD,     SH2ADD },
+    { 0xfe00707f, 0x20006033, OP,        Format::R, Inst::SH3ADD,     SH3ADD },
+    { 0xfe00707f, 0x0800003b, OP_32,     Format::R, Inst::ADD_UW,     ADD   },
+    { 0xfe00707f, 0x2000203b, OP_32,     Format::R, Inst::SH1ADD_UW,  SH1ADD },
+    { 0xfe00707f, 0x2000403b, OP_32,     Format::R, Inst::SH2ADD_UW,  SH2ADD },
+    { 0xfe00707f, 0x2000603b, OP_32,     Format::R, Inst::SH3ADD_UW,  SH3ADD },
+    { 0xfc00707f, 0x0800101b, OP_IMM_32, Format::I, Inst::SLLI_UW,    SLL   },
+    { 0xfe00707f, 0x40007033, OP,        Format::R, Inst::ANDN,       ANDN  },
+    { 0xfe00707f, 0x40006033, OP,        Format::R, Inst::ORN,        ORN   },
+    { 0xfe00707f, 0x40004033, OP,        Format::R, Inst::XNOR,       XNOR  },
+    { 0xfff0707f, 0x60001013, OP_IMM,    Format::I, Inst::CLZ,        CLZ   },
+    { 0xfff0707f, 0x6000101b, OP_IMM_32, Format::I, Inst::CLZW,       CLZW  },
+    { 0xfff0707f, 0x60101013, OP_IMM,    Format::I, Inst::CTZ,        CTZ   },
+    { 0xfff0707f, 0x6010101b, OP_IMM_32, Format::I, Inst::CTZW,       CTZW  },
+    { 0xfff0707f, 0x60201013, OP_IMM,    Format::I, Inst::CPOP,       CPOP  },
+    { 0xfff0707f, 0x6020101b, OP_IMM_32, Format::I, Inst::CPOPW,      CPOP  },
+    { 0xfe00707f, 0x0a006033, OP,        Format::R, Inst::MAX,        MAX   },
+    { 0xfe00707f, 0x0a007033, OP,        Format::R, Inst::MAXU,       MAXU  },
+    { 0xfe00707f, 0x0a004033, OP,        Format::R, Inst::MIN,        MIN   },
+    { 0xfe00707f, 0x0a005033, OP,        Format::R, Inst::MINU,       MINU  },
+    { 0xfff0707f, 0x60401013, OP_IMM,    Format::I, Inst::SEXT_B,     SEXT_B },
+    { 0xfff0707f, 0x60501013, OP_IMM,    Format::I, Inst::SEXT_H,     SEXT_H },
+    { 0xfff0707f, 0x0800403b, OP_32,     Format::R, Inst::ZEXT_H,     ZEXT_H },
+    { 0xfe00707f, 0x60001033, OP,        Format::R, Inst::ROL,        ROL   },
+    { 0xfe00707f, 0x6000103b, OP_32,     Format::R, Inst::ROLW,       ROLW  },
+    { 0xfe00707f, 0x60005033, OP,        Format::R, Inst::ROR,        ROR   },
+    { 0xfc00707f, 0x60005013, OP_IMM,    Format::I, Inst::RORI,       ROR   },
+    { 0xfe00707f, 0x6000501b, OP_IMM_32, Format::I, Inst::RORIW,      RORW  },
+    { 0xfe00707f, 0x6000503b, OP_32,     Format::R, Inst::RORW,       RORW  },
+    { 0xfff0707f, 0x28705013, OP_IMM,    Format::I, Inst::ORC_B,      ORC_B },
+    { 0xfff0707f, 0x6b805013, OP_IMM,    Format::I, Inst::REV8,       REV8  },
+    { 0xfe00707f, 0x48001033, OP,        Format::R, Inst::BCLR,       BCLR  },
+    { 0xfc00707f, 0x48001013, OP_IMM,    Format::I, Inst::BCLRI,      BCLR  },
+    { 0xfe00707f, 0x48005033, OP,        Format::R, Inst::BEXT,       BEXT  },
+    { 0xfc00707f, 0x48005013, OP_IMM,    Format::I, Inst::BEXTI,      BEXT  },
+    { 0xfe00707f, 0x68001033, OP,        Format::R, Inst::BINV,       BINV  },
+    { 0xfc00707f, 0x68001013, OP_IMM,    Format::I, Inst::BINVI,      BINV  },
+    { 0xfe00707f, 0x28001033, OP,        Format::R, Inst::BSET,       BSET  },
+    { 0xfc00707f, 0x28001013, OP_IMM,    Format::I, Inst::BSETI,      BSET  },
+
+    { 0x0000707f, 0x00000013, OP_IMM,    Format::I, Inst::ADDI,       ADD   },
+    { 0x0000707f, 0x00001013, OP_IMM,    Format::I, Inst::SLLI,       SLL   },
+    { 0x0000707f, 0x00002013, OP_IMM,    Format::I, Inst::SLTI,       SLT   },
+    { 0x0000707f, 0x00003013, OP_IMM,    Format::I, Inst::SLTIU,      SLTU  },
+    { 0x0000707f, 0x00004013, OP_IMM,    Format::I, Inst::XORI,       XOR   },
+    // bit 30 of the immediate picks SRAI
+    { 0x4000707f, 0x40005013, OP_IMM,    Format::I, Inst::SRAI,       SRA   },
+    { 0x0000707f, 0x00005013, OP_IMM,    Format::I, Inst::SRLI,       SRL   },
+    { 0x0000707f, 0x00006013, OP_IMM,    Format::I, Inst::ORI,        OR    },
+    { 0x0000707f, 0x00007013, OP_IMM,    Format::I, Inst::ANDI,       AND   },
+
+    { 0xfe00707f, 0x00000033, OP,        Format::R, Inst::ADD,        ADD   },
+    { 0xfe00707f, 0x00001033, OP,        Format::R, Inst::SLL,        SLL   },
+    { 0xfe00707f, 0x00002033, OP,        Format::R, Inst::SLT,        SLT   },
+    { 0xfe00707f, 0x00003033, OP,        Format::R, Inst::SLTU,       SLTU  },
+    { 0xfe00707f, 0x00004033, OP,        Format::R, Inst::XOR,        XOR   },
+    { 0xfe00707f, 0x00005033, OP,        Format::R, Inst::SRL,        SRL   },
+    { 0xfe00707f, 0x00006033, OP,        Format::R, Inst::OR,         OR    },
+    { 0xfe00707f, 0x00007033, OP,        Format::R, Inst::AND,        AND   },
+    { 0xfe00707f, 0x40000033, OP,        Format::R, Inst::SUB,        SUB   },
+    { 0xfe00707f, 0x40005033, OP,        Format::R, Inst::SRA,        SRA   },
+    { 0xfe00707f, 0x02000033, OP,        Format::R, Inst::MUL,        MUL   },
+    { 0xfe00707f, 0x02001033, OP,        Format::R, Inst::MULH,       MULH  },
+    { 0xfe00707f, 0x02002033, OP,        Format::R, Inst::MULHSU,     MULHSU },
+    { 0xfe00707f, 0x02003033, OP,        Format::R, Inst::MULHU,      MULHU },
+    { 0xfe00707f, 0x02004033, OP,        Format::R, Inst::DIV,        DIV   },
+    { 0xfe00707f, 0x02005033, OP,        Format::R, Inst::DIVU,       DIVU  },
+    { 0xfe00707f, 0x02006033, OP,        Format::R, Inst::REM,        REM   },
+    { 0xfe00707f, 0x02007033, OP,        Format::R, Inst::REMU,       REMU  },
+
+    { 0x0000707f, 0x0000001b, OP_IMM_32, Format::I, Inst::ADDIW,      ADD   },
+    { 0x0000707f, 0x0000101b, OP_IMM_32, Format::I, Inst::SLLIW,      SLL   },
+    // bit 30 of the immediate picks SRAIW
+    { 0x4000707f, 0x4000501b, OP_IMM_32, Format::I, Inst::SRAIW,      SRA   },
+    { 0x0000707f, 0x0000501b, OP_IMM_32, Format::I, Inst::SRLIW,      SRL   },
+
+    { 0xfe00707f, 0x0000003b, OP_32,     Format::R, Inst::ADDW,       ADD   },
+    { 0xfe00707f, 0x0000103b, OP_32,     Format::R, Inst::SLLW,       SLL   },
+    { 0xfe00707f, 0x0000503b, OP_32,     Format::R, Inst::SRLW,       SRL   },
+    { 0xfe00707f, 0x4000003b, OP_32,     Format::R, Inst::SUBW,       SUB   },
+    { 0xfe00707f, 0x4000503b, OP_32,     Format::R, Inst::SRAW,       SRA   },
+    { 0xfe00707f, 0x0200003b, OP_32,     Format::R, Inst::MULW,       MUL   },
+    { 0xfe00707f, 0x0200403b, OP_32,     Format::R, Inst::DIVW,       DIV   },
+    { 0xfe00707f, 0x0200503b, OP_32,     Format::R, Inst::DIVUW,      DIVU  },
+    { 0xfe00707f, 0x0200603b, OP_32,     Format::R, Inst::REMW,       REM   },
+    { 0xfe00707f, 0x0200703b, OP_32,     Format::R, Inst::REMUW,      REMU  },
+
+    // funct3 0 is ecall (ebreak and the rest are treated the same)
+    { 0x0000707f, 0x00000073, SYSTEM,    Format::I, Inst::ECALL,      NO_OP },
+    { 0x0000707f, 0x00001073, SYSTEM,    Format::I, Inst::CSRRW,      NO_OP },
+    { 0x0000707f, 0x00002073, SYSTEM,    Format::I, Inst::CSRRS,      NO_OP },
+    { 0x0000707f, 0x00003073, SYSTEM,    Format::I, Inst::CSRRC,      NO_OP },
+    { 0x0000707f, 0x00005073, SYSTEM,    Format::I, Inst::CSRRWI,     NO_OP },
+    { 0x0000707f, 0x00006073, SYSTEM,    Format::I, Inst::CSRRSI,     NO_OP },
+    { 0x0000707f, 0x00007073, SYSTEM,    Format::I, Inst::CSRRCI,     NO_OP },
+
+    // pause is the fence that only orders earlier stores
+    { 0xffffffff, 0x0100000f, MISC_MEM,  Format::I, Inst::PAUSE,      NO_OP },
+    { 0x0000707f, 0x0000000f, MISC_MEM,  Format::I, Inst::FENCE,      NO_OP },
+    { 0x0000707f, 0x0000100f, MISC_MEM,  Format::I, Inst::FENCE_I,    NO_OP },
+
+    // picked by funct5, the aq and rl bits below it don't matter since
+    // every atomic is sequentially consistent anyway, and lr has no rs2
+    { 0xf9f0707f, 0x1000202f, AMO,       Format::R, Inst::LR_W,       NO_OP },
+    { 0xf800707f, 0x1800202f, AMO,       Format::R, Inst::SC_W,       NO_OP },
+    { 0xf800707f, 0x0800202f, AMO,       Format::R, Inst::AMOSWAP_W,  NO_OP },
+    { 0xf800707f, 0x0000202f, AMO,       Format::R, Inst::AMOADD_W,   NO_OP },
+    { 0xf800707f, 0x2000202f, AMO,       Format::R, Inst::AMOXOR_W,   NO_OP },
+    { 0xf800707f, 0x6000202f, AMO,       Format::R, Inst::AMOAND_W,   NO_OP },
+    { 0xf800707f, 0x4000202f, AMO,       Format::R, Inst::AMOOR_W,    NO_OP },
+    { 0xf800707f, 0x8000202f, AMO,       Format::R, Inst::AMOMIN_W,   NO_OP },
+    { 0xf800707f, 0xa000202f, AMO,       Format::R, Inst::AMOMAX_W,   NO_OP },
+    { 0xf800707f, 0xc000202f, AMO,       Format::R, Inst::AMOMINU_W,  NO_OP },
+    { 0xf800707f, 0xe000202f, AMO,       Format::R, Inst::AMOMAXU_W,  NO_OP },
+    { 0xf9f0707f, 0x1000302f, AMO,       Format::R, Inst::LR_D,       NO_OP },
+    { 0xf800707f, 0x1800302f, AMO,       Format::R, Inst::SC_D,       NO_OP },
+    { 0xf800707f, 0x0800302f, AMO,       Format::R, Inst::AMOSWAP_D,  NO_OP },
+    { 0xf800707f, 0x0000302f, AMO,       Format::R, Inst::AMOADD_D,   NO_OP },
+    { 0xf800707f, 0x2000302f, AMO,       Format::R, Inst::AMOXOR_D,   NO_OP },
+    { 0xf800707f, 0x6000302f, AMO,       Format::R, Inst::AMOAND_D,   NO_OP },
+    { 0xf800707f, 0x4000302f, AMO,       Format::R, Inst::AMOOR_D,    NO_OP },
+    { 0xf800707f, 0x8000302f, AMO,       Format::R, Inst::AMOMIN_D,   NO_OP },
+    { 0xf800707f, 0xa000302f, AMO,       Format::R, Inst::AMOMAX_D,   NO_OP },
+    { 0xf800707f, 0xc000302f, AMO,       Format::R, Inst::AMOMINU_D,  NO_OP },
+    { 0xf800707f, 0xe000302f, AMO,       Format::R, Inst::AMOMAXU_D,  NO_OP },
 };
 
-// Because OpcodeMap is a static MD array, it has to be defined outside of the class for some reason
-const Machine::Opcodes Machine::OC_MAP[4][8] = {
-    // First row (inst[6:5] = 0b00)
-    { LOAD, UNIMPL, UNIMPL, UNIMPL, OP_IMM, AUIPC, OP_IMM_32, UNIMPL }, 
-    // Second row (inst[6:5] = 0b01)
-    { STORE, UNIMPL, UNIMPL, UNIMPL, OP, LUI, OP_32, UNIMPL },
-    // Third row (inst[6:5] = 0b10)
-    { UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL, UNIMPL },
-    // Fourth row (inst[6:5] = 0b11)
-    { BRANCH, JALR, UNIMPL, JAL, SYSTEM, UNIMPL, UNIMPL, UNIMPL }
+constexpr i32 Machine::DecodeKey(u32 instruction)
+{
+    return static_cast<i32>(((instruction >> 2) & 0x1f) | ((instruction >> 7) & 0xe0) | ((instruction >> 17) & 0x7f00));
+}
+
+constexpr Machine::DecodeTable Machine::BuildDecodeTable()
+{
+    DecodeTable table{};
+    // every key starts out as whatever its major opcode is, but illegal
+    Opcodes ops[32] = {};
+    Format formats[32] = {};
+    for (i32 opcode = 0; opcode < 32; ++opcode)
+    {
+        ops[opcode] = UNIMPL;
+        formats[opcode] = Format::NONE;
+    }
+    for (i32 r = static_cast<i32>(std::size(SPECS)) - 1; r >= 0; --r)
+    {
+        ops[(SPECS[r].match >> 2) & 0x1f] = SPECS[r].op;
+        formats[(SPECS[r].match >> 2) & 0x1f] = SPECS[r].format;
+    }
+    for (i32 key = 0; key < DECODE_KEYS; ++key)
+    {
+        table[key].inst = static_cast<u8>(Inst::ILLEGAL);
+        table[key].op = static_cast<u8>(ops[key & 0x1f]);
+        table[key].format = static_cast<u8>(formats[key & 0x1f]);
+        table[key].narrow = false;
+    }
+    // then each row claims the keys it matches, last row first so the
+    // first one wins, going through every setting of the key bits it
+    // doesn't care about
+    for (i32 r = static_cast<i32>(std::size(SPECS)) - 1; r >= 0; --r)
+    {
+        const InstSpec& spec = SPECS[r];
+        i32 match = DecodeKey(spec.match);
+        i32 free = ~DecodeKey(spec.mask) & (DECODE_KEYS - 1);
+        bool narrow = (spec.mask & ~DECODE_KEY_MASK & ~3u) != 0;
+        for (i32 bits = free; ; bits = (bits - 1) & free)
+        {
+            DecodeEntry& entry = table[match | bits];
+            entry.inst = static_cast<u8>(spec.inst);
+            entry.narrow = entry.narrow || narrow;
+            if (bits == 0)
+                break;
+        }
+    }
+    return table;
+}
+
+constexpr Machine::AluTable Machine::BuildInstAlu()
+{
+    AluTable alu{};
+    for (i32 i = 0; i < NUM_INSTS; ++i)
+        alu[i] = NO_OP;
+    for (i32 r = static_cast<i32>(std::size(SPECS)) - 1; r >= 0; --r)
+        alu[static_cast<i32>(SPECS[r].inst)] = SPECS[r].alu;
+    return alu;
+}
+
+constexpr Machine::DecodeTable Machine::DECODE_TABLE = BuildDecodeTable();
+constexpr Machine::AluTable Machine::INST_ALU = BuildInstAlu();
+
+template <Machine::Format F>
+constexpr i64 Machine::Immediate(u32 instruction)
+{
+    // the sign is always bit 31, shifted down to the top of the immediate
+    i32 sign = static_cast<i32>(instruction & 0x8000'0000);
+    switch (F)
+    {
+    case Format::I:
+        return static_cast<i32>(instruction) >> 20;
+    case Format::S:
+        return (sign >> 20) | static_cast<i32>(((instruction >> 20) & 0x7e0) | ((instruction >> 7) & 0x1f));
+    case Format::B:
+        return (sign >> 19) | static_cast<i32>(((instruction << 4) & 0x800) | ((instruction >> 20) & 0x7e0) |
+                                               ((instruction >> 7) & 0x1e));
+    case Format::U:
+        return static_cast<i32>(instruction & 0xffff'f000);
+    case Format::J:
+        return (sign >> 11) | static_cast<i32>((instruction & 0xf'f000) | ((instruction >> 9) & 0x800) |
+                                               ((instruction >> 20) & 0x7fe));
+    default:
+        return 0;
+    }
+}
+
+template <Machine::Format F>
+void Machine::DecodeFields(DecodedInst& di)
+{
+    u32 instruction = di.instruction;
+    // stores and branches have no rd, U and J types read x0 so leftVal is 0
+    bool hasRd  = F == Format::R || F == Format::I || F == Format::U || F == Format::J;
+    bool hasRs1 = F == Format::R || F == Format::I || F == Format::S || F == Format::B;
+    bool hasRs2 = F == Format::R || F == Format::S || F == Format::B;
+    di.rd     = hasRd  ? (instruction >> 7)  & 0x1f : 0;
+    di.funct3 = hasRs1 ? (instruction >> 12) & 0x7 : 0;
+    di.funct7 = F == Format::R ? (instruction >> 25) & 0x3f : 0;
+    di.rs1    = hasRs1 ? (instruction >> 15) & 0x1f : 0;
+    di.rs2    = hasRs2 ? (instruction >> 20) & 0x1f : 0;
+    di.imm    = static_cast<i32>(Immediate<F>(instruction));
+    di.rightImm = !hasRs2;
+}
+
+const Machine::FieldDecoder Machine::FIELD_DECODERS[7] = {
+    &DecodeFields<Format::NONE>, &DecodeFields<Format::R>, &DecodeFields<Format::I>,
+    &DecodeFields<Format::S>, &DecodeFields<Format::B>, &DecodeFields<Format::U>,
+    &DecodeFields<Format::J>
 };
 
 std::ostream& operator<<(std::ostream& out, const Machine::FetchOut& fo) 
@@ -188,6 +1496,10 @@ std::ostream& operator<<(std::ostream& out, const Machine::DecodeOut& dec)
         sout << "JAL"; break;
     case Machine::SYSTEM:
         sout << "SYSTEM"; break;
+    case Machine::MISC_MEM:
+        sout << "MISCMEM"; break;
+    case Machine::AMO:
+        sout << "AMO"; break;
     case Machine::UNIMPL:
         sout << "NOT-IMPLEMENTED"; break;
     default: 
@@ -206,10 +1518,10 @@ std::ostream& operator<<(std::ostream& out, const Machine::ExecuteOut& eo)
 {
     std::ostringstream sout;
     sout << "Result: " << eo.result << " [NZCV]: " 
-        << (u32)eo.n 
-        << (u32)eo.z 
-        << (u32)eo.c
-        << (u32)eo.v;
+        << (u32)eo.N() 
+        << (u32)eo.Z() 
+        << (u32)eo.C()
+        << (u32)eo.V();
     return out << sout.str();
 }
 std::ostream& operator<<(std::ostream& out, const Machine::MemoryOut& mo) 
@@ -219,676 +1531,5793 @@ std::ostream& operator<<(std::ostream& out, const Machine::MemoryOut& mo)
     return out << sout.str();
 }
 
-Machine::Machine(char* mem, i64 size)
-    : _memory(mem), _memorySize(size), _pc(0ll)
+thread_local volatile std::sig_atomic_t PagedMemory::faulted = 0;
+#if MACHINE_GUARD
+std::atomic<PagedMemory*> PagedMemory::s_guarded[MAX_GUARDED];
+thread_local char PagedMemory::s_edge[8];
+thread_local char* PagedMemory::s_edgeAt = nullptr;
+#endif
+
+PagedMemory::PagedMemory(i64 size, bool guarded)
+    : _size((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)), _resident(0), _flat(nullptr)
 {
-    for (i32 i = 0; i < NUM_REGS; ++i)
-        _regs[i] = 0ll;
-    // set the stack pointer to be at the end of memory
-    SetXReg(2, _memorySize);
+#if MACHINE_GUARD
+    if (guarded)
+    {
+        // the handler is installed once, by whichever memory needs it first
+        static const bool installed = []
+        {
+            struct sigaction action = {};
+            action.sa_sigaction = &PagedMemory::GuardHandler;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            return sigaction(SIGSEGV, &action, nullptr) == 0;
+        }();
+
+        // reserve the memory and its guard, then open up the memory part
+        void* base = mmap(nullptr, _size + GUARD_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (installed && base != MAP_FAILED)
+        {
+            // the handler has to be able to find us, or it's checked memory after all
+            _flat = static_cast<char*>(base);
+            mprotect(_flat, _size, PROT_READ | PROT_WRITE);
+            for (std::atomic<PagedMemory*>& slot : s_guarded)
+            {
+                PagedMemory* empty = nullptr;
+                if (slot.compare_exchange_strong(empty, this))
+                    return;
+            }
+            _flat = nullptr;
+        }
+        if (base != MAP_FAILED)
+            munmap(base, _size + GUARD_SIZE);
+    }
+#else
+    (void)guarded;
+#endif
+    i64 pages = _size >> PAGE_BITS;
+    _tables.assign((pages >> TABLE_BITS) + 1, nullptr);
+}
+PagedMemory::~PagedMemory()
+{
+#if MACHINE_GUARD
+    if (_flat != nullptr)
+    {
+        for (std::atomic<PagedMemory*>& slot : s_guarded)
+        {
+            PagedMemory* self = this;
+            if (slot.compare_exchange_strong(self, nullptr))
+                break;
+        }
+        munmap(_flat, _size + GUARD_SIZE);
+    }
+#endif
+    for (char** table : _tables)
+    {
+        if (table == nullptr)
+            continue;
+        for (i64 i = 0; i < (1 << TABLE_BITS); ++i)
+            delete[] table[i];
+        delete[] table;
+    }
 }
 
-i64 Machine::GetPC() const
+i64 PagedMemory::Size() const
 {
-    return _pc;
+    return _size;
 }
-void Machine::SetPC(i64 to)
+i64 PagedMemory::ResidentPages() const
 {
-    _pc = to;
+#if MACHINE_GUARD
+    if (_flat != nullptr)
+    {
+        // the kernel hands out guarded pages on first touch, so ask it
+        // (a mapped program counts as far as it is in the page cache)
+        std::vector<unsigned char> resident(_size >> PAGE_BITS);
+        if (mincore(_flat, _size, resident.data()) != 0)
+            return 0;
+        return std::count_if(resident.begin(), resident.end(),
+                             [](unsigned char r) { return r & 1; });
+    }
+#endif
+    return _resident;
 }
 
-i64  Machine::GetXReg(i32 which) const
+char* PagedMemory::Page(i64 address)
 {
-    which &= 0x1f; // Make sure the register number is 0 - 31
-    return _regs[which];
+    if (address < 0 || address >= _size)
+        return nullptr;
+    if (_flat != nullptr)
+        return _flat + (address & ~(PAGE_SIZE - 1));
+    std::lock_guard<std::mutex> lock(_tablesLock);
+    i64 page = address >> PAGE_BITS;
+    char**& table = _tables[page >> TABLE_BITS];
+    if (table == nullptr)
+        table = new char*[1 << TABLE_BITS]();
+    char*& host = table[page & ((1 << TABLE_BITS) - 1)];
+    if (host == nullptr)
+    {
+        host = new char[PAGE_SIZE](); // zero filled
+        ++_resident;
+    }
+    return host;
 }
-void Machine::SetXReg(i32 which, i64 value)
+const char* PagedMemory::Peek(i64 page) const
 {
-    which &= 0x1f; // Make sure the register number is 0 - 31
-    _regs[which] = value;
-    _regs[0] = 0; // make sure zero is 0
+    if (_flat != nullptr)
+        return _flat + (page << PAGE_BITS);
+    const char* const* table = _tables[page >> TABLE_BITS];
+    return table != nullptr ? table[page & ((1 << TABLE_BITS) - 1)] : nullptr;
 }
 
-void Machine::Fetch()
+void PagedMemory::Write(i64 address, const char* data, i64 numBytes)
 {
-    // read the instruction at the program counter memory address
-    _FO.instruction = MemoryRead<u32>(_pc);
+    // one page at a time, since neighbouring pages aren't next to each other on the host
+    while (numBytes > 0)
+    {
+        i64 offset = address & (PAGE_SIZE - 1);
+        i64 chunk = std::min(numBytes, PAGE_SIZE - offset);
+        char* host = Page(address);
+        if (host == nullptr)
+            return;
+        std::memcpy(host + offset, data, chunk);
+        address += chunk;
+        data += chunk;
+        numBytes -= chunk;
+    }
 }
-void Machine::Decode() 
+void PagedMemory::Read(i64 address, char* data, i64 numBytes)
 {
-    u8 OpcodeMapRow = (_FO.instruction >> 5) & 0b11;
-    u8 OpcodeMapCol = (_FO.instruction >> 2) & 0b111;
-    u8 InstSize     =  _FO.instruction & 0b11;
-    if (InstSize != 3) 
+    while (numBytes > 0)
     {
-        std::cerr << "[DECODE] Invalid instruction (not a 32-bit instruction).\n";
-        return;
+        i64 offset = address & (PAGE_SIZE - 1);
+        i64 chunk = std::min(numBytes, PAGE_SIZE - offset);
+        char* host = Page(address);
+        if (host == nullptr)
+            return;
+        std::memcpy(data, host + offset, chunk);
+        address += chunk;
+        data += chunk;
+        numBytes -= chunk;
     }
+}
 
-    _DO.op = Machine::OC_MAP[OpcodeMapRow][OpcodeMapCol];
-    // Decode the rest of _DO based on the instruction type
-    switch (_DO.op)
+i64 PagedMemory::FirstDifference(const PagedMemory& other) const
+{
+    static const char ZERO_PAGE[PAGE_SIZE] = {};
+    i64 pages = std::min(_size, other._size) >> PAGE_BITS;
+    for (i64 page = 0; page < pages; ++page)
     {
-    case LOAD:
-    case JALR:
-    case OP_IMM:
-    case OP_IMM_32:
-    case SYSTEM:
-        DecodeI();
-        break;
-    case STORE:
-        DecodeS();
-        break;
-    case BRANCH:
-        DecodeB();
-        break;
-    case JAL:
-        DecodeJ();
-        break;
-    case AUIPC:
-    case LUI:
-        DecodeU();
-        break;
-    case OP:
-    case OP_32:
-        DecodeR();
-        break;
-    default:
-        std::cerr << "Invalid op type: " << _DO.op << '\n';
-        break;
+        // untouched pages are all zero
+        const char* mine   = Peek(page);
+        const char* theirs = other.Peek(page);
+        if (mine == theirs)
+            continue;
+        mine   = mine   != nullptr ? mine   : ZERO_PAGE;
+        theirs = theirs != nullptr ? theirs : ZERO_PAGE;
+        for (i64 i = 0; i < PAGE_SIZE; ++i)
+            if (mine[i] != theirs[i])
+                return (page << PAGE_BITS) + i;
     }
+    return _size == other._size ? -1 : pages << PAGE_BITS;
 }
-void Machine::Execute() 
+
+char* PagedMemory::Flat() const
 {
-    // to grab Commands and Opcodes enums
-    Alu cmd = NO_OP;
+    return _flat;
+}
 
-    // Most instructions will follow left/right
-    // but some won't, so we need these:
-    i64 opLeft  = _DO.leftVal;
-    i64 opRight = _DO.rightVal; 
+void PagedMemory::Protect(i64 address, bool readOnly)
+{
+#if MACHINE_GUARD
+    if (_flat != nullptr && address >= 0 && address < _size)
+        mprotect(Page(address), PAGE_SIZE, readOnly ? PROT_READ : PROT_READ | PROT_WRITE);
+#else
+    (void)address;
+    (void)readOnly;
+#endif
+}
+void PagedMemory::Reguard(i64 address, i64 numBytes)
+{
+#if MACHINE_GUARD
+    // a store that ran off the end doesn't get to change what was before it
+    if (_flat != nullptr && s_edgeAt == _flat + _size - sizeof(s_edge))
+    {
+        std::memcpy(s_edgeAt, s_edge, sizeof(s_edge));
+        s_edgeAt = nullptr;
+    }
+    // only the part past the end of memory is guard
+    i64 first = std::max(address, _size) & ~(PAGE_SIZE - 1);
+    i64 end = std::min(address + numBytes, _size + GUARD_SIZE);
+    for (i64 page = first; _flat != nullptr && page < end; page += PAGE_SIZE)
+    {
+        // drop whatever was stored there so the next fault starts from zero
+        madvise(_flat + page, PAGE_SIZE, MADV_DONTNEED);
+        mprotect(_flat + page, PAGE_SIZE, PROT_NONE);
+    }
+#else
+    (void)address;
+    (void)numBytes;
+#endif
+}
 
-    switch (_DO.op)
+bool PagedMemory::MapFile(i64 address, int fd, i64 offset, i64 numBytes)
+{
+#if MACHINE_GUARD
+    i64 slack = address & (PAGE_SIZE - 1); // mmap works in whole pages
+    if (_flat == nullptr || address < 0 || offset < 0 || (offset & (PAGE_SIZE - 1)) != slack
+        || numBytes > _size - address)
+        return false;
+    if (numBytes == 0)
+        return true;
+    char* start = _flat + address - slack;
+    i64 length = numBytes + slack;
+    void* at = mmap(start, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset - slack);
+    if (at == MAP_FAILED)
     {
-    case BRANCH: // BEQ, BNE, BLT, BGE
-        cmd = SUB; 
-        break;
+        // a failed MAP_FIXED can leave a hole, so put plain memory back
+        mmap(start, length, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        return false;
+    }
 
-    case JALR: // JALR
-        // offset and a register value need to be added together
-        cmd = ADD;
-        break; 
-    
-    case JAL: // JAL
-        opLeft = _pc;
-        cmd = ADD;
-        break;
+    // The first and last pages can hold bits of the file from either side,
+    // which aren't part of this piece. Only copy the page if they aren't zero.
+    char* end = _flat + address + numBytes;
+    char* pageEnd = _flat + std::min(_size, (address + numBytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    auto zero = [](char* from, char* to)
+    {
+        if (std::any_of(from, to, [](char c) { return c != 0; }))
+            std::fill(from, to, 0);
+    };
+    zero(start, _flat + address);
+    zero(end, pageEnd);
+    return true;
+#else
+    (void)address;
+    (void)fd;
+    (void)offset;
+    (void)numBytes;
+    return false;
+#endif
+}
 
-    case AUIPC: // AUIPC
-        opLeft = _pc;
-        cmd = ADD; 
-        break;
+#if MACHINE_GUARD
+void PagedMemory::GuardHandler(int sig, siginfo_t* info, void* context)
+{
+    (void)context;
+    char* host = static_cast<char*>(info->si_addr);
+    for (std::atomic<PagedMemory*>& slot : s_guarded)
+    {
+        PagedMemory* mem = slot.load();
+        if (mem == nullptr || host < mem->_flat || host >= mem->_flat + mem->_size + GUARD_SIZE)
+            continue;
+        // open the page up and let the access run again, the machine checks
+        // faulted straight after and undoes it
+        char* page = mem->_flat + ((host - mem->_flat) & ~(PAGE_SIZE - 1));
+        if (page == mem->_flat + mem->_size)
+        {
+            s_edgeAt = page - sizeof(s_edge);
+            std::memcpy(s_edge, s_edgeAt, sizeof(s_edge));
+        }
+        mprotect(page, PAGE_SIZE, PROT_READ | PROT_WRITE);
+        faulted = 1;
+        return;
+    }
+    // not guest memory, so a real crash: let it happen the usual way
+    signal(sig, SIG_DFL);
+}
+#endif
 
-    case LUI: // LUI
-        cmd = ADD;
-        break;
+Console::Console()
+    : _buffer(BUFFER_SIZE), _used(0), _capture(nullptr), _bytesOut(0), 
+      _input(nullptr), _inputAt(0)
+{
+}
+Console::~Console()
+{
+    Flush();
+}
 
-    case LOAD: // LB, LH, LW, LD, LBU, LHU, LWU
-        cmd = ADD;
-        break;
+void Console::Capture(std::string* to)
+{
+    Flush();
+    _capture = to;
+}
 
-    case STORE: // SB, SH, SW, SD
-        opRight = _DO.offset;
-        cmd = ADD;
-        break;
+void Console::Feed(const std::string* from)
+{
+    _input = from;
+    _inputAt = 0;
+}
 
-    case OP:
-        switch (_DO.funct3) 
+void Console::Put(char c)
+{
+    ++_bytesOut;
+    if (_capture != nullptr)
+    {
+        _capture->push_back(c);
+        return;
+    }
+    if (_used == BUFFER_SIZE)
+        Flush();
+    _buffer[_used++] = c;
+}
+void Console::Write(const char* data, i64 numBytes)
+{
+    _bytesOut += numBytes;
+    if (_capture != nullptr)
+    {
+        _capture->append(data, numBytes);
+        return;
+    }
+    // anything that doesn't fit goes out in the same write as the buffer
+    if (_used + numBytes > BUFFER_SIZE)
+    {
+        Flush();
+        if (numBytes >= BUFFER_SIZE)
         {
-        case 0b000: // ADD, MUL, SUB 
-            switch (_DO.funct7)
-            {
-            case 0: // ADD
-                cmd = ADD;
-                break;
-            case 1: // MUL
-                cmd = MUL;
-                break;
-            case 32: // SUB
-                cmd = SUB;
-                break;
-            }
-            break;
-        case 0b001: // SLL
-            cmd = SLL; 
-            break;
-        case 0b100: // XOR, DIV
-            switch (_DO.funct7)
-            {
-            case 0: // XOR
-                cmd = XOR;
-                break;
-            case 1: // DIV
-                cmd = DIV;
-                break;
-            }
-            break;
-        case 0b101: // SRL, SRA
-            switch (_DO.funct7)
-            {
-            case 0: // SRL
-                cmd = SRL;
-                break;
-            case 32: // SRA
-                cmd = SRA;
-                break;
-            }
-            break;
-        case 0b110: // OR, REM
-            switch (_DO.funct7)
-            {
-            case 0: // OR
-                cmd = OR;
-                break;
-            case 1: // REM
-                cmd = REM;
-                break;
-            }
+            std::fwrite(data, 1, numBytes, stdout);
+            std::fflush(stdout);
+            return;
+        }
+    }
+    std::memcpy(_buffer.data() + _used, data, numBytes);
+    _used += numBytes;
+}
+void Console::Flush()
+{
+    if (_used == 0)
+        return;
+    std::fwrite(_buffer.data(), 1, _used, stdout);
+    std::fflush(stdout);
+    _used = 0;
+}
+
+i32 Console::Get()
+{
+    // whatever the program printed last is probably a prompt
+    Flush();
+    return Next();
+}
+i64 Console::ReadLine(char* data, i64 numBytes)
+{
+    Flush();
+    i64 got = 0;
+    while (got < numBytes)
+    {
+        i32 c = Next();
+        if (c == EOF)
             break;
-        case 0b111: // AND
-            cmd = AND;
+        data[got++] = static_cast<char>(c);
+        if (c == '\n')
             break;
+    }
+    return got;
+}
+
+i64 Console::BytesOut() const
+{
+    return _bytesOut;
+}
+
+i32 Console::Next()
+{
+    if (_input == nullptr)
+        return std::getchar();
+    if (_inputAt == _input->size())
+        return EOF;
+    return static_cast<unsigned char>((*_input)[_inputAt++]);
+}
+
+const Caches::Config Caches::DEFAULT_L1I = { 32 << 10, 8, 64, Caches::LRU, true };
+const Caches::Config Caches::DEFAULT_L1D = { 32 << 10, 8, 64, Caches::LRU, true };
+const Caches::Config Caches::DEFAULT_L2 = { 256 << 10, 8, 64, Caches::LRU, true };
+
+Caches::Caches(const Config& l1i, const Config& l1d, const Config& l2)
+    : _lastPcPage(-1), _lastPcStats(nullptr)
+{
+    const Config* configs[LEVELS] = { &l1i, &l1d, &l2 };
+    for (i32 i = 0; i < LEVELS; ++i)
+    {
+        Level& c = _levels[i];
+        c.config = *configs[i];
+        c.lineBits = 0;
+        while ((1ll << c.lineBits) < c.config.lineSize)
+            ++c.lineBits;
+        c.sets = c.config.size > 0 ? c.config.size / (c.config.ways * c.config.lineSize) : 0;
+        c.tags.assign(c.sets * c.config.ways, 0);
+        c.dirty.assign(c.tags.size(), 0);
+        if (c.config.replacement == LRU)
+            c.used.assign(c.tags.size(), 0);
+        if (c.config.replacement == PLRU)
+            c.tree.assign(c.sets, 0);
+        c.clock = 0;
+        c.random = 0x9e3779b97f4a7c15ull;
+        c.lastLine = -1;
+        c.lastWay = 0;
+        c.reads = c.readMisses = c.writes = c.writeMisses = c.writebacks = 0;
+    }
+}
+
+const char* Caches::Check(const Config& config)
+{
+    auto pow2 = [](i64 n) { return n > 0 && (n & (n - 1)) == 0; };
+    if (config.size == 0)
+        return nullptr;
+    if (!pow2(config.lineSize) || config.ways <= 0 || config.size < 0)
+        return "line size has to be a power of 2 and ways positive";
+    if (config.size % (config.ways * config.lineSize) != 0 || !pow2(config.size / (config.ways * config.lineSize)))
+        return "size has to be a power of 2 sets of ways * line size";
+    if (config.replacement == PLRU && (!pow2(config.ways) || config.ways > 64))
+        return "plru needs a power of 2 ways, up to 64";
+    return nullptr;
+}
+
+inline void Caches::Fetch(i64 pc)
+{
+    PcStats& ps = AtPc(pc);
+    ++ps.fetches;
+    // instructions never span lines, and most come from the line before
+    Level& c = _levels[L1I];
+    if ((static_cast<u64>(pc) >> c.lineBits) == c.lastLine)
+        ++c.reads;
+    else
+        FetchLine(ps, pc);
+}
+void Caches::FetchLine(PcStats& ps, i64 pc)
+{
+    i64 l2Misses = L2Misses();
+    if (!Access(L1I, pc, false))
+    {
+        ++ps.fetchMisses;
+        ps.fetchL2Misses += L2Misses() - l2Misses;
+    }
+}
+inline void Caches::Load(i64 pc, i64 address, i64 numBytes)
+{
+    Data(pc, address, numBytes, false);
+}
+inline void Caches::Store(i64 pc, i64 address, i64 numBytes)
+{
+    Data(pc, address, numBytes, true);
+}
+
+inline void Caches::Data(i64 pc, i64 address, i64 numBytes, bool write)
+{
+    PcStats& ps = AtPc(pc);
+    ++ps.accesses;
+    // the line used last is a hit without looking at the set, unless it's
+    // a store that has to go through to L2
+    Level& c = _levels[L1D];
+    u64 line = static_cast<u64>(address) >> c.lineBits;
+    if (line == c.lastLine && (static_cast<u64>(address + numBytes - 1) >> c.lineBits) == line &&
+        (!write || c.config.writeBack))
+    {
+        if (write)
+        {
+            ++c.writes;
+            c.dirty[c.lastWay] = 1;
         }
-        break;
+        else
+            ++c.reads;
+        return;
+    }
+    DataLines(ps, address, numBytes, write);
+}
+void Caches::DataLines(PcStats& ps, i64 address, i64 numBytes, bool write)
+{
+    i32 lineBits = _levels[L1D].lineBits;
+    u64 first = static_cast<u64>(address) >> lineBits;
+    u64 last = static_cast<u64>(address + numBytes - 1) >> lineBits;
+    i64 l2Misses = L2Misses();
+    bool hit = Access(L1D, address, write);
+    if (last != first)
+        hit &= Access(L1D, last << lineBits, write);
+    if (!hit)
+    {
+        ++ps.misses;
+        ps.l2Misses += L2Misses() - l2Misses;
+    }
+}
 
-    case OP_32:
-        opLeft  = SignExtend(opLeft,  31u);
-        opRight = SignExtend(opRight, 31u);
-        // You still need to determine the ALU command
-        switch (_DO.funct3)
+bool Caches::Access(i32 level, u64 address, bool write)
+{
+    Level& c = _levels[level];
+    if (c.sets == 0)
+        return level == L2 || Access(L2, address, write); // no cache here, try the next
+    Level* next = level == L2 ? nullptr : &_levels[L2];
+    u64 line = address >> c.lineBits;
+    u64 set = line & (c.sets - 1);
+    u64 ways = c.config.ways;
+    if (write)
+        ++c.writes;
+    else
+        ++c.reads;
+
+    bool hit = true;
+    u64 way = c.lastWay;
+    if (line != c.lastLine)
+    {
+        u64 end = (set + 1) * ways;
+        for (way = set * ways; way < end && c.tags[way] != line + 1; ++way)
+            ;
+        if (way == end)
         {
-        case 0b000:
-            switch (_DO.funct7)
+            hit = false;
+            if (write)
+                ++c.writeMisses;
+            else
+                ++c.readMisses;
+            // write-through caches don't take the line for a store
+            if (write && !c.config.writeBack)
             {
-            case 0:
-                cmd = ADD; // ADDW
-                break;
-            case 1:
-                cmd = MUL; // MULW
-                break;
-            case 32:
-                cmd = SUB; // SUBW
-                break;
+                if (next != nullptr)
+                    Access(L2, address, true);
+                return false;
             }
-            break;
-        case 0b001:
-            cmd = SLL; // SLLW
-            break;
-        case 0b100:
-            cmd = DIV; // DIVW
-            break;
-        case 0b101:
-            switch (_DO.funct7)
+            way = Victim(c, set);
+            if (c.tags[way] != 0 && c.dirty[way])
             {
-            case 0:
-                cmd = SRL; // SRLW
-                break;
-            case 1:
-                cmd = DIV; // DIVUW
-                break;
-            case 32:
-                cmd = SRA; // SRAW
-                break;
+                ++c.writebacks;
+                if (next != nullptr)
+                    Access(L2, (c.tags[way] - 1) << c.lineBits, true);
             }
-            break;
-        case 0b110:
-            cmd = REM; // REMW
-            break;
-        case 0b111:
-            cmd = REM; // REMUW
-            break;
+            if (next != nullptr)
+                Access(L2, address, false);
+            c.tags[way] = line + 1;
+            c.dirty[way] = 0;
         }
-        break;
+        c.lastLine = line;
+        c.lastWay = way;
+        Touch(c, set, way);
+    }
 
-    case OP_IMM:
-        // Look and see which ALU op needs to be executed.
-        switch (_DO.funct3)
-        {
-        case 0b000: // ADDI
-            cmd = ADD;
-            break;
-        case 0b001: // SLLI (64)
-            cmd = SLL;
-            break;
-        case 0b100: // XORI
-            cmd = XOR;
-            break;
-        case 0b101: // SRLI, SRAI (64)
-            if (opRight >> 10)
-                cmd = SRA; 
-            else
-                cmd = SRL;
-            break;
-        case 0b110: // ORI
-            cmd = OR;
-            break;
-        case 0b111: // ANDI
-            cmd = AND;
-            break;
-        }
-        break;
+    if (write)
+    {
+        if (c.config.writeBack)
+            c.dirty[way] = 1;
+        else if (next != nullptr)
+            Access(L2, address, true);
+    }
+    return hit;
+}
 
-    case OP_IMM_32:
-        // This is just like OP_IMM except we truncated
-        // the left and right ops.
-        opLeft  = SignExtend(opLeft,  31u);
-        opRight = SignExtend(opRight, 31u);
+u64 Caches::Victim(Level& c, u64 set)
+{
+    u64 ways = c.config.ways;
+    u64 first = set * ways;
+    for (u64 way = first; way < first + ways; ++way)
+        if (c.tags[way] == 0)
+            return way;
+    switch (c.config.replacement)
+    {
+    case LRU:
+    {
+        u64 oldest = first;
+        for (u64 way = first + 1; way < first + ways; ++way)
+            if (c.used[way] < c.used[oldest])
+                oldest = way;
+        return oldest;
+    }
+    case PLRU:
+    {
+        // follow the bits down the tree, each points away from the side used last
+        u64 node = 1;
+        while (node < ways)
+            node = node * 2 + ((c.tree[set] >> node) & 1);
+        return first + node - ways;
+    }
+    default:
+        c.random ^= c.random << 13;
+        c.random ^= c.random >> 7;
+        c.random ^= c.random << 17;
+        return first + c.random % ways;
+    }
+}
 
-        // Look and see which ALU op needs to be executed.
-        switch (_DO.funct3)
+void Caches::Touch(Level& c, u64 set, u64 way)
+{
+    if (c.config.replacement == LRU)
+        c.used[way] = ++c.clock;
+    else if (c.config.replacement == PLRU)
+    {
+        u64 ways = c.config.ways;
+        u64 leaf = ways + way - set * ways;
+        u64& bits = c.tree[set];
+        // point each node on the way down at the other side
+        for (u64 node = leaf; node > 1; node /= 2)
         {
-        case 0b000:
-            cmd = ADD; // ADDIW
-            break;
-        case 0b001:
-            cmd = SLL; // SLLIW
-            break;
-        case 0b101:
-            if (opRight >> 10)
-                cmd = SRA; // SRAIW
+            if (node & 1)
+                bits &= ~(1ull << (node / 2));
             else
-                cmd = SRL; // SRLIW
-            break;
+                bits |= 1ull << (node / 2);
         }
-        break;
-
-    default:
-        opLeft  = 0ll;
-        opRight = 0ll;
-        cmd = NO_OP;
     }
-    
-    _EO = ALU(cmd, opLeft, opRight);
 }
-void Machine::Memory() 
+
+inline Caches::PcStats& Caches::AtPc(i64 pc)
 {
-    // out of bounds checks are done inside of MemoryWrite and MemoryRead
+    if ((static_cast<u64>(pc) >> (PC_PAGE_BITS + 2)) != _lastPcPage)
+        return AtNewPage(pc);
+    return _lastPcStats[(pc >> 2) & ((1 << PC_PAGE_BITS) - 1)];
+}
+Caches::PcStats& Caches::AtNewPage(i64 pc)
+{
+    u64 page = static_cast<u64>(pc) >> (PC_PAGE_BITS + 2);
+    if (page >= _pcPages.size())
+        _pcPages.resize(page + 1);
+    if (!_pcPages[page])
+        _pcPages[page].reset(new PcStats[1 << PC_PAGE_BITS]());
+    _lastPcPage = page;
+    _lastPcStats = _pcPages[page].get();
+    return _lastPcStats[(pc >> 2) & ((1 << PC_PAGE_BITS) - 1)];
+}
 
-    // Read or Write based on the Opcode
-    // Determine the size based on the funct3
+i64 Caches::L2Misses() const
+{
+    return _levels[L2].readMisses + _levels[L2].writeMisses;
+}
 
-    switch (_DO.op)
+void Caches::PrintStats(std::ostream& out, i32 top) const
+{
+    static const char* const NAMES[LEVELS] = { "L1I               : ", "L1D               : ", "L2                : " };
+    static const char* const REPLACEMENTS[] = { "lru", "plru", "random" };
+    for (i32 i = 0; i < LEVELS; ++i)
     {
-    case STORE:
-        switch (_DO.funct3) 
+        const Level& c = _levels[i];
+        if (c.sets == 0)
+            continue;
+        i64 accesses = c.reads + c.writes;
+        i64 misses = c.readMisses + c.writeMisses;
+        out << NAMES[i] << (c.config.size >> 10) << " KiB " << c.config.ways << "-way, "
+            << c.config.lineSize << " B lines, " << REPLACEMENTS[c.config.replacement];
+        if (i != L1I)
+            out << (c.config.writeBack ? ", write-back" : ", write-through");
+        out << ": " << c.reads << " reads (" << c.readMisses << " missed)";
+        if (i != L1I)
+            out << ", " << c.writes << " writes (" << c.writeMisses << " missed), "
+                << c.writebacks << " writebacks";
+        out << ", " << (accesses ? 100.0 * misses / accesses : 0.0) << "% missed\n";
+    }
+
+    // the pcs that missed the most, ties by pc
+    struct Worst { i64 pc; const PcStats* stats; };
+    std::vector<Worst> fetches, data;
+    for (size_t page = 0; page < _pcPages.size(); ++page)
+    {
+        if (!_pcPages[page])
+            continue;
+        for (i64 i = 0; i < (1 << PC_PAGE_BITS); ++i)
         {
-        case 0b000: // SB
-            MemoryWrite<u8>(_EO.result, _DO.rightVal);
-            break;
-        case 0b001: // SH
-            MemoryWrite<u16>(_EO.result, _DO.rightVal);
-            break;
-        case 0b010: // SW
-            MemoryWrite<u32>(_EO.result, _DO.rightVal);
-            break;
-        case 0b011: // SD
-            MemoryWrite<u64>(_EO.result, _DO.rightVal);
-            break;
-        default:
-            std::cerr << "[MEMORY: STORE]: Invalid funct3: " << _DO.funct3 << '\n';
-            break;
+            const PcStats& ps = _pcPages[page][i];
+            i64 pc = ((static_cast<i64>(page) << PC_PAGE_BITS) + i) << 2;
+            if (ps.fetchMisses > 0)
+                fetches.push_back({ pc, &ps });
+            if (ps.misses > 0)
+                data.push_back({ pc, &ps });
+        }
+    }
+    auto print = [&](const char* title, std::vector<Worst>& worst, bool fetch)
+    {
+        auto misses = [fetch](const Worst& w) { return fetch ? w.stats->fetchMisses : w.stats->misses; };
+        std::sort(worst.begin(), worst.end(), [&misses](const Worst& a, const Worst& b)
+        {
+            return misses(a) != misses(b) ? misses(a) > misses(b) : a.pc < b.pc;
+        });
+        if (static_cast<i32>(worst.size()) > top)
+            worst.resize(top);
+        if (!worst.empty())
+            out << title;
+        for (const Worst& w : worst)
+        {
+            i64 accesses = fetch ? w.stats->fetches : w.stats->accesses;
+            out << "  0x" << std::hex << std::setfill('0') << std::right << std::setw(8) << w.pc
+                << std::dec << std::setfill(' ') << "      : " << accesses << (fetch ? " fetches, " : " accesses, ")
+                << misses(w) << " missed (" << 100.0 * misses(w) / accesses << "%)";
+            if (_levels[L2].sets != 0)
+                out << ", " << (fetch ? w.stats->fetchL2Misses : w.stats->l2Misses) << " missed L2 too";
+            out << '\n';
         }
+    };
+    print("L1I misses by pc  :\n", fetches, true);
+    print("L1D misses by pc  :\n", data, false);
+}
+
+const i32 BranchPredictor::TAGE_HISTORY[TAGE_TABLES] = { 5, 12, 27, 60 };
+
+BranchPredictor::BranchPredictor(Scheme scheme, i32 rasEntries)
+    : _scheme(scheme), _counters(1 << COUNTER_BITS, 1), _targets(1 << TARGET_BITS, -1),
+      _ras(rasEntries), _rasTop(0), _history(0),
+      _tage(scheme == TAGE ? TAGE_TABLES << TAGE_BITS : 0, TageEntry{ 0, 0, 0 }),
+      _provider(-1), _providerTaken(false), _altTaken(false), _tageBranches(0)
+{
+}
+
+i64 BranchPredictor::Predict(i64 pc, Kind kind, i64 target, bool call, bool ret)
+{
+    i64 fallThrough = pc + 4;
+    i64 guess = fallThrough;
+    switch (kind)
+    {
+    case BRANCH:
+        guess = PredictTaken(pc, target) ? target : fallThrough;
         break;
+    case JUMP:
+        guess = _scheme == NOT_TAKEN ? fallThrough : target;
+        break;
+    case INDIRECT:
+        if (ret && !_ras.empty() && _rasTop > 0)
+            guess = _ras[(_rasTop - 1) % _ras.size()];
+        else if (_scheme != NOT_TAKEN && _targets[(pc >> 2) & ((1 << TARGET_BITS) - 1)] != -1)
+            guess = _targets[(pc >> 2) & ((1 << TARGET_BITS) - 1)];
+        break;
+    }
 
-    case LOAD:
-        switch (_DO.funct3) 
+    // a JALR that returns and calls (a coroutine swap) pops, then pushes
+    if (!_ras.empty())
+    {
+        if (ret && _rasTop > 0)
+            --_rasTop;
+        if (call)
+            _ras[_rasTop++ % _ras.size()] = fallThrough;
+    }
+    return guess;
+}
+
+void BranchPredictor::Train(i64 pc, Kind kind, i64 next, i64 predicted)
+{
+    if (kind == BRANCH)
+        TrainTaken(pc, next != pc + 4);
+    else if (kind == INDIRECT)
+        _targets[(pc >> 2) & ((1 << TARGET_BITS) - 1)] = next;
+
+    Site& site = _sites[pc];
+    site.kind = kind;
+    ++site.runs;
+    site.mispredicted += next != predicted;
+}
+
+void BranchPredictor::Charge(i64 pc, i64 cycles)
+{
+    _sites[pc].cycles += cycles;
+}
+
+void BranchPredictor::PrintStats(std::ostream& out, i32 top) const
+{
+    static const char* const SCHEMES[] = { "not-taken", "static", "bimodal", "gshare", "tage" };
+    static const char* const KINDS[] = { "branches          : ", "jumps             : ", "indirect jumps    : " };
+
+    out << "predictor         : " << SCHEMES[_scheme];
+    if (!_ras.empty())
+        out << ", " << _ras.size() << " entry return stack";
+    out << '\n';
+
+    i64 runs[3] = {};
+    i64 mispredicted[3] = {};
+    std::vector<std::pair<i64, const Site*>> worst;
+    for (const auto& entry : _sites)
+    {
+        runs[entry.second.kind] += entry.second.runs;
+        mispredicted[entry.second.kind] += entry.second.mispredicted;
+        if (entry.second.cycles > 0)
+            worst.emplace_back(entry.first, &entry.second);
+    }
+    for (i32 k = 0; k < 3; ++k)
+        out << KINDS[k] << runs[k] << " (" 
+            << (runs[k] ? 100.0 * (runs[k] - mispredicted[k]) / runs[k] : 100.0) << "% predicted)\n";
+
+    // the ones that cost the most, ties by pc so the order doesn't depend on the hash
+    std::sort(worst.begin(), worst.end(), [](const std::pair<i64, const Site*>& a, const std::pair<i64, const Site*>& b)
+    {
+        return a.second->cycles != b.second->cycles ? a.second->cycles > b.second->cycles : a.first < b.first;
+    });
+    if (static_cast<i32>(worst.size()) > top)
+        worst.resize(top);
+    if (!worst.empty())
+        out << "most flushed      :\n";
+    for (const auto& entry : worst)
+    {
+        const Site& site = *entry.second;
+        out << "  0x" << std::hex << std::setfill('0') << std::right << std::setw(8) << entry.first
+            << std::dec << std::setfill(' ') << "      : " << site.runs << " runs, "
+            << site.mispredicted << " mispredicted, " << site.cycles << " cycles flushed\n";
+    }
+}
+
+u32 BranchPredictor::Fold(u64 history, i32 length, i32 bits)
+{
+    if (length < 64)
+        history &= (1ull << length) - 1;
+    u32 folded = 0;
+    for (; history != 0; history >>= bits)
+        folded ^= static_cast<u32>(history & ((1ull << bits) - 1));
+    return folded;
+}
+u32 BranchPredictor::TageIndex(i64 pc, i32 table) const
+{
+    u32 at = static_cast<u32>(pc >> 2);
+    return (at ^ (at >> TAGE_BITS) ^ Fold(_history, TAGE_HISTORY[table], TAGE_BITS)) & ((1 << TAGE_BITS) - 1);
+}
+u16 BranchPredictor::TageTag(i64 pc, i32 table) const
+{
+    // bit 8 marks the entry as in use, so empty entries never match
+    u32 at = static_cast<u32>(pc >> 2);
+    u32 tag = at ^ Fold(_history, TAGE_HISTORY[table], 8) ^ (Fold(_history, TAGE_HISTORY[table], 7) << 1);
+    return static_cast<u16>(0x100 | (tag & 0xff));
+}
+
+bool BranchPredictor::PredictTaken(i64 pc, i64 target)
+{
+    u32 at = static_cast<u32>(pc >> 2);
+    u32 mask = (1 << COUNTER_BITS) - 1;
+    switch (_scheme)
+    {
+    case STATIC:
+        return target < pc;
+    case BIMODAL:
+        return _counters[at & mask] >= 2;
+    case GSHARE:
+        return _counters[(at ^ _history) & mask] >= 2;
+    case TAGE:
+        // the longest history that matches decides, the next one down is
+        // kept to see whether that table is any use
+        _provider = -1;
+        _providerTaken = _altTaken = _counters[at & mask] >= 2;
+        for (i32 t = 0; t < TAGE_TABLES; ++t)
         {
-        case 0b000: // LB
-            _MO.value = MemoryRead<i8>(_EO.result);
-            break;
-        case 0b001: // LH
-            _MO.value = MemoryRead<i16>(_EO.result);
-            break;
-        case 0b010: // LW 
-            _MO.value = MemoryRead<i32>(_EO.result);
-            break;
-        case 0b011: // LD 
-            _MO.value = MemoryRead<i64>(_EO.result);
-            break;
-        case 0b100: // LBU
-            _MO.value = MemoryRead<u8>(_EO.result);
-            break;
-        case 0b101: // LHU
-            _MO.value = MemoryRead<u16>(_EO.result);
-            break;
-        case 0b110: // LWU
-            _MO.value = MemoryRead<u32>(_EO.result);
-            break;
-        default:
-            std::cerr << "[MEMORY: LOAD]: Invalid funct3: " << _DO.funct3 << '\n';
-            break;
+            const TageEntry& e = _tage[(t << TAGE_BITS) + TageIndex(pc, t)];
+            if (e.tag == TageTag(pc, t))
+            {
+                _altTaken = _providerTaken;
+                _providerTaken = e.counter >= 0;
+                _provider = t;
+            }
         }
-        break;
+        return _providerTaken;
+    default:
+        return false;
+    }
+}
 
+void BranchPredictor::TrainTaken(i64 pc, bool taken)
+{
+    u32 at = static_cast<u32>(pc >> 2);
+    u32 mask = (1 << COUNTER_BITS) - 1;
+    auto bump = [taken](u8& counter)
+    {
+        if (taken && counter < 3)
+            ++counter;
+        else if (!taken && counter > 0)
+            --counter;
+    };
+    switch (_scheme)
+    {
+    case BIMODAL:
+        bump(_counters[at & mask]);
+        break;
+    case GSHARE:
+        bump(_counters[(at ^ _history) & mask]);
+        break;
+    case TAGE:
+        if (_provider < 0)
+            bump(_counters[at & mask]);
+        else
+        {
+            TageEntry& e = _tage[(_provider << TAGE_BITS) + TageIndex(pc, _provider)];
+            if (taken && e.counter < 3)
+                ++e.counter;
+            else if (!taken && e.counter > -4)
+                --e.counter;
+            if (_providerTaken != _altTaken)
+            {
+                if (_providerTaken == taken && e.useful < 3)
+                    ++e.useful;
+                else if (_providerTaken != taken && e.useful > 0)
+                    --e.useful;
+            }
+        }
+        // a miss takes an entry in a table with longer history, or makes
+        // the ones in its way a bit less useful
+        if (_providerTaken != taken)
+        {
+            bool allocated = false;
+            for (i32 t = _provider + 1; t < TAGE_TABLES && !allocated; ++t)
+            {
+                TageEntry& e = _tage[(t << TAGE_BITS) + TageIndex(pc, t)];
+                if (e.useful == 0)
+                {
+                    e = TageEntry{ TageTag(pc, t), static_cast<i8>(taken ? 0 : -1), 0 };
+                    allocated = true;
+                }
+            }
+            for (i32 t = _provider + 1; t < TAGE_TABLES && !allocated; ++t)
+            {
+                TageEntry& e = _tage[(t << TAGE_BITS) + TageIndex(pc, t)];
+                if (e.useful > 0)
+                    --e.useful;
+            }
+        }
+        if (++_tageBranches % TAGE_AGING == 0)
+            for (TageEntry& e : _tage)
+                e.useful >>= 1;
+        break;
     default:
-        // If this is not a LOAD or STORE, then this stage just copies
-        // the ALU result.
-        _MO.value = _EO.result;
+        break;
     }
+    _history = (_history << 1) | taken;
 }
-bool Machine::WriteBack()
+
+Profiler::Profiler(i64 interval, i64 entry)
+    : _interval(interval), _countdown(interval), _samples(0), _stack{ { entry, -1 } }, _lost(0)
 {
-// (1) write a result to the RD register 
-    // SetXReg automatically restores x0 to 0
-    if (_DO.op == JALR || _DO.op == JAL)
-        SetXReg(_DO.rd, GetPC()+4);
-    else
-        SetXReg(_DO.rd, _MO.value);
-    // std::cout << "Writeback: " << (int)_DO.rd << " = " << GetXReg(_DO.rd) << '\n';
+}
+
+void Profiler::AddSymbol(i64 address, const std::string& name)
+{
+    // the first name given for an address stays
+    _symbols.emplace(address, name);
+}
+
+inline void Profiler::Retire(i64 pc, u32 instruction, i64 next)
+{
+    if (--_countdown == 0)
+        Sample(pc);
+    u32 opcode = instruction & 0x7f;
+    if (opcode == 0x6f || opcode == 0x67) // JAL, JALR
+        Jump(pc, instruction, next);
+}
+void Profiler::Sample(i64 pc)
+{
+    _countdown = _interval;
+    ++_samples;
+    ++_flat[pc];
+    std::vector<i64> key;
+    key.reserve(_stack.size() + 1);
+    for (const Frame& frame : _stack)
+        key.push_back(frame.entry);
+    key.push_back(Function(pc));
+    ++_stacks[key];
+}
+void Profiler::Jump(i64 pc, u32 instruction, i64 next)
+{
+    // the hints from the spec: JALR through ra or t0 returns, JAL or JALR
+    // linking ra or t0 calls, and JALR from one to the other does both
+    auto link = [](u32 r) { return r == 1 || r == 5; };
+    u32 rd = (instruction >> 7) & 0x1f;
+    u32 rs1 = (instruction >> 15) & 0x1f;
+    bool jalr = (instruction & 0x7f) == 0x67;
+    if (jalr && link(rs1) && !(link(rd) && rd == rs1))
+    {
+        if (_lost > 0)
+            --_lost;
+        else
+        {
+            // unwind to the frame that returns there, which also drops frames
+            // something like longjmp left, otherwise just the innermost one
+            size_t depth = _stack.size() - 1;
+            while (depth > 0 && _stack[depth].ret != next)
+                --depth;
+            if (depth == 0)
+                depth = std::max<size_t>(_stack.size() - 1, 1);
+            _stack.resize(depth);
+        }
+    }
+    if (link(rd))
+    {
+        if (_stack.size() < MAX_DEPTH)
+            _stack.push_back({ next, pc + 4 });
+        else
+            ++_lost;
+    }
+}
+
+i64 Profiler::Function(i64 address) const
+{
+    auto at = _symbols.upper_bound(address);
+    return at == _symbols.begin() ? -1 : std::prev(at)->first;
+}
+std::string Profiler::Name(i64 address) const
+{
+    i64 function = Function(address);
+    if (function != -1)
+        return _symbols.at(function);
+    std::ostringstream name;
+    name << "0x" << std::hex << address;
+    return name.str();
+}
+
+std::string Profiler::Leaf(const std::vector<i64>& key) const
+{
+    return key.back() != -1 ? _symbols.at(key.back()) : Name(key[key.size() - 2]);
+}
+
+void Profiler::PrintFlat(std::ostream& out, i32 top) const
+{
+    out << "profile           : " << _samples << " samples, one every " << _interval << " instructions\n";
+
+    // percentages and counts in columns, without touching out's flags
+    auto row = [&](i64 count, const std::string& what)
+    {
+        std::ostringstream line;
+        line << std::fixed << std::setprecision(1) << std::setw(7)
+             << (_samples ? 100.0 * count / _samples : 0.0) << "% " << std::setw(10) << count << "  " << what << '\n';
+        out << line.str();
+    };
+    // the most samples first, ties by name or pc so the order doesn't depend on the hash
+    std::map<std::string, i64> byName;
+    std::vector<std::pair<i64, i64>> byPc(_flat.begin(), _flat.end());
+    for (const auto& entry : _stacks)
+        byName[Leaf(entry.first)] += entry.second;
+    std::vector<std::pair<std::string, i64>> functions(byName.begin(), byName.end());
+    std::stable_sort(functions.begin(), functions.end(), [](const std::pair<std::string, i64>& a, const std::pair<std::string, i64>& b)
+    {
+        return a.second > b.second;
+    });
+    std::sort(byPc.begin(), byPc.end(), [](const std::pair<i64, i64>& a, const std::pair<i64, i64>& b)
+    {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    if (!functions.empty())
+        out << "by function       :\n";
+    for (i32 i = 0; i < static_cast<i32>(functions.size()) && i < top; ++i)
+        row(functions[i].second, functions[i].first);
+    if (!byPc.empty())
+        out << "by pc             :\n";
+    for (i32 i = 0; i < static_cast<i32>(byPc.size()) && i < top; ++i)
+    {
+        i64 pc = byPc[i].first;
+        std::ostringstream where;
+        where << "0x" << std::hex << std::setfill('0') << std::setw(8) << pc;
+        i64 function = Function(pc);
+        if (function != -1)
+        {
+            where << ' ' << _symbols.at(function);
+            if (pc != function)
+                where << "+0x" << std::hex << pc - function;
+        }
+        row(byPc[i].second, where.str());
+    }
+}
+
+void Profiler::WriteCollapsed(std::ostream& out) const
+{
+    // stacks that name the same get merged, and come out sorted
+    std::map<std::string, i64> collapsed;
+    for (const auto& entry : _stacks)
+    {
+        const std::vector<i64>& key = entry.first;
+        std::string stack;
+        for (size_t i = 0; i + 1 < key.size(); ++i)
+            stack += (i > 0 ? ";" : "") + Name(key[i]);
+        // the pc's own function, when it isn't the innermost call (a tail
+        // call or a jump into another function)
+        std::string leaf = Leaf(key);
+        if (leaf != Name(key[key.size() - 2]))
+            stack += ";" + leaf;
+        collapsed[stack] += entry.second;
+    }
+    for (const auto& entry : collapsed)
+        out << entry.first << ' ' << entry.second << '\n';
+}
+
+const char TraceWriter::MAGIC[8] = { 'M', 'M', 'T', 'R', 'A', 'C', 'E', '1' };
+
+TraceWriter::TraceWriter(const char* fileName, Compression compression, const i64* regs)
+    : _out(fileName, std::ios::binary), _compression(compression), _filling(0),
+      _expected(0), _words(1 << WORD_BITS, 0), _value(0),
+      _handed(-1), _stopping(false), _failed(!_out)
+{
+    for (std::vector<u8>& buffer : _buffers)
+        buffer.resize(BLOCK_SIZE);
+    _at = _buffers[0].data();
+    _end = _at + BLOCK_SIZE - MAX_RECORD;
+    _out.write(MAGIC, sizeof(MAGIC));
+    _out.write(reinterpret_cast<const char*>(regs), 32 * 8);
+    _writer = std::thread(&TraceWriter::Write, this);
+}
+TraceWriter::~TraceWriter()
+{
+    Finish();
+}
+
+u64 TraceWriter::Zigzag(i64 value)
+{
+    return (static_cast<u64>(value) << 1) ^ static_cast<u64>(value >> 63);
+}
+i64 TraceWriter::Unzigzag(u64 value)
+{
+    return static_cast<i64>(value >> 1) ^ -static_cast<i64>(value & 1);
+}
+
+inline void TraceWriter::Put(i64 difference)
+{
+    u64 value = Zigzag(difference);
+    while (value >= 0x80)
+    {
+        *_at++ = static_cast<u8>(value | 0x80);
+        value >>= 7;
+    }
+    *_at++ = static_cast<u8>(value);
+}
+
+inline void TraceWriter::Record(i64 pc, u32 instruction, i64 next, u32 rd, i64 value)
+{
+    if (_at > _end)
+        Hand();
+    u8* flags = _at++;
+    u8 f = 0;
+    if (pc != _expected)
+    {
+        f |= MOVED;
+        Put(pc - _expected);
+    }
+    _expected = next;
+    u32& word = _words[(pc >> 2) & ((1 << WORD_BITS) - 1)];
+    if (word != instruction)
+    {
+        f |= NEW_WORD;
+        std::memcpy(_at, &instruction, 4);
+        _at += 4;
+        word = instruction;
+    }
+    if (rd != 0)
+    {
+        f |= VALUE;
+        Put(value - _value);
+        _value = value;
+    }
+    *flags = f;
+}
+
+void TraceWriter::Hand()
+{
+    i64 bytes = _at - _buffers[_filling].data();
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _changed.wait(lock, [this] { return _handed < 0; });
+        _handed = bytes;
+        _changed.notify_all();
+    }
+    _filling ^= 1;
+    _at = _buffers[_filling].data();
+    _end = _at + BLOCK_SIZE - MAX_RECORD;
+}
+
+void TraceWriter::Write()
+{
+    std::vector<u8> packed;
+    for (i32 buffer = 0; ; buffer ^= 1)
+    {
+        i64 bytes;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _changed.wait(lock, [this] { return _handed >= 0 || _stopping; });
+            if (_handed < 0)
+                return;
+            bytes = _handed;
+        }
+
+        // buffers are handed over in turn, so this is the one
+        const u8* raw = _buffers[buffer].data();
+        u8 compression = static_cast<u8>(_compression);
+        if (_compression == LZ)
+            Compress(raw, bytes, packed);
+        if (_compression == NONE || static_cast<i64>(packed.size()) >= bytes)
+        {
+            compression = NONE;
+            packed.assign(raw, raw + bytes);
+        }
+        u32 sizes[2] = { static_cast<u32>(bytes), static_cast<u32>(packed.size()) };
+        _out.write(reinterpret_cast<const char*>(&compression), 1);
+        _out.write(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+        _out.write(reinterpret_cast<const char*>(packed.data()), packed.size());
+
+        std::lock_guard<std::mutex> lock(_lock);
+        _failed = _failed || !_out;
+        _handed = -1;
+        _changed.notify_all();
+    }
+}
+
+bool TraceWriter::Finish()
+{
+    if (!_writer.joinable())
+        return !_failed;
+    if (_at != _buffers[_filling].data())
+        Hand();
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stopping = true;
+        _changed.notify_all();
+    }
+    _writer.join();
+    _out.close();
+    return !_failed && !_out.fail();
+}
+
+void TraceWriter::Compress(const u8* in, i64 size, std::vector<u8>& out)
+{
+    const i32 HASH_BITS = 14;
+    const i64 MIN_MATCH = 4;
+    const i64 MAX_OFFSET = 0xffff;
+    std::vector<i32> table(1 << HASH_BITS, -1); // last position of each hashed 4 bytes
+
+    // the worst case is all literals: a length byte per 255 of them more
+    out.resize(size + size / 255 + 16);
+    u8* put = out.data();
+    auto length = [&put](i64 n)
+    {
+        for (; n >= 255; n -= 255)
+            *put++ = 255;
+        *put++ = static_cast<u8>(n);
+    };
+    // literals from anchor up to at, then a match (if any)
+    auto sequence = [&](i64 anchor, i64 at, i64 match, i64 offset)
+    {
+        i64 literals = at - anchor;
+        i64 extra = match > 0 ? match - MIN_MATCH : 0;
+        *put++ = static_cast<u8>((std::min<i64>(literals, 15) << 4) | std::min<i64>(extra, 15));
+        if (literals >= 15)
+            length(literals - 15);
+        std::memcpy(put, in + anchor, literals);
+        put += literals;
+        if (match == 0)
+            return;
+        *put++ = static_cast<u8>(offset);
+        *put++ = static_cast<u8>(offset >> 8);
+        if (extra >= 15)
+            length(extra - 15);
+    };
+
+    i64 anchor = 0;
+    i64 at = 0;
+    i64 misses = 0; // since the last match, to step faster over what doesn't compress
+    while (at + MIN_MATCH <= size)
+    {
+        u32 bytes;
+        std::memcpy(&bytes, in + at, 4);
+        u32 hash = static_cast<u32>(bytes * 2654435761u) >> (32 - HASH_BITS);
+        i64 candidate = table[hash];
+        table[hash] = static_cast<i32>(at);
+        u32 old;
+        if (candidate >= 0)
+            std::memcpy(&old, in + candidate, 4);
+        if (candidate < 0 || at - candidate > MAX_OFFSET || old != bytes)
+        {
+            at += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+        // 8 bytes at a time, then the rest
+        i64 match = MIN_MATCH;
+        while (at + match + 8 <= size && std::memcmp(in + candidate + match, in + at + match, 8) == 0)
+            match += 8;
+        while (at + match < size && in[candidate + match] == in[at + match])
+            ++match;
+        sequence(anchor, at, match, at - candidate);
+        at += match;
+        anchor = at;
+    }
+    sequence(anchor, size, 0, 0);
+    out.resize(put - out.data());
+}
+
+bool TraceWriter::Decompress(const u8* in, i64 size, i64 rawSize, std::vector<u8>& out)
+{
+    out.clear();
+    out.reserve(rawSize);
+    i64 at = 0;
+    // a nibble's length and the bytes after it, -1 if they run off the end
+    auto length = [&](i64 n)
+    {
+        if (n < 15)
+            return n;
+        for (u8 more = 255; more == 255; n += more)
+        {
+            if (at == size)
+                return static_cast<i64>(-1);
+            more = in[at++];
+        }
+        return n;
+    };
+    while (at < size)
+    {
+        u8 token = in[at++];
+        i64 literals = length(token >> 4);
+        if (literals < 0 || literals > size - at)
+            return false;
+        out.insert(out.end(), in + at, in + at + literals);
+        at += literals;
+        if (at == size)
+            break;
+        if (size - at < 2)
+            return false;
+        i64 offset = in[at] | (in[at + 1] << 8);
+        at += 2;
+        i64 match = length(token & 0xf);
+        if (match < 0 || offset == 0 || offset > static_cast<i64>(out.size()))
+            return false;
+        match += 4;
+        // the match can overlap what it is copying
+        for (size_t from = out.size() - offset; match > 0; --match)
+            out.push_back(out[from++]);
+    }
+    return static_cast<i64>(out.size()) == rawSize;
+}
+
+Machine::Machine(PagedMemory& mem)
+    : _memory(&mem), _memorySize(mem.Size()), _flat(mem.Flat()),
+      _flatLimit(mem.Size() + PagedMemory::GUARD_SIZE - 8), _lastCodePage(-1), _ctx(),
+      _decodeCacheEnabled(true), _decodeCache(DECODE_CACHE_SIZE), _image(nullptr),
+      _flushBlocks(false), _flushAllBlocks(false), _blockStats(),
+      _jitEnabled(false), _jitThreshold(0), _forwarding(true), _pipelineStats(), _profiler(nullptr),
+      _trace(nullptr),
+      _reservedAt(-1), _reservedBytes(0), _reservedValue(0), _hartId(0), _harts(nullptr)
+#if MACHINE_COUNTERS
+      , _counters()
+#endif
+{
+    for (DecodedInst& di : _decodeCache)
+        di.pc = -1;
+    for (i32 i = 0; i < TLB_SIZE; ++i)
+        _readTlb[i].page = _writeTlb[i].page = -1;
+    // set the stack pointer to be at the end of memory
+    SetXReg(2, _memorySize);
+}
+
+i64 Machine::GetPC() const
+{
+    return _ctx.pc;
+}
+void Machine::SetPC(i64 to)
+{
+    _ctx.pc = to;
+}
+
+i64  Machine::GetXReg(i32 which) const
+{
+    which &= 0x1f; // Make sure the register number is 0 - 31
+    return _ctx.regs[which];
+}
+void Machine::SetXReg(i32 which, i64 value)
+{
+    which &= 0x1f; // Make sure the register number is 0 - 31
+    _ctx.regs[which] = value;
+    _ctx.regs[0] = 0; // make sure zero is 0
+}
+
+void Machine::Fetch()
+{
+    // read the instruction at the program counter memory address
+    if (_caches)
+        _caches->Fetch(_ctx.pc);
+    _FO.instruction = MemoryPeek<u32>(_ctx.pc);
+}
+void Machine::Decode() 
+{
+    DecodedInst uncached;
+    DecodedInst& di = _decodeCacheEnabled 
+        ? _decodeCache[(_ctx.pc >> 2) & (DECODE_CACHE_SIZE - 1)] 
+        : uncached;
+
+    // hot code finds the instruction already decoded and only has to read registers
+    if (!_decodeCacheEnabled || di.pc != _ctx.pc)
+    {
+        u8 InstSize = _FO.instruction & 0b11;
+        if (InstSize != 3) 
+        {
+            std::cerr << "[DECODE] Invalid instruction (not a 32-bit instruction).\n";
+            return;
+        }
+        if (!Predecoded(_ctx.pc, _FO.instruction, di))
+            DecodeInstruction(_FO.instruction, di);
+        // don't cache anything we can't run so the error shows up every time
+        di.pc = di.op == UNIMPL ? -1 : _ctx.pc;
+        if (_decodeCacheEnabled)
+            MarkCode(_ctx.pc);
+    }
+
+    _DO.op       = di.op;
+    _DO.rd       = di.rd;
+    _DO.funct3   = di.funct3;
+    _DO.funct7   = di.funct7;
+    _DO.offset   = di.op == STORE || di.op == BRANCH ? di.imm : 0;
+    _DO.leftVal  = GetXReg(di.rs1);
+    _DO.rightVal = di.rightImm ? di.imm : GetXReg(di.rs2);
+    _DO.inst     = di.inst;
+}
+void Machine::DecodeInstruction(u32 instruction, DecodedInst& di) const
+{
+    static_assert(Immediate<Format::I>(0xfff00093) == -1, "addi x1, x0, -1");
+    static_assert(Immediate<Format::S>(0xfe113c23) == -8, "sd x1, -8(x2)");
+    static_assert(Immediate<Format::B>(0xfe000ee3) == -4, "beq x0, x0, -4");
+    static_assert(Immediate<Format::U>(0x800000b7) == -0x8000'0000ll, "lui x1, 0x80000");
+    static_assert(Immediate<Format::J>(0xffdff06f) == -4, "jal x0, -4");
+    static_assert(DECODE_TABLE[DecodeKey(0x40005033)].inst == static_cast<u8>(Inst::SRA), "sra");
+
+    const DecodeEntry& entry = DECODE_TABLE[DecodeKey(instruction)];
+
+    di.instruction = instruction;
+    di.op = static_cast<Opcodes>(entry.op);
+    di.inst = static_cast<Inst>(entry.inst);
+    if (entry.narrow)
+        di.inst = NarrowInst(instruction);
+    Format format = static_cast<Format>(entry.format);
+    if (format == Format::NONE)
+        std::cerr << "Invalid op type: " << di.op << '\n';
+    FIELD_DECODERS[entry.format](di);
+}
+Machine::Inst Machine::NarrowInst(u32 instruction)
+{
+    // pause and lr look past funct7
+    for (const InstSpec& spec : SPECS)
+    {
+        if ((instruction & spec.mask) == spec.match)
+            return spec.inst;
+    }
+    return Inst::ILLEGAL;
+}
+
+void Machine::Predecode(i64 base, std::vector<u32> words, DecodedImage& image)
+{
+    size_t count = words.size();
+    image.base = base;
+    image.words = std::move(words);
+    image.imm.resize(count);
+    for (std::vector<u8>* field : { &image.inst, &image.op, &image.format, &image.rd, &image.rs1,
+                                    &image.rs2, &image.funct3, &image.funct7 })
+        field->resize(count);
+    i64 done = 0;
+#if MACHINE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        done = PredecodeAvx2(image);
+#endif
+    PredecodeScalar(image, done);
+}
+void Machine::SetDecodedImage(const DecodedImage* image)
+{
+    _image = image;
+}
+
+inline bool Machine::Predecoded(i64 pc, u32 instruction, DecodedInst& di) const
+{
+    if (_image == nullptr)
+        return false;
+    // the fields only depend on the word, so a misaligned pc is fine too
+    u64 i = static_cast<u64>(pc - _image->base) >> 2;
+    if (i >= _image->words.size() || _image->words[i] != instruction || _image->op[i] == UNIMPL)
+        return false;
+    Format format = static_cast<Format>(_image->format[i]);
+    di.instruction = instruction;
+    di.op       = static_cast<Opcodes>(_image->op[i]);
+    di.inst     = static_cast<Inst>(_image->inst[i]);
+    di.rd       = _image->rd[i];
+    di.rs1      = _image->rs1[i];
+    di.rs2      = _image->rs2[i];
+    di.funct3   = _image->funct3[i];
+    di.funct7   = _image->funct7[i];
+    di.imm      = _image->imm[i];
+    di.rightImm = format != Format::R && format != Format::S && format != Format::B;
+    return true;
+}
+
+void Machine::PredecodeScalar(DecodedImage& image, i64 first)
+{
+    for (size_t i = first; i < image.words.size(); ++i)
+    {
+        u32 instruction = image.words[i];
+        const DecodeEntry& entry = DECODE_TABLE[DecodeKey(instruction)];
+        DecodedInst di;
+        di.instruction = instruction;
+        FIELD_DECODERS[entry.format](di);
+        image.imm[i]    = di.imm;
+        image.inst[i]   = entry.narrow ? static_cast<u8>(NarrowInst(instruction)) : entry.inst;
+        image.op[i]     = entry.op;
+        image.format[i] = entry.format;
+        image.rd[i]     = di.rd;
+        image.rs1[i]    = di.rs1;
+        image.rs2[i]    = di.rs2;
+        image.funct3[i] = di.funct3;
+        image.funct7[i] = di.funct7;
+    }
+}
+
+#if MACHINE_AVX2
+// helpers for PredecodeAvx2, which have to be built for AVX2 like it is
+
+// (w >> shift) & mask in each lane
+__attribute__((target("avx2")))
+static inline __m256i Avx2Bits(__m256i w, i32 shift, i32 mask)
+{
+    return _mm256_and_si256(_mm256_srli_epi32(w, shift), _mm256_set1_epi32(mask));
+}
+// the low byte of each lane, as 8 bytes
+__attribute__((target("avx2")))
+static inline void Avx2StoreBytes(u8* to, __m256i lanes)
+{
+    const __m256i LOW_BYTES = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                               0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(lanes, LOW_BYTES),
+                                                 _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(to), _mm256_castsi256_si128(packed));
+}
+
+__attribute__((target("avx2")))
+i64 Machine::PredecodeAvx2(DecodedImage& image)
+{
+    static_assert(sizeof(DecodeEntry) == 4, "entries are gathered as 32-bit lanes");
+    const int* table = reinterpret_cast<const int*>(DECODE_TABLE.data());
+
+    i64 count = static_cast<i64>(image.words.size()) & ~7ll;
+    for (i64 i = 0; i < count; i += 8)
+    {
+        __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(image.words.data() + i));
+        __m256i key = _mm256_or_si256(Avx2Bits(w, 2, 0x1f), _mm256_or_si256(Avx2Bits(w, 7, 0xe0), Avx2Bits(w, 17, 0x7f00)));
+        __m256i entry = _mm256_i32gather_epi32(table, key, 4);
+        __m256i format = Avx2Bits(entry, 16, 0xff);
+
+        __m256i r = _mm256_cmpeq_epi32(format, _mm256_set1_epi32(static_cast<i32>(Format::R)));
+        __m256i iType = _mm256_cmpeq_epi32(format, _mm256_set1_epi32(static_cast<i32>(Format::I)));
+        __m256i s = _mm256_cmpeq_epi32(format, _mm256_set1_epi32(static_cast<i32>(Format::S)));
+        __m256i b = _mm256_cmpeq_epi32(format, _mm256_set1_epi32(static_cast<i32>(Format::B)));
+        __m256i u = _mm256_cmpeq_epi32(format, _mm256_set1_epi32(static_cast<i32>(Format::U)));
+        __m256i j = _mm256_cmpeq_epi32(format, _mm256_set1_epi32(static_cast<i32>(Format::J)));
+        __m256i hasRd  = _mm256_or_si256(_mm256_or_si256(r, iType), _mm256_or_si256(u, j));
+        __m256i hasRs1 = _mm256_or_si256(_mm256_or_si256(r, iType), _mm256_or_si256(s, b));
+        __m256i hasRs2 = _mm256_or_si256(r, _mm256_or_si256(s, b));
+
+        // the same shifts as Immediate, the sign coming down from bit 31
+        __m256i sign = _mm256_and_si256(w, _mm256_set1_epi32(static_cast<i32>(0x8000'0000)));
+        __m256i immI = _mm256_srai_epi32(w, 20);
+        __m256i immS = _mm256_or_si256(_mm256_srai_epi32(sign, 20), _mm256_or_si256(Avx2Bits(w, 20, 0x7e0), Avx2Bits(w, 7, 0x1f)));
+        __m256i immB = _mm256_or_si256(_mm256_or_si256(_mm256_srai_epi32(sign, 19),
+                                                       _mm256_and_si256(_mm256_slli_epi32(w, 4), _mm256_set1_epi32(0x800))),
+                                       _mm256_or_si256(Avx2Bits(w, 20, 0x7e0), Avx2Bits(w, 7, 0x1e)));
+        __m256i immU = _mm256_and_si256(w, _mm256_set1_epi32(static_cast<i32>(0xffff'f000)));
+        __m256i immJ = _mm256_or_si256(_mm256_or_si256(_mm256_srai_epi32(sign, 11),
+                                                       _mm256_and_si256(w, _mm256_set1_epi32(0xf'f000))),
+                                       _mm256_or_si256(Avx2Bits(w, 9, 0x800), Avx2Bits(w, 20, 0x7fe)));
+        __m256i imm = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(iType, immI), _mm256_and_si256(s, immS)),
+                                      _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(b, immB), _mm256_and_si256(u, immU)),
+                                                      _mm256_and_si256(j, immJ)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(image.imm.data() + i), imm);
+
+        Avx2StoreBytes(image.inst.data() + i, entry);
+        Avx2StoreBytes(image.op.data() + i, _mm256_srli_epi32(entry, 8));
+        Avx2StoreBytes(image.format.data() + i, format);
+        Avx2StoreBytes(image.rd.data() + i, _mm256_and_si256(hasRd, Avx2Bits(w, 7, 0x1f)));
+        Avx2StoreBytes(image.rs1.data() + i, _mm256_and_si256(hasRs1, Avx2Bits(w, 15, 0x1f)));
+        Avx2StoreBytes(image.rs2.data() + i, _mm256_and_si256(hasRs2, Avx2Bits(w, 20, 0x1f)));
+        Avx2StoreBytes(image.funct3.data() + i, _mm256_and_si256(hasRs1, Avx2Bits(w, 12, 0x7)));
+        Avx2StoreBytes(image.funct7.data() + i, _mm256_and_si256(r, Avx2Bits(w, 25, 0x3f)));
+
+        // the odd narrow one (pause, lr) is looked up one at a time
+        u32 narrow = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(entry, 7)));
+        for (i32 k = 0; narrow != 0; ++k, narrow >>= 1)
+        {
+            if (narrow & 1)
+                image.inst[i + k] = static_cast<u8>(NarrowInst(image.words[i + k]));
+        }
+    }
+    return count;
+}
+#endif
+
+void Machine::Execute() 
+{
+    // the ALU command comes from the instruction's row in SPECS
+    Alu cmd = INST_ALU[static_cast<i32>(_DO.inst)];
+    // the W forms give a 32-bit result, except Zba's .uw forms, which
+    // only zero extend rs1 and give the whole 64 bits
+    enum { DOUBLE, WORD, UNSIGNED_WORD } word = DOUBLE;
+    if (_DO.op == OP_32 || _DO.op == OP_IMM_32)
+        word = _DO.inst >= Inst::ADD_UW && _DO.inst <= Inst::SLLI_UW ? UNSIGNED_WORD : WORD;
+
+    // Most instructions will follow left/right
+    // but some won't, so we need these:
+    i64 opLeft  = _DO.leftVal;
+    i64 opRight = _DO.rightVal; 
+
+    switch (_DO.op)
+    {
+    case BRANCH: // WriteBack compares the operands the ALU saw
+    case JALR:   // offset and a register value need to be added together
+    case LUI:
+    case LOAD:
+    case OP:
+    case OP_IMM:
+        break;
+
+    case JAL:
+    case AUIPC:
+        opLeft = _ctx.pc;
+        break;
+
+    case STORE:
+        opRight = _DO.offset;
+        break;
+
+    case OP_32:
+    case OP_IMM_32:
+        // just like OP and OP_IMM except the operands are truncated, zero
+        // extended for the unsigned ones, and shifts only use 5 bits
+        if (word == UNSIGNED_WORD)
+        {
+            opLeft = static_cast<u32>(opLeft);
+            break;
+        }
+        if (cmd == SRL || cmd == DIVU || cmd == REMU || cmd == CPOP)
+            opLeft = static_cast<u32>(opLeft);
+        else
+            opLeft = SignExtend(opLeft, 31u);
+        if (cmd == DIVU || cmd == REMU)
+            opRight = static_cast<u32>(opRight);
+        else if (cmd == SLL || cmd == SRL || cmd == SRA)
+            opRight &= 31;
+        else
+            opRight = SignExtend(opRight, 31u);
+        break;
+
+    default:
+        opLeft  = 0ll;
+        opRight = 0ll;
+        cmd = NO_OP;
+    }
+    
+    _EO = ALU(cmd, opLeft, opRight);
+    // and the 32-bit result is sign extended
+    if (word == WORD)
+        _EO.result = SignExtend(_EO.result, 31u);
+}
+void Machine::Memory() 
+{
+    // out of bounds checks are done inside of MemoryWrite and MemoryRead
+
+    // Read or Write based on the Opcode
+    // Determine the size based on the funct3
+
+    switch (_DO.op)
+    {
+    case STORE:
+        switch (_DO.funct3) 
+        {
+        case 0b000: // SB
+            MemoryWrite<u8>(_EO.result, _DO.rightVal);
+            break;
+        case 0b001: // SH
+            MemoryWrite<u16>(_EO.result, _DO.rightVal);
+            break;
+        case 0b010: // SW
+            MemoryWrite<u32>(_EO.result, _DO.rightVal);
+            break;
+        case 0b011: // SD
+            MemoryWrite<u64>(_EO.result, _DO.rightVal);
+            break;
+        default:
+            std::cerr << "[MEMORY: STORE]: Invalid funct3: " << _DO.funct3 << '\n';
+            break;
+        }
+        break;
+
+    case LOAD:
+        switch (_DO.funct3) 
+        {
+        case 0b000: // LB
+            _MO.value = MemoryRead<i8>(_EO.result);
+            break;
+        case 0b001: // LH
+            _MO.value = MemoryRead<i16>(_EO.result);
+            break;
+        case 0b010: // LW 
+            _MO.value = MemoryRead<i32>(_EO.result);
+            break;
+        case 0b011: // LD 
+            _MO.value = MemoryRead<i64>(_EO.result);
+            break;
+        case 0b100: // LBU
+            _MO.value = MemoryRead<u8>(_EO.result);
+            break;
+        case 0b101: // LHU
+            _MO.value = MemoryRead<u16>(_EO.result);
+            break;
+        case 0b110: // LWU
+            _MO.value = MemoryRead<u32>(_EO.result);
+            break;
+        default:
+            std::cerr << "[MEMORY: LOAD]: Invalid funct3: " << _DO.funct3 << '\n';
+            break;
+        }
+        break;
+
+    case SYSTEM:
+        // CSR instructions swap with the CSR here, ecall waits for WriteBack
+        _MO.value = 0;
+        if (_DO.funct3 != 0)
+        {
+            u8 rs1 = (_FO.instruction >> 15) & 0x1f;
+            _MO.value = Csr(_DO.rightVal & 0xfff, (_DO.funct3 & 0b11) == 0b01 || rs1 != 0);
+        }
+        break;
+
+    case MISC_MEM:
+        if (_DO.inst == Inst::PAUSE)
+            std::this_thread::yield();
+        else
+            Fence(_DO.funct3 == 0b001);
+        _MO.value = 0;
+        break;
+
+    case AMO:
+        // the address is rs1 as it is, not rs1 plus an offset
+        if (_DO.funct3 == 0b010)
+            _MO.value = Amo<i32>(_DO.inst, _DO.leftVal, _DO.rightVal);
+        else if (_DO.funct3 == 0b011)
+            _MO.value = Amo<i64>(_DO.inst, _DO.leftVal, _DO.rightVal);
+        else
+            std::cerr << "[MEMORY: AMO]: Invalid funct3: " << _DO.funct3 << '\n';
+        break;
+
+    default:
+        // If this is not a LOAD or STORE, then this stage just copies
+        // the ALU result.
+        _MO.value = _EO.result;
+    }
+}
+bool Machine::WriteBack()
+{
+// (1) write a result to the RD register 
+    // SetXReg automatically restores x0 to 0
+    if (_DO.op == JALR || _DO.op == JAL)
+        SetXReg(_DO.rd, GetPC()+4);
+    else
+        SetXReg(_DO.rd, _MO.value);
+    // std::cout << "Writeback: " << (int)_DO.rd << " = " << GetXReg(_DO.rd) << '\n';
+
+// (2) offset the program counter (+4 for all instructions except BRANCH, JAL, and JALR) 
+    i64 pc = GetPC();
+    switch (_DO.op)
+    {
+    case JALR:
+        // new pc calculate in execute, with bit 0 cleared
+        SetPC(_MO.value & ~1ll);
+        break;
+    case JAL:
+        // new pc calculate in execute
+        SetPC(_MO.value);
+        break;
+    case BRANCH:
+    {
+        // add offset to pc if condition is true, other wise add 4
+        // the condition comes straight from comparing the operands
+        bool taken = false;
+        switch (_DO.funct3)
+        {
+        case 0b000: // BEQ
+            taken = _EO.left == _EO.right;
+            break;
+        case 0b001: // BNE
+            taken = _EO.left != _EO.right;
+            break;
+        case 0b100: // BLT
+            taken = _EO.left < _EO.right;
+            break;
+        case 0b101: // BGE
+            taken = _EO.left >= _EO.right;
+            break;
+        case 0b110: // BLTU
+            taken = static_cast<u64>(_EO.left) < static_cast<u64>(_EO.right);
+            break;
+        case 0b111: // BGEU
+            taken = static_cast<u64>(_EO.left) >= static_cast<u64>(_EO.right);
+            break;
+        }
+        if (taken)
+            SetPC(GetPC() + _DO.offset);
+        else   
+            SetPC(GetPC()+4);
+        break;
+    }
+    default:
+        // every other instruction
+        SetPC(GetPC()+4);
+    }
+    if (_profiler)
+        _profiler->Retire(pc, _FO.instruction, GetPC());
+#if MACHINE_COUNTERS
+    if (_counters.enabled)
+        Count(_DO.inst, GetPC() != pc + 4);
+#endif
+    ++_ctx.instret;
+
+// (3) talk to the operating system (for SYSTEM instructions)
+    // return true to go to next instruction
+    // return false to quit program
+    // check if there are any environment calls
+    bool running = true; // go to next instruction
+    if (_DO.op == SYSTEM && _DO.funct3 == 0)
+        running = Ecall();
+    if (_trace)
+        Trace(pc, _FO.instruction, _DO.op);
+    return running;
+}
+bool Machine::Ecall()
+{
+#if MACHINE_COUNTERS
+    if (_counters.enabled)
+        ++_counters.ecalls[GetXReg(17)];
+#endif
+    // look a the a7 register (x17)
+    switch (GetXReg(17))
+    {
+    case 0: // quit the program
+        _console.Flush();
+        return false; 
+    case 1: // getchar
+        SetXReg(10, _console.Get() & 0xff); // store a char in reg a0 (x10)
+        break;
+    case 2: // putchar
+        _console.Put(static_cast<char>(GetXReg(10)));
+        break;
+    case 3: // write a1 bytes from address a0, a0 = bytes written
+    case 4: // read a line of up to a1 bytes to address a0, a0 = bytes read
+    {
+        bool write   = GetXReg(17) == 3;
+        i64 address  = GetXReg(10);
+        i64 numBytes = GetXReg(11);
+        if (numBytes < 0 || address < 0 || address > _memorySize - numBytes)
+        {
+            std::cerr << "[Ecall]: " << numBytes << " bytes at address " << address
+                      << " would access undefined memory (pc " << _ctx.pc << ")\n";
+            SetXReg(10, -1);
+            break;
+        }
+        // a page at a time through a bounce buffer
+        char chunk[PagedMemory::PAGE_SIZE];
+        i64 done = 0;
+        while (done < numBytes)
+        {
+            i64 n = std::min(numBytes - done, PagedMemory::PAGE_SIZE);
+            if (write)
+            {
+                _memory->Read(address + done, chunk, n);
+                _console.Write(chunk, n);
+                done += n;
+                continue;
+            }
+            i64 got = _console.ReadLine(chunk, n);
+            // byte by byte so stores over code are noticed like any other
+            for (i64 i = 0; i < got; ++i)
+                MemoryWrite<u8>(address + done + i, chunk[i]);
+            done += got;
+            if (got < n || chunk[got - 1] == '\n')
+                break;
+        }
+        SetXReg(10, done);
+        break;
+    }
+    case 5: // start a hart at a0 with sp = a1 and a0 = a2, a0 = its id or -1
+        _console.Flush();
+        SetXReg(10, _harts != nullptr ? _harts->Start(GetXReg(10), GetXReg(11), GetXReg(12)) : -1);
+        break;
+    case 6: // wait for hart a0 to stop, a0 = its a0 or -1
+        _console.Flush();
+        SetXReg(10, _harts != nullptr ? _harts->Join(GetXReg(10)) : -1);
+        break;
+    }
+    return true;
+}
+
+i64 Machine::Csr(u32 csr, bool write)
+{
+    switch (csr)
+    {
+    case 0xf14: // mhartid
+        if (write)
+            std::cerr << "[CSR]: mhartid is read-only\n";
+        return _hartId;
+    case 0xc00: // cycle
+    case 0xc01: // time
+    case 0xc02: // instret
+        if (write)
+            std::cerr << "[CSR]: the counters are read-only\n";
+        if (csr == 0xc02)
+            return _ctx.instret;
+        // only RunPipelined counts cycles, the other engines take one per instruction
+        if (csr == 0xc00)
+            return _pipelineStats.cycles > 0 ? _pipelineStats.cycles : _ctx.instret;
+        {
+            // microseconds since the first time any hart read it
+            static const auto START = std::chrono::steady_clock::now();
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - START).count();
+        }
+    }
+    std::cerr << "[CSR]: CSR 0x" << std::hex << csr << std::dec << " is not implemented\n";
+    return 0;
+}
+
+void Machine::Fence(bool instructions)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!instructions)
+        return;
+    // Stores by other harts don't invalidate anything here, so start over.
+    // Pages are marked as code again as they run.
+    for (DecodedInst& di : _decodeCache)
+        di.pc = -1;
+    _codePages.clear();
+    _lastCodePage = -1;
+    if (!_blocks.empty())
+        _flushBlocks = _flushAllBlocks = true;
+}
+
+Machine::FetchOut& Machine::DebugFetchOut()
+{
+    return _FO;
+}
+Machine::DecodeOut& Machine::DebugDecodeOut()
+{
+    return _DO;
+}
+Machine::ExecuteOut& Machine::DebugExecuteOut()
+{
+    return _EO;
+}
+Machine::MemoryOut& Machine::DebugMemoryOut()
+{
+    return _MO;
+}
+
+void Machine::SetCaches(const Caches::Config& l1i, const Caches::Config& l1d, const Caches::Config& l2)
+{
+    _caches.reset(new Caches(l1i, l1d, l2));
+}
+void Machine::SetProfiler(Profiler* profiler)
+{
+    _profiler = profiler;
+}
+
+void Machine::SetTrace(TraceWriter* trace)
+{
+    _trace = trace;
+}
+inline void Machine::Trace(i64 pc, u32 instruction, Opcodes op)
+{
+    // the rest DecodeTrace gets by running the instruction again
+    u32 rd = 0;
+    if (op == LOAD || op == AMO)
+        rd = (instruction >> 7) & 0x1f;
+    else if (op == SYSTEM)
+        rd = ((instruction >> 12) & 0x7) == 0 ? 10 : (instruction >> 7) & 0x1f; // ecalls answer in a0
+    _trace->Record(pc, instruction, _ctx.pc, rd, _ctx.regs[rd]);
+}
+
+bool Machine::Replay(u32 instruction)
+{
+    DecodedInst di;
+    DecodeInstruction(instruction, di);
+    switch (di.op)
+    {
+    case LOAD:
+    case STORE:
+    case AMO:
+    case SYSTEM:
+    case MISC_MEM:
+    case UNIMPL:
+        return false;
+    default:
+        di.pc = _ctx.pc;
+        FastHandlers()[static_cast<i32>(di.inst)](*this, di);
+        return true;
+    }
+}
+
+#if MACHINE_COUNTERS
+void Machine::SetCounters(bool enabled)
+{
+    _counters.enabled = enabled;
+}
+inline void Machine::Count(Inst inst, bool jumped)
+{
+    ++_counters.insts[static_cast<i32>(inst)];
+    if (inst >= Inst::BEQ && inst <= Inst::BGEU)
+        ++(jumped ? _counters.taken : _counters.notTaken);
+}
+void Machine::WriteCounters(std::ostream& out) const
+{
+    static const char* const INSTS[NUM_INSTS] = {
+        "LB", "LH", "LW", "LD", "LBU", "LHU", "LWU",
+        "SB", "SH", "SW", "SD",
+        "BEQ", "BNE", "BLT", "BGE", "BLTU", "BGEU",
+        "JALR", "JAL", "AUIPC", "LUI",
+        "ADDI", "SLTI", "SLTIU", "XORI", "ORI", "ANDI", "SLLI", "SRLI", "SRAI",
+        "ADD", "SUB", "SLL", "SLT", "SLTU", "XOR", "SRL", "SRA", "OR", "AND",
+        "MUL", "MULH", "MULHSU", "MULHU", "DIV", "DIVU", "REM", "REMU",
+        "ADDIW", "SLLIW", "SRLIW", "SRAIW",
+        "ADDW", "SUBW", "SLLW", "SRLW", "SRAW",
+        "MULW", "DIVW", "DIVUW", "REMW", "REMUW",
+        "SH1ADD", "SH2ADD", "SH3ADD", "ADD_UW", "SH1ADD_UW", "SH2ADD_UW", "SH3ADD_UW", "SLLI_UW",
+        "ANDN", "ORN", "XNOR", "CLZ", "CLZW", "CTZ", "CTZW", "CPOP", "CPOPW",
+        "MAX", "MAXU", "MIN", "MINU", "SEXT_B", "SEXT_H", "ZEXT_H",
+        "ROL", "ROLW", "ROR", "RORI", "RORIW", "RORW", "ORC_B", "REV8",
+        "BCLR", "BCLRI", "BEXT", "BEXTI", "BINV", "BINVI", "BSET", "BSETI",
+        "ECALL", "CSRRW", "CSRRS", "CSRRC", "CSRRWI", "CSRRSI", "CSRRCI",
+        "FENCE", "FENCE_I", "PAUSE",
+        "LR_W", "SC_W", "AMOSWAP_W", "AMOADD_W", "AMOXOR_W", "AMOAND_W", "AMOOR_W",
+        "AMOMIN_W", "AMOMAX_W", "AMOMINU_W", "AMOMAXU_W",
+        "LR_D", "SC_D", "AMOSWAP_D", "AMOADD_D", "AMOXOR_D", "AMOAND_D", "AMOOR_D",
+        "AMOMIN_D", "AMOMAX_D", "AMOMINU_D", "AMOMAXU_D",
+        "ILLEGAL"
+    };
+    static const char* const OPCODES[] = {
+        "LOAD", "STORE", "BRANCH", "JALR", "JAL", "OP_IMM", "OP", "AUIPC", "LUI",
+        "OP_IMM_32", "OP_32", "SYSTEM", "MISC_MEM", "AMO", "UNIMPL"
+    };
+    static const char* const ALUS[] = {
+        "ADD", "SUB", "MUL", "DIV", "REM", "SLL", "SRL", "SRA",
+        "AND", "OR", "XOR", "NOT", "SLT", "SLTU",
+        "MULH", "MULHSU", "MULHU", "DIVU", "REMU",
+        "SH1ADD", "SH2ADD", "SH3ADD", "ANDN", "ORN", "XNOR",
+        "CLZ", "CLZW", "CTZ", "CTZW", "CPOP",
+        "MAX", "MAXU", "MIN", "MINU", "SEXT_B", "SEXT_H", "ZEXT_H",
+        "ROL", "ROLW", "ROR", "RORW", "ORC_B", "REV8",
+        "BCLR", "BEXT", "BINV", "BSET", "NO_OP"
+    };
+
+    // the opcode and ALU command of each instruction, as Decode and
+    // Execute see them (addresses are added, branches compared by SUB),
+    // from its row in SPECS
+    Opcodes opOf[NUM_INSTS];
+    for (i32 i = 0; i < NUM_INSTS; ++i)
+        opOf[i] = UNIMPL;
+    for (const InstSpec& spec : SPECS)
+        opOf[static_cast<i32>(spec.inst)] = spec.op;
+
+    i64 ops[UNIMPL + 1] = {};
+    i64 alu[NO_OP + 1] = {};
+    for (i32 i = 0; i < NUM_INSTS; ++i)
+    {
+        ops[opOf[i]] += _counters.insts[i];
+        alu[INST_ALU[i]] += _counters.insts[i];
+    }
+    // "name": count pairs, leaving out the zeros
+    auto object = [&out](const char* const* names, const i64* counts, i32 first, i32 last)
+    {
+        out << '{';
+        const char* comma = "";
+        for (i32 i = first; i <= last; ++i)
+        {
+            if (counts[i] == 0)
+                continue;
+            out << comma << '"' << names[i] << "\": " << counts[i];
+            comma = ", ";
+        }
+        out << '}';
+    };
+
+    i64 cycles = _pipelineStats.cycles > 0 ? _pipelineStats.cycles : _ctx.instret;
+    out << "{\n  \"hart\": " << _hartId << ",\n  \"instret\": " << _ctx.instret
+        << ",\n  \"cycle\": " << cycles << ",\n  \"opcodes\": ";
+    object(OPCODES, ops, 0, UNIMPL);
+    out << ",\n  \"alu\": ";
+    object(ALUS, alu, 0, NO_OP);
+    out << ",\n  \"branches\": {\"taken\": " << _counters.taken << ", \"not_taken\": " << _counters.notTaken << '}';
+    out << ",\n  \"loads\": ";
+    object(INSTS, _counters.insts, static_cast<i32>(Inst::LB), static_cast<i32>(Inst::LWU));
+    out << ",\n  \"stores\": ";
+    object(INSTS, _counters.insts, static_cast<i32>(Inst::SB), static_cast<i32>(Inst::SD));
+    out << ",\n  \"ecalls\": {";
+    const char* comma = "";
+    for (const auto& entry : _counters.ecalls)
+    {
+        out << comma << '"' << entry.first << "\": " << entry.second;
+        comma = ", ";
+    }
+    out << "},\n  \"instructions\": ";
+    object(INSTS, _counters.insts, 0, NUM_INSTS - 1);
+    out << "\n}\n";
+}
+#endif
+void Machine::PrintCacheStats(std::ostream& out) const
+{
+    if (_caches)
+        _caches->PrintStats(out, 10);
+}
+
+void Machine::SetDecodeCache(bool enabled)
+{
+    // entries can go stale while the cache is off, so start over either way
+    _decodeCacheEnabled = enabled;
+    for (DecodedInst& di : _decodeCache)
+        di.pc = -1;
+}
+
+template <typename T>
+T Machine::MemoryRead(i64 address) const
+{
+    if (_caches)
+        _caches->Load(_ctx.pc, address, sizeof(T));
+    return MemoryPeek<T>(address);
+}
+template <typename T>
+T Machine::MemoryPeek(i64 address) const
+{
+    const i64 PAGE_SIZE = PagedMemory::PAGE_SIZE;
+    i64 numBytes = static_cast<i64>(sizeof(T));
+    i64 offset   = address & (PAGE_SIZE - 1);
+
+    // guarded memory: anything past the end lands in the guard and faults
+    if (_flat != nullptr && static_cast<u64>(address) < _flatLimit)
+    {
+        T value = *reinterpret_cast<const T*>(_flat + address);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if (!PagedMemory::faulted || GuardFault(address, numBytes, false))
+            return value;
+        return T(); // 0
+    }
+
+    // fast path: the page is in the TLB and the value doesn't run onto the next page
+    u64 page = static_cast<u64>(address) >> PagedMemory::PAGE_BITS;
+    TlbEntry& entry = _readTlb[page & (TLB_SIZE - 1)];
+    if (entry.page == page && offset <= PAGE_SIZE - numBytes)
+        return *reinterpret_cast<T*>(entry.host + offset);
+
+    // address cannot be negative
+    // memory has addresses [0, _memorySize-1] (inclusive)
+    // the max value of address is _memorySize - sizeof(T) (number of bytes in T)
+
+    // example: T = char: max address = _memorySize-1  
+    //          T =  i64: max address = _memorySize-8  
+
+    if (address < 0 || address > _memorySize-numBytes)
+    {
+        std::cerr << "[MemoryRead]: address " << address << " would access undefined memory (pc "
+                  << _ctx.pc << ")\n";
+        return T(); // 0
+    }
+
+    // a value split across two pages is put together a byte at a time
+    T value;
+    if (offset > PAGE_SIZE - numBytes)
+    {
+        _memory->Read(address, reinterpret_cast<char*>(&value), numBytes);
+        return value;
+    }
+    entry.page = page;
+    entry.host = _memory->Page(address);
+    return *reinterpret_cast<T*>(entry.host + offset);
+}
+
+template <typename T>
+void Machine::MemoryWrite(i64 address, T value)
+{
+    const i64 PAGE_SIZE = PagedMemory::PAGE_SIZE;
+    i64 numBytes = static_cast<i64>(sizeof(T));
+    i64 offset   = address & (PAGE_SIZE - 1);
+    if (_caches)
+        _caches->Store(_ctx.pc, address, numBytes);
+
+    // guarded memory: the guard and code pages are read-only, so the store
+    // faults if it needs anything more done, unless it's to code that was
+    // left writable
+    if (_flat != nullptr && static_cast<u64>(address) < _flatLimit)
+    {
+        *reinterpret_cast<T*>(_flat + address) = value;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if (PagedMemory::faulted)
+        {
+            if (GuardFault(address, numBytes, true))
+                CodeWritten(address, numBytes);
+        }
+        else if (!_writableCode.empty() && WritableCode(address, numBytes))
+            CodeStored(address, numBytes);
+        return;
+    }
+
+    // fast path, only ever taken for pages that hold no decoded instructions
+    u64 page = static_cast<u64>(address) >> PagedMemory::PAGE_BITS;
+    TlbEntry& entry = _writeTlb[page & (TLB_SIZE - 1)];
+    if (entry.page == page && offset <= PAGE_SIZE - numBytes)
+    {
+        *reinterpret_cast<T*>(entry.host + offset) = value;
+        return;
+    }
+
+    // address cannot be negative
+    // memory has addresses [0, _memorySize-1] (inclusive)
+    // the max value of address is _memorySize - sizeof(T) (number of bytes in T)
+
+    if (address < 0 || address > _memorySize-numBytes)
+    {
+        std::cerr << "[MemoryWrite]: address " << address << " would access undefined memory (pc "
+                  << _ctx.pc << ")\n";
+        return;
+    }
+
+    u64 lastPage = static_cast<u64>(address + numBytes - 1) >> PagedMemory::PAGE_BITS;
+    if (_codePages.count(page) || _codePages.count(lastPage))
+    {
+        // storing over code: anything decoded or translated from it is stale
+        CodeStored(address, numBytes);
+    }
+    else if (page == lastPage)
+    {
+        entry.page = page;
+        entry.host = _memory->Page(address);
+    }
+
+    if (page != lastPage)
+        _memory->Write(address, reinterpret_cast<const char*>(&value), numBytes);
+    else
+        *reinterpret_cast<T*>(_memory->Page(address) + offset) = value;
+}
+
+template <typename T>
+i64 Machine::Amo(Inst inst, i64 address, T value)
+{
+    i64 numBytes = static_cast<i64>(sizeof(T));
+    bool write = inst != Inst::LR_W && inst != Inst::LR_D;
+    if (address & (numBytes - 1))
+    {
+        std::cerr << "[AMO]: address " << address << " is not aligned\n";
+        return 0;
+    }
+    if (_caches && write)
+        _caches->Store(_ctx.pc, address, numBytes);
+    else if (_caches)
+        _caches->Load(_ctx.pc, address, numBytes);
+
+    // aligned, so it never runs onto the next page
+    T* host;
+    bool guarded = _flat != nullptr && static_cast<u64>(address) < _flatLimit;
+    if (guarded)
+        host = reinterpret_cast<T*>(_flat + address);
+    else
+    {
+        if (address < 0 || address > _memorySize - numBytes)
+        {
+            std::cerr << "[AMO]: address " << address << " would access undefined memory (pc "
+                      << _ctx.pc << ")\n";
+            return 0;
+        }
+        host = reinterpret_cast<T*>(_memory->Page(address) + (address & (PagedMemory::PAGE_SIZE - 1)));
+        if (write && _codePages.count(static_cast<u64>(address) >> PagedMemory::PAGE_BITS))
+            CodeStored(address, numBytes);
+    }
+
+    // min and max have no single host instruction, so they loop on a compare-and-swap
+    auto update = [host, value](auto pick)
+    {
+        T old = __atomic_load_n(host, __ATOMIC_SEQ_CST);
+        while (!__atomic_compare_exchange_n(host, &old, pick(old, value), true,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            ;
+        return old;
+    };
+    using U = typename std::make_unsigned<T>::type;
+
+    i64 result = 0;
+    switch (inst)
+    {
+    case Inst::LR_W: 
+    case Inst::LR_D:
+        result = __atomic_load_n(host, __ATOMIC_SEQ_CST);
+        _reservedAt = address;
+        _reservedBytes = numBytes;
+        _reservedValue = result;
+        break;
+    case Inst::SC_W: 
+    case Inst::SC_D:
+    {
+        // 0 if the store happened, 1 if it didn't
+        result = 1;
+        T expected = static_cast<T>(_reservedValue);
+        if (_reservedAt == address && _reservedBytes == numBytes
+            && __atomic_compare_exchange_n(host, &expected, value, false,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            result = 0;
+        _reservedAt = -1;
+        break;
+    }
+    case Inst::AMOSWAP_W: 
+    case Inst::AMOSWAP_D:
+        result = __atomic_exchange_n(host, value, __ATOMIC_SEQ_CST);
+        break;
+    case Inst::AMOADD_W: 
+    case Inst::AMOADD_D:
+        // unsigned so it wraps
+        result = static_cast<T>(__atomic_fetch_add(reinterpret_cast<U*>(host), 
+                                                   static_cast<U>(value), __ATOMIC_SEQ_CST));
+        break;
+    case Inst::AMOXOR_W: 
+    case Inst::AMOXOR_D:
+        result = __atomic_fetch_xor(host, value, __ATOMIC_SEQ_CST);
+        break;
+    case Inst::AMOAND_W: 
+    case Inst::AMOAND_D:
+        result = __atomic_fetch_and(host, value, __ATOMIC_SEQ_CST);
+        break;
+    case Inst::AMOOR_W: 
+    case Inst::AMOOR_D:
+        result = __atomic_fetch_or(host, value, __ATOMIC_SEQ_CST);
+        break;
+    case Inst::AMOMIN_W: 
+    case Inst::AMOMIN_D:
+        result = update([](T a, T b) { return std::min(a, b); });
+        break;
+    case Inst::AMOMAX_W: 
+    case Inst::AMOMAX_D:
+        result = update([](T a, T b) { return std::max(a, b); });
+        break;
+    case Inst::AMOMINU_W: 
+    case Inst::AMOMINU_D:
+        result = update([](T a, T b) { return static_cast<U>(a) < static_cast<U>(b) ? a : b; });
+        break;
+    case Inst::AMOMAXU_W: 
+    case Inst::AMOMAXU_D:
+        result = update([](T a, T b) { return static_cast<U>(a) > static_cast<U>(b) ? a : b; });
+        break;
+    default:
+        break;
+    }
+
+    // same as MemoryWrite, the guard and code pages fault
+    if (guarded)
+    {
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        if (PagedMemory::faulted)
+        {
+            if (!GuardFault(address, numBytes, write))
+                return 0;
+            CodeWritten(address, numBytes);
+        }
+        else if (write && !_writableCode.empty() && WritableCode(address, numBytes))
+            CodeStored(address, numBytes);
+    }
+    return result;
+}
+
+void Machine::MarkCode(i64 pc)
+{
+    u64 page = static_cast<u64>(pc) >> PagedMemory::PAGE_BITS;
+    if (page == _lastCodePage)
+        return;
+    _lastCodePage = page;
+    if (!_codePages.insert(page).second)
+        return;
+    // take the page out of the write TLB so stores to it go the slow way
+    if (_writeTlb[page & (TLB_SIZE - 1)].page == page)
+        _writeTlb[page & (TLB_SIZE - 1)].page = -1;
+    if (_flat != nullptr && (_writableCode.empty() || !_writableCode[page]))
+        _memory->Protect(pc, true);
+}
+
+bool Machine::GuardFault(i64 address, i64 numBytes, bool write) const
+{
+    PagedMemory::faulted = 0;
+    if (address > _memorySize - numBytes)
+    {
+        _memory->Reguard(address, numBytes);
+        std::cerr << (write ? "[MemoryWrite]" : "[MemoryRead]") << ": address " << address
+                  << " would access undefined memory (pc " << _ctx.pc << ")\n";
+        return false;
+    }
+    return true;
+}
+void Machine::CodeWritten(i64 address, i64 numBytes)
+{
+    // the store went through on a code page the handler opened up
+    if (_writableCode.empty())
+    {
+        _writableCode.resize((_memorySize >> PagedMemory::PAGE_BITS) + 1);
+        // compiled stores only check _writableCode once it's there
+        if (!_blocks.empty())
+            _flushBlocks = _flushAllBlocks = true;
+    }
+    _writableCode[static_cast<u64>(address) >> PagedMemory::PAGE_BITS] = 1;
+    _writableCode[static_cast<u64>(address + numBytes - 1) >> PagedMemory::PAGE_BITS] = 1;
+    CodeStored(address, numBytes);
+}
+void Machine::CodeStored(i64 address, i64 numBytes)
+{
+    if (_decodeCacheEnabled)
+        InvalidateDecodeCache(address, numBytes);
+    if (!_blocks.empty())
+        StaleBlocks(address, numBytes);
+}
+
+i64 Machine::SignExtend(u64 value, u32 index) const
+{
+    if ((value >> index) & 1) 
+    {
+        // Sign bit is 1
+        return value | (-1ull << index);
+    }
+    else 
+    {
+        // Sign bit is 0
+        return value & ~(-1ull << index);
+    }  
+}
+
+void Machine::InvalidateDecodeCache(i64 address, i64 numBytes)
+{
+    // a store can straddle two instruction words, so check every word it touches
+    for (i64 word = address & ~3ll; word < address + numBytes; word += 4)
+    {
+        DecodedInst& di = _decodeCache[(word >> 2) & (DECODE_CACHE_SIZE - 1)];
+        if (di.pc == word)
+            di.pc = -1;
+    }
+}
+
+// RISC-V division never traps: dividing by zero gives all ones, or the
+// dividend for the remainder, and the one signed overflow (the most
+// negative number by -1) gives the dividend back, with a remainder of 0.
+// The host traps on both, so those divide by 1 instead, which is already
+// the right answer for overflow, and dividing by zero is picked out after.
+// Both choices compile to conditional moves, not branches. For the
+// unsigned types the overflow test is 0 by the largest value, which
+// divides by 1 harmlessly.
+template <typename T>
+inline T Divide(T left, T right)
+{
+    bool zero = right == 0;
+    bool overflow = left == std::numeric_limits<T>::min() && right == static_cast<T>(-1);
+    T quotient = left / (zero || overflow ? T(1) : right);
+    return zero ? static_cast<T>(-1) : quotient;
+}
+template <typename T>
+inline T Remainder(T left, T right)
+{
+    bool zero = right == 0;
+    bool overflow = left == std::numeric_limits<T>::min() && right == static_cast<T>(-1);
+    T remainder = left % (zero || overflow ? T(1) : right);
+    return zero ? left : remainder;
+}
+
+// Zbb's counts give the width for no bits set. With -mlzcnt, -mbmi and
+// -mpopcnt (or -march=native) each is a single lzcnt, tzcnt or popcnt.
+inline i64 LeadingZeros(u64 value)
+{
+    return value == 0 ? 64 : __builtin_clzll(value);
+}
+inline i64 LeadingZeros32(u32 value)
+{
+    return value == 0 ? 32 : __builtin_clz(value);
+}
+inline i64 TrailingZeros(u64 value)
+{
+    return value == 0 ? 64 : __builtin_ctzll(value);
+}
+inline i64 TrailingZeros32(u32 value)
+{
+    return value == 0 ? 32 : __builtin_ctz(value);
+}
+// these come out as a rol or ror
+inline u64 RotateLeft(u64 value, i64 by)
+{
+    return (value << (by & 63)) | (value >> (-by & 63));
+}
+inline i32 RotateLeft32(u32 value, i64 by)
+{
+    return static_cast<i32>((value << (by & 31)) | (value >> (-by & 31)));
+}
+// orc.b: each byte becomes all ones if it had any bit set
+inline u64 OrCombine(u64 value)
+{
+    const u64 LOW7 = 0x7f7f'7f7f'7f7f'7f7full;
+    u64 high = (((value & LOW7) + LOW7) | value) & ~LOW7;
+    return (high >> 7) * 0xff;
+}
+
+Machine::ExecuteOut Machine::ALU(Machine::Alu cmd, i64 left, i64 right) const
+{
+    ExecuteOut ret;
+
+    // perform the appropriate operation 
+    // store in ExecuteOut
+    switch (cmd) 
+    {
+    case NO_OP:
+        ret.result = 0;
+        break;
+    case ADD:
+        ret.result = left + right;
+        break;
+    case SUB:
+        ret.result = left - right;
+        break;
+    case MUL: // unsigned so it wraps
+        ret.result = static_cast<u64>(left) * static_cast<u64>(right);
+        break;
+    // the high half of the 128-bit product, one multiply on 64-bit hosts
+    case MULH:
+        ret.result = static_cast<i64>((static_cast<__int128>(left) * right) >> 64);
+        break;
+    case MULHSU:
+        ret.result = static_cast<i64>((static_cast<__int128>(left) * static_cast<u64>(right)) >> 64);
+        break;
+    case MULHU:
+        ret.result = static_cast<i64>((static_cast<unsigned __int128>(static_cast<u64>(left)) 
+                                       * static_cast<u64>(right)) >> 64);
+        break;
+    case DIV:
+        ret.result = Divide<i64>(left, right);
+        break;
+    case REM:
+        ret.result = Remainder<i64>(left, right);
+        break;
+    case DIVU:
+        ret.result = static_cast<i64>(Divide<u64>(left, right));
+        break;
+    case REMU:
+        ret.result = static_cast<i64>(Remainder<u64>(left, right));
+        break;
+    case AND:
+        ret.result = left & right;
+        break;
+    case OR:
+        ret.result = left | right;
+        break;
+    case XOR:
+        ret.result = left ^ right;
+        break;
+    case NOT:
+        ret.result = ~right;
+        break;
+    case SRL: // shifts only use the low 6 bits of the amount
+        ret.result = static_cast<u64>(left) >> (right & 63);
+        break;
+    case SLL:
+        ret.result = static_cast<u64>(left) << (right & 63);
+        break;
+    case SRA:
+        ret.result = left >> (right & 63);
+        break;
+    case SLT:
+        ret.result = left < right;
+        break;
+    case SLTU:
+        ret.result = static_cast<u64>(left) < static_cast<u64>(right);
+        break;
+    case SH1ADD:
+    case SH2ADD:
+    case SH3ADD:
+        ret.result = (static_cast<u64>(left) << (cmd - SH1ADD + 1)) + right;
+        break;
+    case ANDN:
+        ret.result = left & ~right;
+        break;
+    case ORN:
+        ret.result = left | ~right;
+        break;
+    case XNOR:
+        ret.result = ~(left ^ right);
+        break;
+    case CLZ:
+        ret.result = LeadingZeros(left);
+        break;
+    case CLZW:
+        ret.result = LeadingZeros32(left);
+        break;
+    case CTZ:
+        ret.result = TrailingZeros(left);
+        break;
+    case CTZW:
+        ret.result = TrailingZeros32(left);
+        break;
+    case CPOP:
+        ret.result = __builtin_popcountll(left);
+        break;
+    case MAX:
+        ret.result = std::max(left, right);
+        break;
+    case MAXU:
+        ret.result = std::max(static_cast<u64>(left), static_cast<u64>(right));
+        break;
+    case MIN:
+        ret.result = std::min(left, right);
+        break;
+    case MINU:
+        ret.result = std::min(static_cast<u64>(left), static_cast<u64>(right));
+        break;
+    case SEXT_B:
+        ret.result = static_cast<i8>(left);
+        break;
+    case SEXT_H:
+        ret.result = static_cast<i16>(left);
+        break;
+    case ZEXT_H:
+        ret.result = static_cast<u16>(left);
+        break;
+    case ROL:
+        ret.result = RotateLeft(left, right);
+        break;
+    case ROLW:
+        ret.result = RotateLeft32(left, right);
+        break;
+    case ROR:
+        ret.result = RotateLeft(left, -right);
+        break;
+    case RORW:
+        ret.result = RotateLeft32(left, -right);
+        break;
+    case ORC_B:
+        ret.result = OrCombine(left);
+        break;
+    case REV8:
+        ret.result = __builtin_bswap64(left);
+        break;
+    case BCLR:
+        ret.result = left & ~(1ll << (right & 63));
+        break;
+    case BEXT:
+        ret.result = (left >> (right & 63)) & 1;
+        break;
+    case BINV:
+        ret.result = left ^ (1ll << (right & 63));
+        break;
+    case BSET:
+        ret.result = left | (1ll << (right & 63));
+        break;
+    }
+
+    // Flags are left for later, just remember how we got the result
+    ret.cmd   = cmd;
+    ret.left  = left;
+    ret.right = right;
+
+    return ret;
+}
+
+// The flags, determined from the result and the operands when asked for
+u8 Machine::ExecuteOut::N() const
+{
+    return (result >> 63) & 1;
+}
+u8 Machine::ExecuteOut::Z() const
+{
+    return !result;
+}
+u8 Machine::ExecuteOut::C() const
+{
+    return (result > left) || (result > right);
+}
+u8 Machine::ExecuteOut::V() const
+{
+    u8 sign_left   = (left   >> 63) & 1;
+    u8 sign_right  = (right  >> 63) & 1;
+    u8 sign_result = (result >> 63) & 1;
+    return (~sign_left & ~sign_right &  sign_result) |
+           ( sign_left &  sign_right & ~sign_result);
+}
+
+inline const Machine::DecodedInst& Machine::FetchDecoded()
+{
+    DecodedInst& di = _decodeCacheEnabled 
+        ? _decodeCache[(_ctx.pc >> 2) & (DECODE_CACHE_SIZE - 1)] 
+        : _uncached;
+    if (_decodeCacheEnabled && di.pc == _ctx.pc)
+        return di;
+
+    DecodeAt(_ctx.pc, di);
+    return di;
+}
+void Machine::DecodeAt(i64 pc, DecodedInst& di)
+{
+    u32 instruction = MemoryPeek<u32>(pc);
+    if ((instruction & 0b11) != 3)
+    {
+        std::cerr << "[DECODE] Invalid instruction (not a 32-bit instruction).\n";
+        di.pc = -1;
+        di.inst = Inst::ILLEGAL;
+        return;
+    }
+    if (!Predecoded(pc, instruction, di))
+        DecodeInstruction(instruction, di);
+    di.pc = di.op == UNIMPL ? -1 : pc;
+    MarkCode(pc);
+}
+
+const Machine::Handler* Machine::FastHandlers()
+{
+    struct Table { Handler at[NUM_INSTS]; };
+
+    // built once, the first time any machine runs the fast core
+    static const Table table = [] 
+    {
+        Table t = {};
+        auto set = [&t](Inst inst, Handler h) { t.at[static_cast<i32>(inst)] = h; };
+
+        // a = rs1, b = rs2 or the immediate, result goes to rd
+        // arithmetic is done unsigned so overflow wraps instead of being undefined
+#define REG_OP(NAME, EXPR) \
+        set(Inst::NAME, [](Machine& m, const PackedOp& d) { \
+            i64 a = m.GetXReg(d.rs1); i64 b = m.GetXReg(d.rs2); \
+            m.SetXReg(d.rd, (EXPR)); m._ctx.pc += 4; return true; })
+#define IMM_OP(NAME, EXPR) \
+        set(Inst::NAME, [](Machine& m, const PackedOp& d) { \
+            i64 a = m.GetXReg(d.rs1); i64 b = d.imm; \
+            m.SetXReg(d.rd, (EXPR)); m._ctx.pc += 4; return true; })
+#define LOAD_OP(NAME, T) \
+        set(Inst::NAME, [](Machine& m, const PackedOp& d) { \
+            m.SetXReg(d.rd, m.MemoryRead<T>(m.GetXReg(d.rs1) + d.imm)); m._ctx.pc += 4; return true; })
+#define STORE_OP(NAME, T) \
+        set(Inst::NAME, [](Machine& m, const PackedOp& d) { \
+            m.MemoryWrite<T>(m.GetXReg(d.rs1) + d.imm, m.GetXReg(d.rs2)); m._ctx.pc += 4; return true; })
+#define UNARY_OP(NAME, EXPR) \
+        set(Inst::NAME, [](Machine& m, const PackedOp& d) { \
+            i64 a = m.GetXReg(d.rs1); m.SetXReg(d.rd, (EXPR)); m._ctx.pc += 4; return true; })
+#define BRANCH_OP(NAME, COND) \
+        set(Inst::NAME, [](Machine& m, const PackedOp& d) { \
+            i64 a = m.GetXReg(d.rs1); i64 b = m.GetXReg(d.rs2); \
+            m._ctx.pc += (COND) ? d.imm : 4; return true; })
+
+        LOAD_OP(LB,  i8);
+        LOAD_OP(LH,  i16);
+        LOAD_OP(LW,  i32);
+        LOAD_OP(LD,  i64);
+        LOAD_OP(LBU, u8);
+        LOAD_OP(LHU, u16);
+        LOAD_OP(LWU, u32);
+
+        STORE_OP(SB, u8);
+        STORE_OP(SH, u16);
+        STORE_OP(SW, u32);
+        STORE_OP(SD, u64);
+
+        BRANCH_OP(BEQ,  a == b);
+        BRANCH_OP(BNE,  a != b);
+        BRANCH_OP(BLT,  a < b);
+        BRANCH_OP(BGE,  a >= b);
+        BRANCH_OP(BLTU, static_cast<u64>(a) <  static_cast<u64>(b));
+        BRANCH_OP(BGEU, static_cast<u64>(a) >= static_cast<u64>(b));
+
+        set(Inst::JALR, [](Machine& m, const PackedOp& d) {
+            // rd can be rs1, so work out the target first
+            i64 target = (m.GetXReg(d.rs1) + d.imm) & ~1ll;
+            m.SetXReg(d.rd, m._ctx.pc + 4);
+            m._ctx.pc = target;
+            return true;
+        });
+        set(Inst::JAL, [](Machine& m, const PackedOp& d) {
+            m.SetXReg(d.rd, m._ctx.pc + 4);
+            m._ctx.pc += d.imm;
+            return true;
+        });
+        set(Inst::AUIPC, [](Machine& m, const PackedOp& d) {
+            m.SetXReg(d.rd, m._ctx.pc + d.imm);
+            m._ctx.pc += 4;
+            return true;
+        });
+        set(Inst::LUI, [](Machine& m, const PackedOp& d) {
+            m.SetXReg(d.rd, d.imm);
+            m._ctx.pc += 4;
+            return true;
+        });
+
+        IMM_OP(ADDI,  static_cast<u64>(a) + b);
+        IMM_OP(SLTI,  a < b);
+        IMM_OP(SLTIU, static_cast<u64>(a) < static_cast<u64>(b));
+        IMM_OP(XORI,  a ^ b);
+        IMM_OP(ORI,   a | b);
+        IMM_OP(ANDI,  a & b);
+        IMM_OP(SLLI,  static_cast<u64>(a) << (b & 63));
+        IMM_OP(SRLI,  static_cast<u64>(a) >> (b & 63));
+        IMM_OP(SRAI,  a >> (b & 63));
+
+        REG_OP(ADD,  static_cast<u64>(a) + b);
+        REG_OP(SUB,  static_cast<u64>(a) - b);
+        REG_OP(SLL,  static_cast<u64>(a) << (b & 63));
+        REG_OP(SLT,  a < b);
+        REG_OP(SLTU, static_cast<u64>(a) < static_cast<u64>(b));
+        REG_OP(XOR,  a ^ b);
+        REG_OP(SRL,  static_cast<u64>(a) >> (b & 63));
+        REG_OP(SRA,  a >> (b & 63));
+        REG_OP(OR,   a | b);
+        REG_OP(AND,  a & b);
+
+        // division follows the RISC-V rules for dividing by zero and overflow
+        REG_OP(MUL,    static_cast<u64>(a) * b);
+        REG_OP(MULH,   (static_cast<__int128>(a) * b) >> 64);
+        REG_OP(MULHSU, (static_cast<__int128>(a) * static_cast<u64>(b)) >> 64);
+        REG_OP(MULHU,  (static_cast<unsigned __int128>(static_cast<u64>(a)) * static_cast<u64>(b)) >> 64);
+        REG_OP(DIV,    Divide<i64>(a, b));
+        REG_OP(DIVU,   static_cast<i64>(Divide<u64>(a, b)));
+        REG_OP(REM,    Remainder<i64>(a, b));
+        REG_OP(REMU,   static_cast<i64>(Remainder<u64>(a, b)));
+
+        // the W forms work on the low 32 bits and sign extend the 32-bit result
+        IMM_OP(ADDIW, static_cast<i32>(static_cast<u64>(a) + b));
+        IMM_OP(SLLIW, static_cast<i32>(static_cast<u32>(a) << (b & 31)));
+        IMM_OP(SRLIW, static_cast<i32>(static_cast<u32>(a) >> (b & 31)));
+        IMM_OP(SRAIW, static_cast<i32>(a) >> (b & 31));
+
+        REG_OP(ADDW, static_cast<i32>(static_cast<u64>(a) + b));
+        REG_OP(SUBW, static_cast<i32>(static_cast<u64>(a) - b));
+        REG_OP(SLLW, static_cast<i32>(static_cast<u32>(a) << (b & 31)));
+        REG_OP(SRLW, static_cast<i32>(static_cast<u32>(a) >> (b & 31)));
+        REG_OP(SRAW, static_cast<i32>(a) >> (b & 31));
+
+        REG_OP(MULW,  static_cast<i32>(static_cast<u64>(a) * b));
+        REG_OP(DIVW,  Divide<i32>(static_cast<i32>(a), static_cast<i32>(b)));
+        REG_OP(DIVUW, static_cast<i32>(Divide<u32>(static_cast<u32>(a), static_cast<u32>(b))));
+        REG_OP(REMW,  Remainder<i32>(static_cast<i32>(a), static_cast<i32>(b)));
+        REG_OP(REMUW, static_cast<i32>(Remainder<u32>(static_cast<u32>(a), static_cast<u32>(b))));
+
+        // Zba: shift and add, the .uw forms zero extend rs1 first
+        REG_OP(SH1ADD,    (static_cast<u64>(a) << 1) + b);
+        REG_OP(SH2ADD,    (static_cast<u64>(a) << 2) + b);
+        REG_OP(SH3ADD,    (static_cast<u64>(a) << 3) + b);
+        REG_OP(ADD_UW,    static_cast<u64>(static_cast<u32>(a)) + b);
+        REG_OP(SH1ADD_UW, (static_cast<u64>(static_cast<u32>(a)) << 1) + b);
+        REG_OP(SH2ADD_UW, (static_cast<u64>(static_cast<u32>(a)) << 2) + b);
+        REG_OP(SH3ADD_UW, (static_cast<u64>(static_cast<u32>(a)) << 3) + b);
+        IMM_OP(SLLI_UW,   static_cast<u64>(static_cast<u32>(a)) << (b & 63));
+
+        // Zbb
+        REG_OP(ANDN,     a & ~b);
+        REG_OP(ORN,      a | ~b);
+        REG_OP(XNOR,     ~(a ^ b));
+        UNARY_OP(CLZ,    LeadingZeros(a));
+        UNARY_OP(CLZW,   LeadingZeros32(a));
+        UNARY_OP(CTZ,    TrailingZeros(a));
+        UNARY_OP(CTZW,   TrailingZeros32(a));
+        UNARY_OP(CPOP,   __builtin_popcountll(a));
+        UNARY_OP(CPOPW,  __builtin_popcount(static_cast<u32>(a)));
+        REG_OP(MAX,      std::max(a, b));
+        REG_OP(MAXU,     std::max(static_cast<u64>(a), static_cast<u64>(b)));
+        REG_OP(MIN,      std::min(a, b));
+        REG_OP(MINU,     std::min(static_cast<u64>(a), static_cast<u64>(b)));
+        UNARY_OP(SEXT_B, static_cast<i8>(a));
+        UNARY_OP(SEXT_H, static_cast<i16>(a));
+        UNARY_OP(ZEXT_H, static_cast<u16>(a));
+        REG_OP(ROL,      RotateLeft(a, b));
+        REG_OP(ROLW,     RotateLeft32(a, b));
+        REG_OP(ROR,      RotateLeft(a, -b));
+        IMM_OP(RORI,     RotateLeft(a, -b));
+        IMM_OP(RORIW,    RotateLeft32(a, -b));
+        REG_OP(RORW,     RotateLeft32(a, -b));
+        UNARY_OP(ORC_B,  OrCombine(a));
+        UNARY_OP(REV8,   __builtin_bswap64(a));
+
+        // Zbs, the bit number is the low 6 bits of rs2 or the immediate
+        REG_OP(BCLR,  a & ~(1ll << (b & 63)));
+        IMM_OP(BCLRI, a & ~(1ll << (b & 63)));
+        REG_OP(BEXT,  (a >> (b & 63)) & 1);
+        IMM_OP(BEXTI, (a >> (b & 63)) & 1);
+        REG_OP(BINV,  a ^ (1ll << (b & 63)));
+        IMM_OP(BINVI, a ^ (1ll << (b & 63)));
+        REG_OP(BSET,  a | (1ll << (b & 63)));
+        IMM_OP(BSETI, a | (1ll << (b & 63)));
+
+#undef REG_OP
+#undef IMM_OP
+#undef UNARY_OP
+#undef LOAD_OP
+#undef STORE_OP
+#undef BRANCH_OP
+
+        set(Inst::ECALL, [](Machine& m, const PackedOp&) {
+            m._ctx.pc += 4;
+            return m.Ecall();
+        });
+        // CSRRS and CSRRC only write with a nonzero rs1 (or immediate)
+        auto csr = [](Machine& m, const PackedOp& d) {
+            bool write = d.inst == Inst::CSRRW || d.inst == Inst::CSRRWI || d.rs1 != 0;
+            m.SetXReg(d.rd, m.Csr(d.imm & 0xfff, write));
+            m._ctx.pc += 4;
+            return true;
+        };
+        set(Inst::CSRRW,  csr);
+        set(Inst::CSRRS,  csr);
+        set(Inst::CSRRC,  csr);
+        set(Inst::CSRRWI, csr);
+        set(Inst::CSRRSI, csr);
+        set(Inst::CSRRCI, csr);
+        set(Inst::FENCE, [](Machine& m, const PackedOp&) {
+            m.Fence(false);
+            m._ctx.pc += 4;
+            return true;
+        });
+        set(Inst::FENCE_I, [](Machine& m, const PackedOp&) {
+            m.Fence(true);
+            m._ctx.pc += 4;
+            return true;
+        });
+        set(Inst::PAUSE, [](Machine& m, const PackedOp&) {
+            // a spinning hart lets the one it waits for have the core
+            std::this_thread::yield();
+            m._ctx.pc += 4;
+            return true;
+        });
+
+        // the address is rs1 with no offset
+#define AMO_OP(NAME, T) \
+        set(Inst::NAME, [](Machine& m, const PackedOp& d) { \
+            m.SetXReg(d.rd, m.Amo<T>(Inst::NAME, m.GetXReg(d.rs1), m.GetXReg(d.rs2))); \
+            m._ctx.pc += 4; return true; })
+
+        AMO_OP(LR_W,      i32);
+        AMO_OP(SC_W,      i32);
+        AMO_OP(AMOSWAP_W, i32);
+        AMO_OP(AMOADD_W,  i32);
+        AMO_OP(AMOXOR_W,  i32);
+        AMO_OP(AMOAND_W,  i32);
+        AMO_OP(AMOOR_W,   i32);
+        AMO_OP(AMOMIN_W,  i32);
+        AMO_OP(AMOMAX_W,  i32);
+        AMO_OP(AMOMINU_W, i32);
+        AMO_OP(AMOMAXU_W, i32);
+        AMO_OP(LR_D,      i64);
+        AMO_OP(SC_D,      i64);
+        AMO_OP(AMOSWAP_D, i64);
+        AMO_OP(AMOADD_D,  i64);
+        AMO_OP(AMOXOR_D,  i64);
+        AMO_OP(AMOAND_D,  i64);
+        AMO_OP(AMOOR_D,   i64);
+        AMO_OP(AMOMIN_D,  i64);
+        AMO_OP(AMOMAX_D,  i64);
+        AMO_OP(AMOMINU_D, i64);
+        AMO_OP(AMOMAXU_D, i64);
+#undef AMO_OP
+        set(Inst::ILLEGAL, [](Machine& m, const PackedOp&) {
+            // same as the five stages: nothing happens and we move on
+            m._ctx.pc += 4;
+            return true;
+        });
+        return t;
+    }();
+    return table.at;
+}
+
+bool Machine::Issue(Slot& slot)
+{
+    slot.valid = true;
+    slot.cause = Stall::NONE;
+    slot.pc = _ctx.pc;
+    Fetch();
+    Decode();
+    Execute();
+    Memory();
+    slot.fo = _FO;
+    slot.dec = _DO;
+    slot.eo = _EO;
+    slot.mo = _MO;
+    bool running = WriteBack();
+    slot.next = _ctx.pc;
+    slot.predicted = slot.pc + 4;
+
+    // Fetch asks the predictor about branches and jumps, and it learns
+    // from them straight away (nothing can pass them in this pipeline)
+    if (_DO.op == BRANCH || _DO.op == JAL || _DO.op == JALR)
+    {
+        auto link = [](u8 reg) { return reg == 1 || reg == 5; };
+        u8 rs1 = (_FO.instruction >> 15) & 0x1f;
+        BranchPredictor::Kind kind = _DO.op == BRANCH ? BranchPredictor::BRANCH
+                                   : _DO.op == JAL ? BranchPredictor::JUMP : BranchPredictor::INDIRECT;
+        i64 target = slot.pc + (_DO.op == BRANCH ? _DO.offset : _DO.rightVal);
+        bool ret = _DO.op == JALR && link(rs1) && !(link(_DO.rd) && _DO.rd == rs1);
+        slot.predicted = _predictor->Predict(slot.pc, kind, target, link(_DO.rd), ret);
+        _predictor->Train(slot.pc, kind, slot.next, slot.predicted);
+    }
+
+    // the registers it reads, from the instruction word
+    u8 rs1 = (_FO.instruction >> 15) & 0x1f;
+    u8 rs2 = (_FO.instruction >> 20) & 0x1f;
+    switch (_DO.op)
+    {
+    case OP:
+    case OP_32:
+    case STORE:
+    case BRANCH:
+    case AMO:
+        break;
+    case LUI:
+    case AUIPC:
+    case JAL:
+    case MISC_MEM:
+        rs1 = rs2 = 0;
+        break;
+    case SYSTEM:
+        // ecall reads a7 and a0, the immediate CSR forms read nothing
+        if (_DO.funct3 == 0)
+        {
+            rs1 = 17;
+            rs2 = 10;
+        }
+        else
+        {
+            rs1 = _DO.funct3 & 0b100 ? 0 : rs1;
+            rs2 = 0;
+        }
+        break;
+    default:
+        rs2 = 0;
+    }
+    slot.rs1 = rs1;
+    slot.rs2 = rs2;
+    slot.late = _DO.op == LOAD || _DO.op == AMO || _DO.op == SYSTEM;
+    return running;
+}
+
+i64 Machine::RunPipelined(i64 endPC)
+{
+    enum { IF, ID, EX, MEM, WB, STAGES };
+    PipelineStats& ps = _pipelineStats;
+    Slot bubble = {};
+    bubble.valid = false;
+    bubble.cause = Stall::FILL;
+    Slot stage[STAGES] = { bubble, bubble, bubble, bubble, bubble };
+    bool wrongPath = false; // fetch went somewhere the last instruction didn't
+    bool done = false;
+    i64 retired = 0;
+    if (!_predictor)
+        _predictor.reset(new BranchPredictor(BranchPredictor::NOT_TAKEN, 0));
+
+    // The next thing for IF: the instruction at the pc, wrong path that a
+    // flush will turn into bubbles, or nothing once the program is over.
+    // Only the first runs, so the machine never goes down the wrong path.
+    auto fetch = [&](Slot& slot)
+    {
+        slot = bubble;
+        slot.cause = Stall::NONE;
+        if (done || wrongPath)
+            return;
+        if (_ctx.pc >= endPC)
+        {
+            done = true;
+            return;
+        }
+        done = !Issue(slot);
+        wrongPath = slot.next != slot.predicted;
+    };
+    auto squash = [&bubble](Slot& slot, Stall cause)
+    {
+        slot = bubble;
+        slot.cause = cause;
+    };
+
+    fetch(stage[IF]);
+    while (true)
+    {
+        ++ps.cycles;
+        const Slot& wb = stage[WB];
+        if (wb.valid)
+        {
+            ++retired;
+            if (wb.dec.op == BRANCH)
+            {
+                ++ps.branches;
+                ps.taken += wb.next != wb.pc + 4;
+            }
+        }
+        else
+        {
+            switch (wb.cause)
+            {
+            case Stall::FILL:     ++ps.fill;    break;
+            case Stall::LOAD_USE: ++ps.loadUse; break;
+            case Stall::DATA:     ++ps.data;    break;
+            case Stall::BRANCH:   ++ps.branch;  break;
+            case Stall::JUMP:     ++ps.jump;    break;
+            default:              break;
+            }
+        }
+
+        // A branch or JALR that didn't fall through flushes the two slots
+        // fetched behind it. Otherwise Decode either waits for an operand
+        // or, for a JAL, sends fetch to the target and flushes the one slot.
+        const Slot& ex = stage[EX];
+        const Slot& id = stage[ID];
+        Stall stall = Stall::NONE;
+        if (ex.valid && (ex.dec.op == BRANCH || ex.dec.op == JALR) && ex.next != ex.predicted)
+        {
+            _predictor->Charge(ex.pc, 2);
+            wrongPath = false;
+            squash(stage[ID], Stall::BRANCH);
+            squash(stage[IF], Stall::BRANCH);
+        }
+        else if (id.valid)
+        {
+            auto writes = [&id](const Slot& producer)
+            {
+                return producer.valid && producer.dec.rd != 0 &&
+                       (producer.dec.rd == id.rs1 || producer.dec.rd == id.rs2);
+            };
+            if (_forwarding && writes(ex) && ex.late)
+                stall = Stall::LOAD_USE;
+            else if (!_forwarding && (writes(ex) || writes(stage[MEM])))
+                stall = Stall::DATA;
+            else if (id.dec.op == JAL && id.next != id.predicted)
+            {
+                _predictor->Charge(id.pc, 1);
+                wrongPath = false;
+                squash(stage[IF], Stall::JUMP);
+            }
+        }
+
+        // everything moves up a stage, except that a stall holds Decode and
+        // Fetch and sends a bubble into Execute
+        stage[WB] = stage[MEM];
+        stage[MEM] = stage[EX];
+        if (stall != Stall::NONE)
+            squash(stage[EX], stall);
+        else
+        {
+            stage[EX] = stage[ID];
+            stage[ID] = stage[IF];
+            fetch(stage[IF]);
+        }
+
+        bool busy = false;
+        for (const Slot& slot : stage)
+            busy |= slot.valid;
+        if (done && !busy)
+            break;
+    }
+    ps.instructions += retired;
+    return retired;
+}
+
+void Machine::SetForwarding(bool enabled)
+{
+    _forwarding = enabled;
+}
+void Machine::SetPredictor(BranchPredictor::Scheme scheme, i32 rasEntries)
+{
+    _predictor.reset(new BranchPredictor(scheme, rasEntries));
+}
+
+const Machine::PipelineStats& Machine::GetPipelineStats() const
+{
+    return _pipelineStats;
+}
+
+void Machine::PrintPipelineStats(std::ostream& out) const
+{
+    const PipelineStats& ps = _pipelineStats;
+    out << "cycles            : " << ps.cycles << " (CPI "
+        << (ps.instructions ? static_cast<double>(ps.cycles) / ps.instructions : 0.0) << ")\n";
+    auto stalls = [&](const char* name, i64 bubbles)
+    {
+        out << name << bubbles << " cycles ("
+            << (ps.cycles ? 100.0 * bubbles / ps.cycles : 0.0) << "%)\n";
+    };
+    stalls("pipeline fill     : ", ps.fill);
+    stalls("load-use stalls   : ", ps.loadUse);
+    if (!_forwarding)
+        stalls("data stalls       : ", ps.data);
+    stalls("branch flushes    : ", ps.branch);
+    stalls("jump flushes      : ", ps.jump);
+    out << "branches taken    : " << ps.taken << " of " << ps.branches << '\n';
+    if (_predictor)
+        _predictor->PrintStats(out, 10);
+}
+
+i64 Machine::RunFast(i64 endPC)
+{
+    const Handler* handlers = FastHandlers();
+    bool watched = _caches || _profiler || _trace;
+#if MACHINE_COUNTERS
+    watched = watched || _counters.enabled;
+#endif
+    if (watched)
+        return RunFastWatched(endPC);
+    i64 start = _ctx.instret;
+    i64 retired = start;
+    while (_ctx.pc < endPC)
+    {
+        const DecodedInst& di = FetchDecoded();
+        _ctx.instret = retired++;
+        if (!handlers[static_cast<i32>(di.inst)](*this, di))
+            break;
+    }
+    _ctx.instret = retired;
+    return retired - start;
+}
+
+i64 Machine::RunFastWatched(i64 endPC)
+{
+    // RunFast, with each instruction fetched through the caches, shown to
+    // the profiler, counted and traced
+    const Handler* handlers = FastHandlers();
+    i64 start = _ctx.instret;
+    i64 retired = start;
+    while (_ctx.pc < endPC)
+    {
+        i64 pc = _ctx.pc;
+        if (_caches)
+            _caches->Fetch(pc);
+        const DecodedInst& di = FetchDecoded();
+        u32 instruction = di.instruction; // a store can overwrite the entry
+        Inst inst = di.inst;
+        Opcodes op = di.op;
+        _ctx.instret = retired++;
+        bool running = handlers[static_cast<i32>(inst)](*this, di);
+        if (_profiler)
+            _profiler->Retire(pc, instruction, _ctx.pc);
+        if (_trace)
+            Trace(pc, instruction, op);
+#if MACHINE_COUNTERS
+        if (_counters.enabled)
+            Count(inst, _ctx.pc != pc + 4);
+#endif
+        if (!running)
+            break;
+    }
+    _ctx.instret = retired;
+    return retired - start;
+}
+
+Machine::Block* Machine::TranslateBlock(i64 endPC)
+{
+    std::unique_ptr<Block> block(new Block());
+    block->pc = _ctx.pc;
+    block->indirect = false;
+    block->exitPC[0] = block->exitPC[1] = -1;
+    block->exit[0] = block->exit[1] = nullptr;
+    block->runs = 0;
+    block->jit = nullptr;
+    block->jitOps = 0;
+
+    i64 pc = _ctx.pc;
+    bool ended = false;
+    while (!ended && pc < endPC && static_cast<i64>(block->ops.size()) < MAX_BLOCK_OPS)
+    {
+        DecodedInst di;
+        DecodeAt(pc, di);
+        block->ops.push_back(di);
+        block->insts.push_back(di);
+
+        switch (di.op)
+        {
+        case BRANCH:
+            block->exitPC[0] = pc + di.imm;
+            block->exitPC[1] = pc + 4;
+            ended = true;
+            break;
+        case JAL:
+            block->exitPC[0] = pc + di.imm;
+            ended = true;
+            break;
+        case JALR:
+            block->indirect = true;
+            ended = true;
+            break;
+        case SYSTEM:
+            block->exitPC[0] = pc + 4;
+            ended = true;
+            break;
+        default:
+            break;
+        }
+        pc += 4;
+    }
+    // ran into the end of the image or the length limit
+    if (!ended)
+        block->exitPC[0] = pc;
+
+    ++_blockStats.translated;
+    _blockStats.translatedOps += block->ops.size();
+    for (i64 word = block->pc; word < pc; word += 4)
+        _translatedWords[static_cast<u64>(word) >> PagedMemory::PAGE_BITS].set((word & (PagedMemory::PAGE_SIZE - 1)) >> 2);
+
+    Block* raw = block.get();
+    _blocks[_ctx.pc] = std::move(block);
+    return raw;
+}
+
+void Machine::StaleBlocks(i64 address, i64 numBytes)
+{
+    // most stores to a code page are to data next to the code, which no
+    // block was translated from
+    bool translated = false;
+    for (i64 word = address & ~3ll; word < address + numBytes && !translated; word += 4)
+    {
+        auto found = _translatedWords.find(static_cast<u64>(word) >> PagedMemory::PAGE_BITS);
+        translated = found != _translatedWords.end()
+                     && found->second.test((word & (PagedMemory::PAGE_SIZE - 1)) >> 2);
+    }
+    if (!translated)
+        return;
+    for (const auto& entry : _blocks)
+    {
+        const Block& block = *entry.second;
+        if (block.pc < address + numBytes && block.pc + 4 * static_cast<i64>(block.ops.size()) > address)
+            _staleBlocks.push_back(block.pc);
+    }
+    _flushBlocks = true;
+}
+
+void Machine::FlushBlocks()
+{
+    if (_flushAllBlocks)
+    {
+        _blocks.clear();
+        _translatedWords.clear();
+        if (_jitCode)
+            _jitCode->Reset();
+        ++_blockStats.flushes;
+    }
+    else
+    {
+        // Unlink the stale blocks before dropping them. Their words stay
+        // marked in _translatedWords, and their native code in the buffer,
+        // until everything goes at once.
+        auto stale = [this](const Block* block)
+        {
+            return block != nullptr
+                   && std::find(_staleBlocks.begin(), _staleBlocks.end(), block->pc) != _staleBlocks.end();
+        };
+        for (auto& entry : _blocks)
+        {
+            Block& block = *entry.second;
+            for (i32 i = 0; i < 2; ++i)
+                if (stale(block.exit[i]))
+                    block.exit[i] = nullptr;
+        }
+        for (i64 pc : _staleBlocks)
+            _blockStats.dropped += _blocks.erase(pc);
+    }
+    _staleBlocks.clear();
+    _flushBlocks = _flushAllBlocks = false;
+}
+
+i64 Machine::RunBlocks(i64 endPC)
+{
+    const Handler* handlers = FastHandlers();
+    i64 start = _ctx.instret;
+    i64 instructions = 0;
+    Block* block = nullptr; // the block we just left
+
+    while (_ctx.pc < endPC)
+    {
+        // follow a link out of the last block if there is one
+        Block* next = nullptr;
+        if (block != nullptr)
+        {
+            if (block->exit[0] != nullptr && block->exitPC[0] == _ctx.pc)
+                next = block->exit[0];
+            else if (block->exit[1] != nullptr && block->exitPC[1] == _ctx.pc)
+                next = block->exit[1];
+        }
+
+        if (next != nullptr)
+            ++_blockStats.chained;
+        else
+        {
+            // only here does the dispatcher look anything up
+            auto found = _blocks.find(_ctx.pc);
+            next = found != _blocks.end() ? found->second.get() : TranslateBlock(endPC);
+
+            if (block != nullptr)
+            {
+                if (block->exitPC[0] == _ctx.pc)
+                    block->exit[0] = next;
+                else if (block->exitPC[1] == _ctx.pc)
+                    block->exit[1] = next;
+                else if (block->indirect)
+                {
+                    // remember the last place a JALR went, which is usually where it goes again
+                    block->exitPC[0] = _ctx.pc;
+                    block->exit[0] = next;
+                }
+            }
+        }
+        block = next;
+        ++_blockStats.entered;
+
+        // native code runs as much of the block as it can and the
+        // handlers pick up from wherever it stopped
+        size_t first = 0;
+        if (block->jit != nullptr)
+        {
+            first = block->jit(_ctx.regs, &_ctx.pc, this);
+            instructions += first;
+        }
+        else if (_jitEnabled && ++block->runs == _jitThreshold)
+            CompileBlock(*block);
+
+        for (size_t i = first; i < block->ops.size() && !_flushBlocks; ++i)
+        {
+            const PackedOp& op = block->ops[i];
+            _ctx.instret = start + instructions++;
+            if (!handlers[static_cast<i32>(op.inst)](*this, op))
+            {
+                _ctx.instret = start + instructions;
+                return instructions;
+            }
+            // the loop stops if the store changed the rest of this very block
+        }
+
+        if (_flushBlocks)
+        {
+            FlushBlocks();
+            block = nullptr;
+        }
+    }
+    _ctx.instret = start + instructions;
+    return instructions;
+}
+
+void Machine::PrintBlockStats(std::ostream& out) const
+{
+    const BlockStats& bs = _blockStats;
+    out << "blocks translated : " << bs.translated << " (" << _blocks.size() << " live, "
+        << bs.flushes << " flushes, " << bs.dropped << " dropped)\n";
+    out << "avg block length  : " 
+        << (bs.translated ? static_cast<double>(bs.translatedOps) / bs.translated : 0.0) << '\n';
+    out << "blocks entered    : " << bs.entered << '\n';
+    out << "chain hit rate    : "
+        << (bs.entered ? 100.0 * bs.chained / bs.entered : 0.0) << "%\n";
+}
+
+void Machine::SetJit(bool enabled, i64 threshold)
+{
+    _jitEnabled = MACHINE_JIT && enabled;
+    _jitThreshold = threshold;
+}
+
+void Machine::CaptureOutput(std::string* to)
+{
+    _console.Capture(to);
+}
+void Machine::FeedInput(const std::string* from)
+{
+    _console.Feed(from);
+}
+i64 Machine::OutputBytes() const
+{
+    return _console.BytesOut();
+}
+
+void Machine::SetHart(i64 id, Harts* harts)
+{
+    _hartId = id;
+    _harts = harts;
+}
+
+CodeBuffer::CodeBuffer(i64 size)
+    : _base(nullptr), _size(size), _used(0)
+{
+#if MACHINE_JIT
+    void* mem = mmap(nullptr, _size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED)
+        _base = static_cast<u8*>(mem);
+#endif
+}
+CodeBuffer::~CodeBuffer()
+{
+#if MACHINE_JIT
+    if (_base != nullptr)
+        munmap(_base, _size);
+#endif
+}
+
+const u8* CodeBuffer::Add(const std::vector<u8>& code)
+{
+    i64 numBytes = static_cast<i64>(code.size());
+    if (_base == nullptr || _used + numBytes > _size)
+        return nullptr;
+#if MACHINE_JIT
+    // never writable and executable at the same time
+    if (mprotect(_base, _size, PROT_READ | PROT_WRITE) != 0)
+        return nullptr;
+    std::memcpy(_base + _used, code.data(), numBytes);
+    mprotect(_base, _size, PROT_READ | PROT_EXEC);
+#endif
+    const u8* at = _base + _used;
+    _used += (numBytes + 15) & ~15ll; // keep entry points 16-byte aligned
+    return at;
+}
+void CodeBuffer::Reset()
+{
+    _used = 0;
+}
+
+#if MACHINE_JIT
+// Just enough of an x86-64 assembler for the JIT. Guest registers live in
+// memory at [rbx + 8*n], r13 points at the pc and r14 holds the Machine for
+// TLB lookups and helper calls. rax, rcx, rdx and rsi are scratch, r12 is spare.
+class X64Emitter
+{
+public:
+    enum Reg { RAX = 0, RCX = 1, RDX = 2 };
+    // condition codes for Jcc and SETcc
+    enum Cond { B = 0x2, AE = 0x3, E = 0x4, NE = 0x5, A = 0x7, L = 0xc, GE = 0xd };
+
+    std::vector<u8> code;
+
+    void Bytes(std::initializer_list<u8> bytes)
+    {
+        code.insert(code.end(), bytes);
+    }
+    void Imm32(i64 value)
+    {
+        for (i32 i = 0; i < 4; ++i)
+            code.push_back((value >> (8 * i)) & 0xff);
+    }
+    void Imm64(i64 value)
+    {
+        for (i32 i = 0; i < 8; ++i)
+            code.push_back((value >> (8 * i)) & 0xff);
+    }
+
+    // save the callee-saved registers we use and keep the stack 16-byte aligned for calls
+    void Prologue()
+    {
+        Bytes({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56 }); // push rbx, r12, r13, r14
+        Bytes({ 0x48, 0x83, 0xec, 0x08 });                   // sub rsp, 8
+        Bytes({ 0x48, 0x89, 0xfb });                         // mov rbx, rdi
+        Bytes({ 0x49, 0x89, 0xf5 });                         // mov r13, rsi
+        Bytes({ 0x49, 0x89, 0xd6 });                         // mov r14, rdx
+    }
+    // *pc = rax (or the given register), return retired
+    void Exit(i64 retired, Reg pcIn = RAX)
+    {
+        Bytes({ 0x49, 0x89, static_cast<u8>(0x45 | pcIn << 3), 0x00 }); // mov [r13], pcIn
+        Bytes({ 0xb8 });                                                // mov eax, retired
+        Imm32(retired);
+        Bytes({ 0x48, 0x83, 0xc4, 0x08 });                              // add rsp, 8
+        Bytes({ 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3 });      // pop r14, r13, r12, rbx; ret
+    }
+    void ExitTo(i64 pc, i64 retired)
+    {
+        LoadImm(RAX, pc);
+        Exit(retired);
+    }
+    // *pc = pc without leaving, so helpers can tell where they were called from
+    void StorePC(i64 pc)
+    {
+        LoadImm(RAX, pc);
+        Bytes({ 0x49, 0x89, 0x45, 0x00 }); // mov [r13], rax
+    }
+
+    void LoadReg(Reg host, u8 guest) // mov host, [rbx + 8*guest]
+    {
+        Bytes({ 0x48, 0x8b, static_cast<u8>(0x83 | host << 3) });
+        Imm32(guest * 8);
+    }
+    void StoreReg(u8 guest, Reg host) // mov [rbx + 8*guest], host
+    {
+        if (guest == 0) // x0 stays 0
+            return;
+        Bytes({ 0x48, 0x89, static_cast<u8>(0x83 | host << 3) });
+        Imm32(guest * 8);
+    }
+    void LoadImm(Reg host, i64 value)
+    {
+        if (value == static_cast<i32>(value))
+        {
+            Bytes({ 0x48, 0xc7, static_cast<u8>(0xc0 | host) }); // mov host, simm32
+            Imm32(value);
+        }
+        else
+        {
+            Bytes({ 0x48, static_cast<u8>(0xb8 | host) });       // movabs host, imm64
+            Imm64(value);
+        }
+    }
+
+    // rax = rax op rcx, opcode is add 0x01, or 0x09, and 0x21, sub 0x29, xor 0x31, cmp 0x39
+    void Alu(u8 opcode)   { Bytes({ 0x48, opcode, 0xc8 }); }
+    void Alu32(u8 opcode) { Bytes({ opcode, 0xc8 }); }
+    void Imul()           { Bytes({ 0x48, 0x0f, 0xaf, 0xc1 }); }
+    void Imul32()         { Bytes({ 0x0f, 0xaf, 0xc1 }); }
+    // rax = rax shift cl, ext is shl 4, shr 5, sar 7 (the hardware masks cl like RISC-V does)
+    void Shift(u8 ext)    { Bytes({ 0x48, 0xd3, static_cast<u8>(0xc0 | ext << 3) }); }
+    void Shift32(u8 ext)  { Bytes({ 0xd3, static_cast<u8>(0xc0 | ext << 3) }); }
+    void SignExtend32()   { Bytes({ 0x48, 0x63, 0xc0 }); }       // movsxd rax, eax
+    void SetCond(Cond cc)                                         // rax = cc ? 1 : 0
+    {
+        Bytes({ 0x0f, static_cast<u8>(0x90 | cc), 0xc0 });        // setcc al
+        Bytes({ 0x0f, 0xb6, 0xc0 });                              // movzx eax, al
+    }
+
+    // jump if cc to somewhere not known yet, returns what to give Patch
+    i64 Jump(Cond cc)
+    {
+        Bytes({ 0x0f, static_cast<u8>(0x80 | cc) });
+        Imm32(0);
+        return static_cast<i64>(code.size());
+    }
+    // point the jump at the current end of the code
+    void Patch(i64 jump)
+    {
+        i64 rel = static_cast<i64>(code.size()) - jump;
+        for (i32 i = 0; i < 4; ++i)
+            code[jump - 4 + i] = (rel >> (8 * i)) & 0xff;
+    }
+    // jmp to somewhere already emitted
+    void JumpBack(i64 target)
+    {
+        Bytes({ 0xe9 });
+        Imm32(target - static_cast<i64>(code.size()) - 4);
+    }
+    i64 Here() const
+    {
+        return static_cast<i64>(code.size());
+    }
+};
+#endif
+
+bool Machine::JitStore(Machine* m, i64 address, i64 value, i32 numBytes)
+{
+    switch (numBytes)
+    {
+    case 1:
+        m->MemoryWrite<u8>(address, value);
+        break;
+    case 2:
+        m->MemoryWrite<u16>(address, value);
+        break;
+    case 4:
+        m->MemoryWrite<u32>(address, value);
+        break;
+    case 8:
+        m->MemoryWrite<u64>(address, value);
+        break;
+    }
+    return m->_flushBlocks;
+}
+i64 Machine::JitLoad(Machine* m, i64 address, i32 inst)
+{
+    switch (static_cast<Inst>(inst))
+    {
+    case Inst::LB:  return m->MemoryRead<i8>(address);
+    case Inst::LH:  return m->MemoryRead<i16>(address);
+    case Inst::LW:  return m->MemoryRead<i32>(address);
+    case Inst::LD:  return m->MemoryRead<i64>(address);
+    case Inst::LBU: return m->MemoryRead<u8>(address);
+    case Inst::LHU: return m->MemoryRead<u16>(address);
+    case Inst::LWU: return m->MemoryRead<u32>(address);
+    default:        return 0;
+    }
+}
+
+void Machine::CompileBlock(Block& block)
+{
+#if MACHINE_JIT
+    using X = X64Emitter;
+    X x;
+    x.Prologue();
+
+    // stores that hit translated code leave the native code here
+    // and let the handlers take over
+    struct Stub { i64 jump; i64 pc; i64 retired; };
+    std::vector<Stub> stubs;
+    // loads that miss the read TLB call JitLoad out of line and come back
+    struct LoadStub { i64 jumps[2]; i64 resume; Inst inst; i64 pc; };
+    std::vector<LoadStub> loadStubs;
+    i64 tlb = reinterpret_cast<char*>(_readTlb) - reinterpret_cast<char*>(this);
+    // with guarded memory loads and stores go straight to _flat, and
+    // whatever faults or falls outside it is redone by JitLoad or JitStore
+    struct StoreStub { std::vector<i64> jumps; i64 resume; i32 numBytes; i64 pc; i64 retired; };
+    std::vector<StoreStub> storeStubs;
+    static_assert(sizeof(PagedMemory::faulted) == 4, "faulted is checked with a 32-bit cmp");
+    auto faultCheck = [&]()
+    {
+        x.LoadImm(X::RCX, reinterpret_cast<i64>(&PagedMemory::faulted));
+        x.Bytes({ 0x83, 0x39, 0x00 });                           // cmp dword [rcx], 0
+        return x.Jump(X::NE);
+    };
+
+    i64 count = static_cast<i64>(block.insts.size());
+    i64 k = 0;
+    bool exited = false;
+    for (; k < count && !exited; ++k)
+    {
+        const DecodedInst& di = block.insts[k];
+        i64 pc = block.pc + 4 * k;
+        bool supported = true;
+
+        // rax = rs1, rcx = rs2 or the immediate
+        auto operands = [&]() 
+        {
+            x.LoadReg(X::RAX, di.rs1);
+            if (di.rightImm)
+                x.LoadImm(X::RCX, di.imm);
+            else
+                x.LoadReg(X::RCX, di.rs2);
+        };
+        auto load = [&](std::initializer_list<u8> mov, i64 numBytes)
+        {
+            x.LoadReg(X::RAX, di.rs1);
+            x.LoadImm(X::RCX, di.imm);
+            x.Alu(0x01);
+            x.Bytes({ 0x48, 0x89, 0xc6 });                       // mov rsi, rax
+            if (_flat != nullptr)
+            {
+                x.LoadImm(X::RDX, _flatLimit);
+                x.Bytes({ 0x48, 0x39, 0xd0 });                   // cmp rax, rdx
+                i64 outside = x.Jump(X::AE);
+                x.LoadImm(X::RDX, reinterpret_cast<i64>(_flat));
+                x.Bytes({ 0x48, 0x01, 0xc2 });                   // add rdx, rax
+                x.Bytes(mov);
+                i64 fault = faultCheck();
+                loadStubs.push_back({ { outside, fault }, x.Here(), di.inst, pc });
+                x.StoreReg(di.rd, X::RAX);
+                return;
+            }
+            // the same TLB probe as MemoryRead: rdx = page, rcx = &_readTlb[page % TLB_SIZE] - tlb
+            x.Bytes({ 0x48, 0x89, 0xc2 });                       // mov rdx, rax
+            x.Bytes({ 0x48, 0xc1, 0xea, PagedMemory::PAGE_BITS });  // shr rdx, PAGE_BITS
+            x.Bytes({ 0x48, 0x89, 0xd1 });                       // mov rcx, rdx
+            x.Bytes({ 0x83, 0xe1, TLB_SIZE - 1 });               // and ecx, TLB_SIZE-1
+            x.Bytes({ 0xc1, 0xe1, 0x04 });                       // shl ecx, 4 (sizeof(TlbEntry))
+            x.Bytes({ 0x4c, 0x01, 0xf1 });                       // add rcx, r14
+            x.Bytes({ 0x48, 0x3b, 0x91 });                       // cmp rdx, [rcx + tlb]
+            x.Imm32(tlb);
+            i64 miss = x.Jump(X::NE);
+            // ... and the value has to fit in the page
+            x.Bytes({ 0x89, 0xc2 });                             // mov edx, eax
+            x.Bytes({ 0x81, 0xe2 });                             // and edx, PAGE_SIZE-1
+            x.Imm32(PagedMemory::PAGE_SIZE - 1);
+            x.Bytes({ 0x81, 0xfa });                             // cmp edx, PAGE_SIZE-numBytes
+            x.Imm32(PagedMemory::PAGE_SIZE - numBytes);
+            i64 split = x.Jump(X::A);
+            x.Bytes({ 0x48, 0x03, 0x91 });                       // add rdx, [rcx + tlb + 8]
+            x.Imm32(tlb + 8);
+            x.Bytes(mov);
+            loadStubs.push_back({ { miss, split }, x.Here(), di.inst, pc });
+            x.StoreReg(di.rd, X::RAX);
+        };
+        auto store = [&](std::initializer_list<u8> mov, i32 numBytes)
+        {
+            x.LoadReg(X::RAX, di.rs1);
+            x.LoadImm(X::RCX, di.imm);
+            x.Alu(0x01);
+            x.Bytes({ 0x48, 0x89, 0xc6 });         // mov rsi, rax
+            x.LoadReg(X::RDX, di.rs2);
+            if (_flat != nullptr)
+            {
+                x.LoadImm(X::RCX, _flatLimit);
+                x.Bytes({ 0x48, 0x39, 0xce });     // cmp rsi, rcx
+                i64 outside = x.Jump(X::AE);
+                x.LoadImm(X::RCX, reinterpret_cast<i64>(_flat));
+                x.Bytes(mov);
+                std::vector<i64> jumps = { outside, faultCheck() };
+                if (!_writableCode.empty())
+                {
+                    // stores to code left writable don't fault, so look
+                    // up the pages of the first and last byte
+                    x.LoadImm(X::RAX, reinterpret_cast<i64>(_writableCode.data()));
+                    for (u8 last : { u8(0), static_cast<u8>(numBytes - 1) })
+                    {
+                        x.Bytes({ 0x48, 0x8d, 0x4e, last });                 // lea rcx, [rsi + last]
+                        x.Bytes({ 0x48, 0xc1, 0xe9, PagedMemory::PAGE_BITS }); // shr rcx, PAGE_BITS
+                        x.Bytes({ 0x80, 0x3c, 0x08, 0x00 });                 // cmp byte [rax + rcx], 0
+                        jumps.push_back(x.Jump(X::NE));
+                    }
+                }
+                storeStubs.push_back({ jumps, x.Here(), numBytes, pc, k + 1 });
+                return;
+            }
+            x.StorePC(pc);
+            x.Bytes({ 0x4c, 0x89, 0xf7 });         // mov rdi, r14
+            x.Bytes({ 0xb9 });                     // mov ecx, numBytes
+            x.Imm32(numBytes);
+            x.LoadImm(X::RAX, reinterpret_cast<i64>(&Machine::JitStore));
+            x.Bytes({ 0xff, 0xd0 });               // call rax
+            x.Bytes({ 0x84, 0xc0 });               // test al, al
+            stubs.push_back({ x.Jump(X::NE), pc + 4, k + 1 });
+        };
+        auto branch = [&](X::Cond cc)
+        {
+            x.LoadReg(X::RAX, di.rs1);
+            x.LoadReg(X::RCX, di.rs2);
+            x.Alu(0x39);
+            i64 taken = x.Jump(cc);
+            x.ExitTo(pc + 4, k + 1);
+            x.Patch(taken);
+            x.ExitTo(pc + di.imm, k + 1);
+            exited = true;
+        };
+
+        switch (di.inst)
+        {
+        case Inst::ADD:  case Inst::ADDI:  operands(); x.Alu(0x01); break;
+        case Inst::SUB:                    operands(); x.Alu(0x29); break;
+        case Inst::AND:  case Inst::ANDI:  operands(); x.Alu(0x21); break;
+        case Inst::OR:   case Inst::ORI:   operands(); x.Alu(0x09); break;
+        case Inst::XOR:  case Inst::XORI:  operands(); x.Alu(0x31); break;
+        case Inst::SLL:  case Inst::SLLI:  operands(); x.Shift(4); break;
+        case Inst::SRL:  case Inst::SRLI:  operands(); x.Shift(5); break;
+        case Inst::SRA:  case Inst::SRAI:  operands(); x.Shift(7); break;
+        case Inst::SLT:  case Inst::SLTI:  operands(); x.Alu(0x39); x.SetCond(X::L); break;
+        case Inst::SLTU: case Inst::SLTIU: operands(); x.Alu(0x39); x.SetCond(X::B); break;
+        case Inst::MUL:                    operands(); x.Imul(); break;
+
+        case Inst::ADDW: case Inst::ADDIW: operands(); x.Alu32(0x01); x.SignExtend32(); break;
+        case Inst::SUBW:                   operands(); x.Alu32(0x29); x.SignExtend32(); break;
+        case Inst::SLLW: case Inst::SLLIW: operands(); x.Shift32(4); x.SignExtend32(); break;
+        case Inst::SRLW: case Inst::SRLIW: operands(); x.Shift32(5); x.SignExtend32(); break;
+        case Inst::SRAW: case Inst::SRAIW: operands(); x.Shift32(7); x.SignExtend32(); break;
+        case Inst::MULW:                   operands(); x.Imul32(); x.SignExtend32(); break;
+
+        case Inst::LUI:   x.LoadImm(X::RAX, di.imm); break;
+        case Inst::AUIPC: x.LoadImm(X::RAX, pc + di.imm); break;
+
+        // mov/movsx/movzx rax, [rdx]
+        case Inst::LB:  load({ 0x48, 0x0f, 0xbe, 0x02 }, 1); break;
+        case Inst::LH:  load({ 0x48, 0x0f, 0xbf, 0x02 }, 2); break;
+        case Inst::LW:  load({ 0x48, 0x63, 0x02 }, 4);       break;
+        case Inst::LD:  load({ 0x48, 0x8b, 0x02 }, 8);       break;
+        case Inst::LBU: load({ 0x0f, 0xb6, 0x02 }, 1);       break;
+        case Inst::LHU: load({ 0x0f, 0xb7, 0x02 }, 2);       break;
+        case Inst::LWU: load({ 0x8b, 0x02 }, 4);             break;
+
+        // mov [rcx + rsi], dl/dx/edx/rdx
+        case Inst::SB: store({ 0x88, 0x14, 0x31 }, 1);       break;
+        case Inst::SH: store({ 0x66, 0x89, 0x14, 0x31 }, 2); break;
+        case Inst::SW: store({ 0x89, 0x14, 0x31 }, 4);       break;
+        case Inst::SD: store({ 0x48, 0x89, 0x14, 0x31 }, 8); break;
+
+        case Inst::BEQ:  branch(X::E);  break;
+        case Inst::BNE:  branch(X::NE); break;
+        case Inst::BLT:  branch(X::L);  break;
+        case Inst::BGE:  branch(X::GE); break;
+        case Inst::BLTU: branch(X::B);  break;
+        case Inst::BGEU: branch(X::AE); break;
+
+        case Inst::JAL:
+            x.LoadImm(X::RAX, pc + 4);
+            x.StoreReg(di.rd, X::RAX);
+            x.ExitTo(pc + di.imm, k + 1);
+            exited = true;
+            break;
+        case Inst::JALR:
+            x.LoadReg(X::RAX, di.rs1);
+            x.LoadImm(X::RCX, di.imm);
+            x.Alu(0x01);
+            x.Bytes({ 0x48, 0x83, 0xe0, 0xfe }); // and rax, -2
+            x.Bytes({ 0x48, 0x89, 0xc2 });       // mov rdx, rax
+            x.LoadImm(X::RAX, pc + 4);
+            x.StoreReg(di.rd, X::RAX);
+            x.Exit(k + 1, X::RDX);
+            exited = true;
+            break;
+
+        default:
+            // ecall, division and the rest are left to the handlers
+            supported = false;
+            break;
+        }
+        if (!supported)
+            break;
+
+        // everything but loads, stores and jumps leaves its result in rax
+        bool resultInRax = !exited && di.op != LOAD && di.op != STORE;
+        if (resultInRax)
+            x.StoreReg(di.rd, X::RAX);
+    }
+
+    // mark it as tried either way so it isn't compiled again
+    block.runs = _jitThreshold + 1;
+    if (k == 0)
+        return;
+
+    if (!exited)
+        x.ExitTo(block.pc + 4 * k, k);
+    for (const Stub& stub : stubs)
+    {
+        x.Patch(stub.jump);
+        x.ExitTo(stub.pc, stub.retired);
+    }
+    for (const LoadStub& stub : loadStubs)
+    {
+        // the address is still in rsi
+        x.Patch(stub.jumps[0]);
+        x.Patch(stub.jumps[1]);
+        x.StorePC(stub.pc);
+        x.Bytes({ 0x4c, 0x89, 0xf7 });         // mov rdi, r14
+        x.Bytes({ 0xba });                     // mov edx, inst
+        x.Imm32(static_cast<i32>(stub.inst));
+        x.LoadImm(X::RAX, reinterpret_cast<i64>(&Machine::JitLoad));
+        x.Bytes({ 0xff, 0xd0 });               // call rax
+        x.JumpBack(stub.resume);
+    }
+    for (const StoreStub& stub : storeStubs)
+    {
+        // the address is still in rsi and the value in rdx
+        for (i64 jump : stub.jumps)
+            x.Patch(jump);
+        x.StorePC(stub.pc);
+        x.Bytes({ 0x4c, 0x89, 0xf7 });         // mov rdi, r14
+        x.Bytes({ 0xb9 });                     // mov ecx, numBytes
+        x.Imm32(stub.numBytes);
+        x.LoadImm(X::RAX, reinterpret_cast<i64>(&Machine::JitStore));
+        x.Bytes({ 0xff, 0xd0 });               // call rax
+        x.Bytes({ 0x84, 0xc0 });               // test al, al
+        i64 flush = x.Jump(X::NE);
+        x.JumpBack(stub.resume);
+        x.Patch(flush);
+        x.ExitTo(stub.pc + 4, stub.retired);
+    }
+
+    if (!_jitCode)
+        _jitCode.reset(new CodeBuffer(JIT_BUFFER_SIZE));
+    const u8* code = _jitCode->Add(x.code);
+    if (code == nullptr)
+    {
+        // out of room, start over with a clean slate after this block
+        _flushBlocks = _flushAllBlocks = true;
+        return;
+    }
+    block.jit = reinterpret_cast<JitFn>(const_cast<u8*>(code));
+    block.jitOps = k;
+#else
+    (void)block;
+#endif
+}
+
+Lockstep::Lockstep(const std::vector<Machine*>& machines)
+    : _machines(machines), _instructions(machines.size())
+{
+    // everyone starts in one group and is sorted out by where they start
+    std::unique_ptr<Group> all(new Group());
+    i64 start[LANES];
+    all->count = static_cast<i32>(machines.size());
+    for (i32 k = 0; k < all->count; ++k)
+    {
+        all->lane[k] = k;
+        start[k] = machines[k]->_ctx.pc;
+        for (i32 r = 0; r < 32; ++r)
+            all->regs[r][k] = machines[k]->_ctx.regs[r];
+    }
+    Split(*all, start);
+    if (all->count > 0)
+        _groups.push_back(std::move(all));
+}
+
+std::vector<i64> Lockstep::Run(i64 endPC)
+{
+    while (!_groups.empty())
+    {
+        // merge groups that have come to the same pc, then run the one furthest behind
+        std::sort(_groups.begin(), _groups.end(),
+                  [](const std::unique_ptr<Group>& a, const std::unique_ptr<Group>& b) { return a->pc < b->pc; });
+        for (size_t i = 0; i + 1 < _groups.size(); )
+        {
+            Group& into = *_groups[i];
+            Group& from = *_groups[i + 1];
+            if (into.pc != from.pc)
+            {
+                ++i;
+                continue;
+            }
+            Retire(into);
+            Retire(from);
+            for (i32 k = 0; k < from.count; ++k, ++into.count)
+            {
+                into.lane[into.count] = from.lane[k];
+                for (i32 r = 0; r < 32; ++r)
+                    into.regs[r][into.count] = from.regs[r][k];
+            }
+            _groups.erase(_groups.begin() + i + 1);
+        }
+
+        Step(*_groups.front(), endPC);
+        _groups.erase(std::remove_if(_groups.begin(), _groups.end(),
+                                     [](const std::unique_ptr<Group>& g) { return g->count == 0; }),
+                      _groups.end());
+    }
+    return _instructions;
+}
+
+inline void Lockstep::AluLanes(Machine::Alu cmd, const i64* __restrict left, const i64* __restrict right,
+                               i64* __restrict out)
+{
+    // unsigned so overflow wraps, the loops are what gets vectorized
+    const u64* a = reinterpret_cast<const u64*>(left);
+    const u64* b = reinterpret_cast<const u64*>(right);
+    u64* o = reinterpret_cast<u64*>(out);
+    switch (cmd)
+    {
+    case Machine::ADD:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] + b[i];
+        break;
+    case Machine::SUB:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] - b[i];
+        break;
+    case Machine::MUL:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] * b[i];
+        break;
+    case Machine::AND:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] & b[i];
+        break;
+    case Machine::OR:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] | b[i];
+        break;
+    case Machine::XOR:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] ^ b[i];
+        break;
+    case Machine::SLL:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] << (b[i] & 63);
+        break;
+    case Machine::SRL:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] >> (b[i] & 63);
+        break;
+    case Machine::SRA:
+        for (i32 i = 0; i < LANES; ++i) out[i] = left[i] >> (b[i] & 63);
+        break;
+    case Machine::SLT:
+        for (i32 i = 0; i < LANES; ++i) o[i] = left[i] < right[i];
+        break;
+    case Machine::SLTU:
+        for (i32 i = 0; i < LANES; ++i) o[i] = a[i] < b[i];
+        break;
+    default:
+        break;
+    }
+}
+
+void Lockstep::Step(Group& group, i64 endPC)
+{
+    using Inst = Machine::Inst;
+    // how the ALU instructions map onto the Alu commands, and whether they are W forms
+    enum Width { NONE, DOUBLE, WORD, WORD_ZERO, WORD_SIGN }; // WORD_* extend the left operand first
+    struct AluOp { Machine::Alu cmd; Width width; };
+    static const std::vector<AluOp> ALU_OPS = []
+    {
+        std::vector<AluOp> ops(static_cast<i32>(Inst::ILLEGAL) + 1, AluOp{ Machine::NO_OP, NONE });
+        auto set = [&ops](Inst inst, Machine::Alu cmd, Width width) { ops[static_cast<i32>(inst)] = { cmd, width }; };
+        set(Inst::ADDI,  Machine::ADD,  DOUBLE);    set(Inst::ADD,  Machine::ADD,  DOUBLE);
+        set(Inst::SLTI,  Machine::SLT,  DOUBLE);    set(Inst::SLT,  Machine::SLT,  DOUBLE);
+        set(Inst::SLTIU, Machine::SLTU, DOUBLE);    set(Inst::SLTU, Machine::SLTU, DOUBLE);
+        set(Inst::XORI,  Machine::XOR,  DOUBLE);    set(Inst::XOR,  Machine::XOR,  DOUBLE);
+        set(Inst::ORI,   Machine::OR,   DOUBLE);    set(Inst::OR,   Machine::OR,   DOUBLE);
+        set(Inst::ANDI,  Machine::AND,  DOUBLE);    set(Inst::AND,  Machine::AND,  DOUBLE);
+        set(Inst::SLLI,  Machine::SLL,  DOUBLE);    set(Inst::SLL,  Machine::SLL,  DOUBLE);
+        set(Inst::SRLI,  Machine::SRL,  DOUBLE);    set(Inst::SRL,  Machine::SRL,  DOUBLE);
+        set(Inst::SRAI,  Machine::SRA,  DOUBLE);    set(Inst::SRA,  Machine::SRA,  DOUBLE);
+        set(Inst::SUB,   Machine::SUB,  DOUBLE);    set(Inst::MUL,  Machine::MUL,  DOUBLE);
+        set(Inst::ADDIW, Machine::ADD,  WORD);      set(Inst::ADDW, Machine::ADD,  WORD);
+        set(Inst::SUBW,  Machine::SUB,  WORD);      set(Inst::MULW, Machine::MUL,  WORD);
+        set(Inst::SLLIW, Machine::SLL,  WORD);      set(Inst::SLLW, Machine::SLL,  WORD);
+        set(Inst::SRLIW, Machine::SRL,  WORD_ZERO); set(Inst::SRLW, Machine::SRL,  WORD_ZERO);
+        set(Inst::SRAIW, Machine::SRA,  WORD_SIGN); set(Inst::SRAW, Machine::SRA,  WORD_SIGN);
+        return ops;
+    }();
+
+    Machine& first = *_machines[group.lane[0]];
+    i64 (*regs)[LANES] = group.regs;
+    alignas(64) i64 left[LANES];
+    alignas(64) i64 right[LANES];
+    alignas(64) i64 out[LANES];
+    i64 next[LANES];
+
+    while (group.pc < endPC)
+    {
+        first._ctx.pc = group.pc;
+        const Machine::DecodedInst& di = first.FetchDecoded();
+        ++group.steps;
+        AluOp op = ALU_OPS[static_cast<i32>(di.inst)];
+
+        if (op.width != NONE)
+        {
+            // operands are used in place unless they need widening first
+            const i64* a = regs[di.rs1];
+            const i64* b = regs[di.rs2];
+            if (di.rightImm)
+            {
+                for (i32 i = 0; i < LANES; ++i) right[i] = di.imm;
+                b = right;
+            }
+            if (op.width == DOUBLE)
+            {
+                AluLanes(op.cmd, a, b, out);
+                if (di.rd != 0)
+                    std::memcpy(regs[di.rd], out, sizeof(out));
+                group.pc += 4;
+                continue;
+            }
+            if (op.width == WORD_ZERO || op.width == WORD_SIGN)
+            {
+                for (i32 i = 0; i < LANES; ++i)
+                    left[i] = op.width == WORD_ZERO ? static_cast<i64>(static_cast<u32>(a[i])) : static_cast<i32>(a[i]);
+                a = left;
+            }
+            // W shifts only look at 5 bits of the amount
+            if (op.cmd == Machine::SLL || op.cmd == Machine::SRL || op.cmd == Machine::SRA)
+            {
+                for (i32 i = 0; i < LANES; ++i) right[i] = b[i] & 31;
+                b = right;
+            }
+            AluLanes(op.cmd, a, b, out);
+            if (di.rd != 0)
+                for (i32 i = 0; i < LANES; ++i) regs[di.rd][i] = static_cast<i32>(out[i]);
+            group.pc += 4;
+            continue;
+        }
+
+        switch (di.inst)
+        {
+        case Inst::LUI:
+        case Inst::AUIPC:
+        {
+            i64 value = di.inst == Inst::LUI ? di.imm : group.pc + di.imm;
+            if (di.rd != 0)
+                for (i32 i = 0; i < LANES; ++i) regs[di.rd][i] = value;
+            group.pc += 4;
+            continue;
+        }
+        case Inst::BEQ:
+        case Inst::BNE:
+        case Inst::BLT:
+        case Inst::BGE:
+        case Inst::BLTU:
+        case Inst::BGEU:
+            for (i32 k = 0; k < group.count; ++k)
+            {
+                i64 a = regs[di.rs1][k];
+                i64 b = regs[di.rs2][k];
+                bool taken = false;
+                switch (di.inst)
+                {
+                case Inst::BEQ:  taken = a == b; break;
+                case Inst::BNE:  taken = a != b; break;
+                case Inst::BLT:  taken = a < b;  break;
+                case Inst::BGE:  taken = a >= b; break;
+                case Inst::BLTU: taken = static_cast<u64>(a) <  static_cast<u64>(b); break;
+                default:         taken = static_cast<u64>(a) >= static_cast<u64>(b); break;
+                }
+                next[k] = group.pc + (taken ? di.imm : 4);
+            }
+            // the scheduler only has to look when there is more than one group
+            if (!Split(group, next) || _groups.size() > 1)
+                return;
+            continue;
+        case Inst::JAL:
+            if (di.rd != 0)
+                for (i32 i = 0; i < LANES; ++i) regs[di.rd][i] = group.pc + 4;
+            group.pc += di.imm;
+            if (_groups.size() > 1)
+                return;
+            continue;
+        case Inst::JALR:
+            // rd can be rs1, so work out the targets first
+            for (i32 k = 0; k < group.count; ++k)
+                next[k] = (regs[di.rs1][k] + di.imm) & ~1ll;
+            if (di.rd != 0)
+                for (i32 i = 0; i < LANES; ++i) regs[di.rd][i] = group.pc + 4;
+            if (!Split(group, next) || _groups.size() > 1)
+                return;
+            continue;
+        default:
+            break;
+        }
+
+        // everything else, one lane at a time
+        Scalar(group, di, next);
+        if (!Split(group, next))
+            return;
+    }
+
+    // ran off the end
+    Retire(group);
+    for (i32 k = 0; k < group.count; ++k)
+        Unload(group, k, group.pc);
+    group.count = 0;
+}
+
+void Lockstep::Scalar(Group& group, const Machine::DecodedInst& di, i64* next)
+{
+    Machine::Handler handler = Machine::FastHandlers()[static_cast<i32>(di.inst)];
+    // ecalls can read and write any register, the rest only touch these
+    bool everything = di.op == Machine::SYSTEM;
+    const u8 used[3] = { di.rs1, di.rs2, di.rd };
+    for (i32 k = 0; k < group.count; ++k)
+    {
+        Machine& m = *_machines[group.lane[k]];
+        if (everything)
+            for (i32 r = 0; r < 32; ++r) m._ctx.regs[r] = group.regs[r][k];
+        else
+            for (u8 r : used) m._ctx.regs[r] = group.regs[r][k];
+        m._ctx.pc = group.pc;
+        m._ctx.instret = _instructions[group.lane[k]] + group.steps - 1;
+
+        // a lane that quits gets -1 and keeps the pc it stopped at
+        next[k] = handler(m, di) ? m._ctx.pc : -1;
+
+        if (everything)
+            for (i32 r = 0; r < 32; ++r) group.regs[r][k] = m._ctx.regs[r];
+        else
+            group.regs[di.rd][k] = m._ctx.regs[di.rd];
+    }
+}
+
+bool Lockstep::Split(Group& group, const i64* next)
+{
+    bool together = next[0] != -1;
+    for (i32 k = 1; k < group.count; ++k)
+        together = together && next[k] == next[0];
+    if (together)
+    {
+        group.pc = next[0];
+        return true;
+    }
+
+    Retire(group);
+    std::vector<std::unique_ptr<Group>> made;
+    for (i32 k = 0; k < group.count; ++k)
+    {
+        if (next[k] == -1)
+        {
+            Unload(group, k, _machines[group.lane[k]]->_ctx.pc);
+            continue;
+        }
+        Group* into = nullptr;
+        for (std::unique_ptr<Group>& g : made)
+            if (g->pc == next[k])
+                into = g.get();
+        if (into == nullptr)
+        {
+            made.emplace_back(new Group());
+            into = made.back().get();
+            into->pc = next[k];
+        }
+        into->lane[into->count] = group.lane[k];
+        for (i32 r = 0; r < 32; ++r)
+            into->regs[r][into->count] = group.regs[r][k];
+        ++into->count;
+    }
+
+    // the first takes over this group, the rest are new
+    group.count = 0;
+    if (made.empty())
+        return false;
+    group = *made[0];
+    for (size_t i = 1; i < made.size(); ++i)
+        _groups.push_back(std::move(made[i]));
+    return false;
+}
+
+void Lockstep::Retire(Group& group)
+{
+    for (i32 k = 0; k < group.count; ++k)
+        _instructions[group.lane[k]] += group.steps;
+    group.steps = 0;
+}
+
+void Lockstep::Unload(const Group& group, i32 column, i64 pc)
+{
+    Machine& m = *_machines[group.lane[column]];
+    for (i32 r = 0; r < 32; ++r)
+        m._ctx.regs[r] = group.regs[r][column];
+    m._ctx.pc = pc;
+}
+
+// run the loaded program until it quits or the pc reaches endPC
+// returns the number of instructions executed
+i64 Run(Machine& mach, i64 endPC, Engine engine)
+{
+    if (engine == LOCKSTEP)
+    {
+        // a group of one, really only useful to check it against the others
+        Lockstep lockstep({ &mach });
+        return lockstep.Run(endPC)[0];
+    }
+    if (engine == FAST)
+        return mach.RunFast(endPC);
+    if (engine == PIPELINE)
+        return mach.RunPipelined(endPC);
+    if (engine == BLOCK)
+        return mach.RunBlocks(endPC);
+    if (engine == JIT)
+    {
+        mach.SetJit(true);
+        return mach.RunBlocks(endPC);
+    }
+
+    i64 instructions = 0;
+    while (mach.GetPC() < endPC)
+    {
+        // uncomment for debug
+        // std::cout << "PC = " << mach.GetPC() << '\n';
+        mach.Fetch();
+        // std::cout << mach.DebugFetchOut() << '\n';
+        mach.Decode();
+        // std::cout << mach.DebugDecodeOut() << '\n';
+        mach.Execute();
+        // std::cout << mach.DebugExecuteOut() << '\n';
+        mach.Memory();
+        // std::cout << mach.DebugMemoryOut() << '\n';
+        ++instructions;
+        if (!mach.WriteBack())
+            break;
+        // std::cout << '\n';
+    }
+    return instructions;
+}
+
+Harts::Harts(PagedMemory& memory, Engine engine, i64 endPC, bool decodeCache, i64 maxHarts)
+    : _memory(&memory), _engine(engine), _endPC(endPC), _decodeCache(decodeCache), _image(nullptr),
+      _maxHarts(maxHarts)
+{
+}
+Harts::~Harts()
+{
+    // harts can start more harts until the last of them stops
+    for (size_t i = 0; ; ++i)
+    {
+        std::thread thread;
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            if (i == _harts.size())
+                break;
+            thread = std::move(_harts[i]->thread);
+        }
+        thread.join();
+    }
+}
+
+i64 Harts::Start(i64 pc, i64 sp, i64 arg)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    i64 id = static_cast<i64>(_harts.size()) + 1;
+    if (id >= _maxHarts)
+        return -1;
+
+    std::unique_ptr<Hart> hart(new Hart());
+    hart->machine.reset(new Machine(*_memory));
+    hart->instructions = 0;
+    hart->result = -1;
+    hart->stopped = false;
+    hart->joined = false;
+    Machine& mach = *hart->machine;
+    mach.SetHart(id, this);
+    mach.SetDecodeCache(_decodeCache);
+    mach.SetDecodedImage(_image);
+    mach.SetPC(pc);
+    mach.SetXReg(1, _endPC);
+    mach.SetXReg(2, sp);
+    mach.SetXReg(10, arg);
+
+    // everything the starting hart stored so far is visible to the new thread
+    Hart* raw = hart.get();
+    raw->thread = std::thread([this, raw]()
+    {
+        i64 instructions = Run(*raw->machine, _endPC, _engine);
+        i64 result = raw->machine->GetXReg(10);
+        raw->machine.reset();
+
+        std::lock_guard<std::mutex> lock(_lock);
+        raw->instructions = instructions;
+        raw->result = result;
+        raw->stopped = true;
+        _stopped.notify_all();
+    });
+    _harts.push_back(std::move(hart));
+    return id;
+}
+i64 Harts::Join(i64 id)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    if (id < 1 || id > static_cast<i64>(_harts.size()) || _harts[id - 1]->joined)
+        return -1;
+    Hart& hart = *_harts[id - 1];
+    hart.joined = true;
+    _stopped.wait(lock, [&hart]() { return hart.stopped; });
+    return hart.result;
+}
+void Harts::SetDecodedImage(const Machine::DecodedImage* image)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _image = image;
+}
+
+void Harts::PrintStats(std::ostream& out)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    WaitForAll(lock);
+    for (size_t i = 0; i < _harts.size(); ++i)
+    {
+        // padded in a string of its own so out keeps its alignment
+        std::ostringstream label;
+        label << "hart " << std::left << std::setw(13) << i + 1;
+        out << label.str() << ": " << _harts[i]->instructions << " instructions\n";
+    }
+}
+i64 Harts::Instructions()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    WaitForAll(lock);
+    i64 instructions = 0;
+    for (const std::unique_ptr<Hart>& hart : _harts)
+        instructions += hart->instructions;
+    return instructions;
+}
+
+void Harts::WaitForAll(std::unique_lock<std::mutex>& lock)
+{
+    // a hart can start another before it stops, so check them all each time
+    _stopped.wait(lock, [this]()
+    {
+        return std::all_of(_harts.begin(), _harts.end(),
+                           [](const std::unique_ptr<Hart>& hart) { return hart->stopped; });
+    });
+}
+
+// how the guest address space is set up
+struct Layout
+{
+    i64 memSize;  // size of the address space
+    i64 stackTop; // where the stack pointer starts
+    bool guarded; // guarded rather than checked memory
+};
+
+// A program ready to go into memory: pieces of the file to place, where
+// to start and where to stop. A flat image is one piece at address 0 and
+// stops when the pc runs off the end of it. An ELF file stops at the exit
+// ecall, or if the pc leaves memory.
+struct Program
+{
+    struct Segment
+    {
+        i64 address;  // where it goes in guest memory
+        i64 offset;   // where it starts in the file
+        i64 fileSize; // bytes that come from the file,
+        i64 memSize;  // ... and the rest up to memSize are zero
+        bool code;    // executable
+    };
+    std::vector<Segment> segments;
+    i64 entry;
+    i64 endPC;
+};
+
+// copy the program's pieces out of the whole file, already in host memory
+void LoadProgram(const Program& program, const char* file, PagedMemory& memory)
+{
+    // zero-filled parts (.bss) are left alone, fresh pages are zero anyway
+    for (const Program::Segment& segment : program.segments)
+        memory.Write(segment.address, file + segment.offset, segment.fileSize);
+}
+
+// Decode the program's code segments, already in memory, into image in one
+// pass. Anything between them is decoded too, unless that comes to more
+// than MAX_PREDECODE bytes in all, when image is left empty.
+void PredecodeProgram(const Program& program, PagedMemory& memory, Machine::DecodedImage& image)
+{
+    const i64 MAX_PREDECODE = 64 << 20;
+    i64 start = -1;
+    i64 end = 0;
+    for (const Program::Segment& segment : program.segments)
+    {
+        if (!segment.code || segment.fileSize == 0)
+            continue;
+        start = start < 0 ? segment.address : std::min(start, segment.address);
+        end = std::max(end, segment.address + segment.fileSize);
+    }
+    start &= ~3ll;
+    std::vector<u32> words;
+    if (start >= 0 && end - start <= MAX_PREDECODE)
+    {
+        words.resize((end - start + 3) / 4);
+        memory.Read(start, reinterpret_cast<char*>(words.data()), end - start);
+    }
+    Machine::Predecode(start, std::move(words), image);
+}
+
+// Runs one program many times over, each instance with its own input, on a
+// pool of host threads. The program is loaded once. With guarded memory
+// every instance maps that copy, copy-on-write, so an instance only pays
+// for the pages it writes. Otherwise it is copied in from the one image.
+class Batch
+{
+public:
+    struct Result
+    {
+        i64 exitCode;     // a0 when it stopped
+        i64 instructions;
+        std::string output;
+    };
+
+    Batch(const char* image, const Program& program, const Layout& layout, Engine engine);
+    ~Batch();
+    Batch(const Batch&) = delete;
+    Batch& operator=(const Batch&) = delete;
+
+    // Run the program once per input, which it reads as its console input,
+    // on up to threads threads. Idle threads steal from busy ones. LOCKSTEP
+    // runs Lockstep::LANES instances at a time on each thread.
+    std::vector<Result> Run(const std::vector<std::string>& inputs, i32 threads);
+
+private:
+    // one thread's share of tasks, taken from the front by its owner and
+    // the back by thieves
+    struct Queue
+    {
+        std::deque<i64> tasks;
+        std::mutex lock;
+    };
+
+    // run instances [first, first+count) and fill in their results
+    void RunInstances(const std::vector<std::string>& inputs, i64 first, i64 count,
+                      std::vector<Result>& results);
+    // the next task for worker to run, -1 when there are none left anywhere
+    i64 Take(std::vector<Queue>& queues, size_t worker);
+
+    const char* _image;
+    Program _program;
+    Layout _layout;
+    Engine _engine;
+    int _loaded; // the loaded address space as a file to map, or -1
+    Machine::DecodedImage _decoded; // the code, decoded once for every instance
+};
+
+Batch::Batch(const char* image, const Program& program, const Layout& layout, Engine engine)
+    : _image(image), _program(program), _layout(layout), _engine(engine), _loaded(-1)
+{
+    {
+        PagedMemory memory(layout.memSize);
+        LoadProgram(program, image, memory);
+        PredecodeProgram(program, memory, _decoded);
+    }
+#if MACHINE_GUARD
+    if (!layout.guarded)
+        return;
+    // lay the segments out at their guest addresses in an unlinked file,
+    // so each one maps at the same offset as its address
+    std::FILE* file = std::tmpfile();
+    if (file == nullptr)
+        return;
+    _loaded = dup(fileno(file));
+    std::fclose(file);
+    i64 end = 0;
+    bool ok = _loaded != -1;
+    for (const Program::Segment& segment : program.segments)
+    {
+        ok = ok && pwrite(_loaded, image + segment.offset, segment.fileSize, segment.address) == segment.fileSize;
+        end = std::max(end, segment.address + segment.fileSize);
+    }
+    // mapping past the end of a file faults, so cover the last page
+    const i64 PAGE_SIZE = PagedMemory::PAGE_SIZE;
+    ok = ok && ftruncate(_loaded, (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) == 0;
+    if (!ok && _loaded != -1)
+    {
+        close(_loaded);
+        _loaded = -1;
+    }
+#endif
+}
+Batch::~Batch()
+{
+#if MACHINE_GUARD
+    if (_loaded != -1)
+        close(_loaded);
+#endif
+}
+
+std::vector<Batch::Result> Batch::Run(const std::vector<std::string>& inputs, i32 threads)
+{
+    std::vector<Result> results(inputs.size());
+    i64 perTask = _engine == LOCKSTEP ? Lockstep::LANES : 1;
+    i64 tasks = (static_cast<i64>(inputs.size()) + perTask - 1) / perTask;
+    size_t workers = std::max<size_t>(1, std::min<size_t>(threads, tasks));
+
+    // deal the tasks out in runs, so neighbours usually end up together
+    std::vector<Queue> queues(workers);
+    for (i64 t = 0; t < tasks; ++t)
+        queues[t * workers / tasks].tasks.push_back(t);
+
+    auto work = [&](size_t worker)
+    {
+        for (i64 t = Take(queues, worker); t != -1; t = Take(queues, worker))
+            RunInstances(inputs, t * perTask, std::min<i64>(perTask, inputs.size() - t * perTask), results);
+    };
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; ++w)
+        pool.emplace_back(work, w);
+    work(0);
+    for (std::thread& thread : pool)
+        thread.join();
+    return results;
+}
+
+i64 Batch::Take(std::vector<Queue>& queues, size_t worker)
+{
+    {
+        Queue& own = queues[worker];
+        std::lock_guard<std::mutex> lock(own.lock);
+        if (!own.tasks.empty())
+        {
+            i64 t = own.tasks.front();
+            own.tasks.pop_front();
+            return t;
+        }
+    }
+    // nothing left at home, so steal from the back of the others, starting
+    // with the next one along so thieves spread out
+    for (size_t k = 1; k < queues.size(); ++k)
+    {
+        Queue& victim = queues[(worker + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            i64 t = victim.tasks.back();
+            victim.tasks.pop_back();
+            return t;
+        }
+    }
+    // tasks never get added, so empty everywhere means done
+    return -1;
+}
+
+void Batch::RunInstances(const std::vector<std::string>& inputs, i64 first, i64 count,
+                         std::vector<Result>& results)
+{
+    const i64 PAGE_SIZE = PagedMemory::PAGE_SIZE;
+    std::vector<std::unique_ptr<PagedMemory>> memories;
+    std::vector<std::unique_ptr<Machine>> machines;
+    for (i64 i = first; i < first + count; ++i)
+    {
+        memories.emplace_back(new PagedMemory(_layout.memSize, _layout.guarded));
+        PagedMemory& memory = *memories.back();
+        bool mapped = _loaded != -1 && memory.Flat() != nullptr;
+        for (const Program::Segment& segment : _program.segments)
+        {
+            i64 start = segment.address & ~(PAGE_SIZE - 1);
+            i64 end = std::min(_layout.memSize, (segment.address + segment.fileSize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+            mapped = mapped && memory.MapFile(start, _loaded, start, end - start);
+        }
+        if (!mapped)
+            LoadProgram(_program, _image, memory);
+
+        machines.emplace_back(new Machine(memory));
+        Machine& mach = *machines.back();
+        mach.SetPC(_program.entry);
+        mach.SetXReg(2, _layout.stackTop);
+        mach.SetDecodedImage(&_decoded);
+        mach.CaptureOutput(&results[i].output);
+        mach.FeedInput(&inputs[i]);
+    }
+
+    if (_engine == LOCKSTEP)
+    {
+        std::vector<Machine*> lanes;
+        for (std::unique_ptr<Machine>& mach : machines)
+            lanes.push_back(mach.get());
+        std::vector<i64> instructions = Lockstep(lanes).Run(_program.endPC);
+        for (i64 k = 0; k < count; ++k)
+            results[first + k].instructions = instructions[k];
+    }
+    else
+    {
+        for (i64 k = 0; k < count; ++k)
+            results[first + k].instructions = ::Run(*machines[k], _program.endPC, _engine);
+    }
+    for (i64 k = 0; k < count; ++k)
+        results[first + k].exitCode = machines[k]->GetXReg(10);
+}
+
+// L1 data cache read misses on this thread between Start and Stop, from
+// the host's performance counters. Ok is false where there are none to
+// be had (not Linux, a VM without them, or perf_event_paranoid too high).
+class L1Misses
+{
+public:
+    L1Misses();
+    ~L1Misses();
+    L1Misses(const L1Misses&) = delete;
+    L1Misses& operator=(const L1Misses&) = delete;
+
+    bool Ok() const { return _fd >= 0; }
+    void Start();
+    i64 Stop();
+
+private:
+    int _fd;
+};
+
+L1Misses::L1Misses()
+    : _fd(-1)
+{
+#if MACHINE_PERF
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    _fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+}
+L1Misses::~L1Misses()
+{
+#if MACHINE_PERF
+    if (_fd >= 0)
+        close(_fd);
+#endif
+}
+void L1Misses::Start()
+{
+#if MACHINE_PERF
+    if (_fd < 0)
+        return;
+    ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+i64 L1Misses::Stop()
+{
+    u64 count = 0;
+#if MACHINE_PERF
+    if (_fd < 0)
+        return 0;
+    ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(_fd, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+#endif
+    return static_cast<i64>(count);
+}
+
+// run the program reps times under each engine, decode cache setting and
+// kind of memory (try ldst_test.bin to see what guarded memory buys), with
+// the L1 data cache misses per 1000 instructions where the host counts them
+// (try loop_test.bin with a large reps, it runs long enough to settle),
+// then a built-in loop storing next to its own code on the engines that
+// track stores to code
+// results go to stderr so the program's own output can be thrown away
+void Benchmark(const char* image, const Program& program, const Layout& layout, i32 reps)
+{
+    struct Config { const char* name; Engine engine; bool cache; bool guarded; };
+    const Config configs[] = {
+        { "stage, decode cache off", STAGE, false, false },
+        { "stage, decode cache on ", STAGE, true,  false },
+        { "fast,  decode cache off", FAST,  false, false },
+        { "fast,  checked memory  ", FAST,  true,  false },
+        { "fast,  guarded memory  ", FAST,  true,  true  },
+        { "block, checked memory  ", BLOCK, true,  false },
+        { "block, guarded memory  ", BLOCK, true,  true  },
+        { "jit,   checked memory  ", JIT,   true,  false },
+        { "jit,   guarded memory  ", JIT,   true,  true  },
+    };
+
+    L1Misses l1;
+    if (!l1.Ok())
+        std::cerr << "(no L1 miss counter on this host)\n";
+    auto bench = [&](const char* file, const Program& prog, const Config& config)
+    {
+        i64 instructions = 0;
+        i64 bytesOut = 0;
+        i64 misses = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (i32 i = 0; i < reps; ++i)
+        {
+            PagedMemory memory(layout.memSize, config.guarded);
+            LoadProgram(prog, file, memory);
+            Machine mach(memory);
+            mach.SetPC(prog.entry);
+            mach.SetXReg(2, layout.stackTop);
+            mach.SetDecodeCache(config.cache);
+            // only the run itself, not setting up the memory
+            l1.Start();
+            instructions += Run(mach, prog.endPC, config.engine);
+            misses += l1.Stop();
+            bytesOut += mach.OutputBytes();
+        }
+        std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        std::cerr << config.name << ": " 
+                  << instructions << " instructions in " << secs.count() << " s, "
+                  << static_cast<i64>(instructions / secs.count()) << " inst/s";
+        if (l1.Ok() && instructions > 0)
+            std::cerr << ", " << 1000.0 * misses / instructions << " L1d misses/1000 inst";
+        if (bytesOut > 0)
+            std::cerr << ", " << static_cast<i64>(bytesOut / secs.count() / 1e6) << " MB/s out";
+        std::cerr << '\n';
+    };
+    for (const Config& config : configs)
+        bench(image, program, config);
+
+    // sd to the dword right after the loop, on the same page, 200000 times
+    static const u32 NEAR_CODE[] = {
+        0x00000297, // auipc t0, 0
+        0x02428293, // addi  t0, t0, 36
+        0x00031337, // lui   t1, 49
+        0xd403031b, // addiw t1, t1, -704
+        0x0062b023, // sd    t1, 0(t0)
+        0xfff30313, // addi  t1, t1, -1
+        0xfe031ce3, // bnez  t1, -8
+        0x00000893, // li    a7, 0
+        0x00000073, // ecall
+        0, 0,       // the dword
+    };
+    Program near;
+    near.segments = { { 0, 0, sizeof(NEAR_CODE), sizeof(NEAR_CODE), true } };
+    near.entry = 0;
+    near.endPC = sizeof(NEAR_CODE);
+    const Config nearConfigs[] = {
+        { "store near code, fast,  checked", FAST,  true, false },
+        { "store near code, fast,  guarded", FAST,  true, true  },
+        { "store near code, block, checked", BLOCK, true, false },
+        { "store near code, block, guarded", BLOCK, true, true  },
+        { "store near code, jit,   checked", JIT,   true, false },
+        { "store near code, jit,   guarded", JIT,   true, true  },
+    };
+    for (const Config& config : nearConfigs)
+        bench(reinterpret_cast<const char*>(NEAR_CODE), near, config);
+}
+
+// run the program with up to 1, 2, 4 ... maxHarts harts on one engine
+// and kind of memory (try amo_test.bin, which fights over a spinlock and
+// an atomic counter), results go to stderr
+void BenchmarkHarts(const char* image, const Program& program, const Layout& layout,
+                    Engine engine, i64 maxHarts)
+{
+    for (i64 count = 1; count <= maxHarts; count *= 2)
+    {
+        auto start = std::chrono::steady_clock::now();
+        PagedMemory memory(layout.memSize, layout.guarded);
+        LoadProgram(program, image, memory);
+        Harts harts(memory, engine, program.endPC, true, count);
+        Machine mach(memory);
+        mach.SetHart(0, &harts);
+        mach.SetPC(program.entry);
+        mach.SetXReg(2, layout.stackTop);
+        i64 instructions = Run(mach, program.endPC, engine);
+        instructions += harts.Instructions();
+        std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        std::cerr << std::setw(2) << count << " harts: " 
+                  << instructions << " instructions in " << secs.count() << " s, "
+                  << static_cast<i64>(instructions / secs.count()) << " inst/s\n";
+        if (count < maxHarts && count * 2 > maxHarts)
+            count = maxHarts / 2;
+    }
+}
+
+// Run the program under the engines that should behave exactly like the
+// fast core on checked memory, on both kinds of memory, and compare the
+// output, instruction count, pc, registers and memory they end up with.
+// PIPELINE is left out, it runs STAGE but its cycle CSR counts pipeline
+// cycles. Returns true if everything matches.
+bool DiffTest(const char* image, const Program& program, const Layout& layout)
+{
+    struct Result
+    {
+        std::string output;
+        i64 instructions;
+        i64 pc;
+        i64 regs[32];
+        std::unique_ptr<PagedMemory> memory;
+    };
+    // every run reads the same console input, so stdin is read up front
+    std::string input((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+    // jitThreshold 1 compiles every block the first time it runs
+    auto run = [&](Engine engine, i64 jitThreshold, bool guarded)
+    {
+        Result r;
+        r.memory.reset(new PagedMemory(layout.memSize, guarded));
+        LoadProgram(program, image, *r.memory);
+        Machine mach(*r.memory);
+        mach.SetPC(program.entry);
+        mach.SetXReg(2, layout.stackTop);
+        mach.CaptureOutput(&r.output);
+        mach.FeedInput(&input);
+        if (engine == JIT)
+        {
+            mach.SetJit(true, jitThreshold);
+            r.instructions = mach.RunBlocks(program.endPC);
+        }
+        else
+            r.instructions = Run(mach, program.endPC, engine);
+        r.pc = mach.GetPC();
+        for (i32 i = 0; i < 32; ++i)
+            r.regs[i] = mach.GetXReg(i);
+        return r;
+    };
+
+    struct Config { const char* name; Engine engine; i64 jitThreshold; bool guarded; };
+    const Config configs[] = {
+        { "block               ", BLOCK, 0,  false },
+        { "jit                 ", JIT,   16, false },
+        { "jit (eager)         ", JIT,   1,  false },
+        { "fast (guarded)      ", FAST,  0,  true  },
+        { "block (guarded)     ", BLOCK, 0,  true  },
+        { "jit (guarded)       ", JIT,   16, true  },
+        { "jit (eager, guarded)", JIT,   1,  true  },
+        { "lockstep            ", LOCKSTEP, 0, false },
+        { "stage               ", STAGE, 0,  false },
+    };
+
+    Result expected = run(FAST, 0, false);
+    std::cout << "fast                : " << expected.instructions << " instructions\n";
+
+    bool allMatch = true;
+    for (const Config& config : configs)
+    {
+        Result r = run(config.engine, config.jitThreshold, config.guarded);
+        std::ostringstream why;
+        if (r.output != expected.output)
+            why << "output differs";
+        else if (r.instructions != expected.instructions)
+            why << r.instructions << " instructions";
+        else if (r.pc != expected.pc)
+            why << "pc is " << r.pc << ", expected " << expected.pc;
+        else
+        {
+            for (i32 i = 0; i < 32 && why.tellp() == 0; ++i)
+                if (r.regs[i] != expected.regs[i])
+                    why << "x" << i << " is " << r.regs[i] << ", expected " << expected.regs[i];
+            i64 at = r.memory->FirstDifference(*expected.memory);
+            if (why.tellp() == 0 && at != -1)
+                why << "memory differs at " << at;
+        }
+        bool match = why.tellp() == 0;
+        std::cout << config.name << ": " << (match ? "match" : "MISMATCH, " + why.str()) << '\n';
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+// Work out what the file wants loaded. An ELF64 RISC-V executable is
+// placed by its PT_LOAD segments, anything else is taken as a flat image.
+// Says what's wrong and returns false if the file can't be run.
+bool ReadProgram(const char* fileName, i64 memSize, Program& program)
+{
+    // open binary file and check if opened 
+    std::ifstream fin(fileName, std::ios::binary);
+    if (!fin.is_open())
+    {
+        std::cerr << "Could not open " << fileName << '\n';
+        return false;
+    }
+
+    // get size of file by pointing to end and getting position
+    fin.seekg(0, fin.end);
+    i64 fileSize = fin.tellg();
+    fin.seekg(0, fin.beg);
+
+    // little-endian fields out of the headers
+    auto field = [](const std::vector<char>& bytes, i64 at, i64 numBytes)
+    {
+        u64 value = 0;
+        std::memcpy(&value, bytes.data() + at, numBytes);
+        return static_cast<i64>(value);
+    };
+    const i64 EHDR_SIZE = 64;
+    std::vector<char> ehdr(EHDR_SIZE);
+    bool elf = fileSize >= EHDR_SIZE && fin.read(ehdr.data(), EHDR_SIZE)
+               && std::memcmp(ehdr.data(), "\x7f" "ELF", 4) == 0;
+
+    if (!elf)
+    {
+        // make sure the file size doesn't exceed the memory size
+        if (fileSize > memSize)
+        {
+            std::cerr << "File is too large\n";
+            return false;
+        }
+        // each instruction has to be four bytes 
+        if (fileSize % 4 != 0)
+        {
+            std::cerr << fileName << " needs a multiple of four bytes\n";
+            return false;
+        }
+        program.segments = { { 0, 0, fileSize, fileSize, true } };
+        program.entry = 0;
+        program.endPC = fileSize;
+        return true;
+    }
+
+    // ELFCLASS64, ELFDATA2LSB, ET_EXEC, EM_RISCV
+    const i64 PT_LOAD = 1, PF_X = 1, PHDR_SIZE = 56;
+    if (ehdr[4] != 2 || ehdr[5] != 1 || field(ehdr, 16, 2) != 2 || field(ehdr, 18, 2) != 243)
+    {
+        std::cerr << fileName << " is not a 64-bit little-endian RISC-V executable\n";
+        return false;
+    }
+    i64 phoff = field(ehdr, 32, 8);
+    i64 phnum = field(ehdr, 56, 2);
+    std::vector<char> phdrs(phnum * PHDR_SIZE);
+    if (field(ehdr, 54, 2) != PHDR_SIZE || phoff < 0 || phoff > fileSize
+        || !fin.seekg(phoff) || !fin.read(phdrs.data(), phdrs.size()))
+    {
+        std::cerr << fileName << " has broken program headers\n";
+        return false;
+    }
+
+    program.segments.clear();
+    program.entry = field(ehdr, 24, 8);
+    program.endPC = memSize;
+    for (i64 i = 0; i < phnum; ++i)
+    {
+        i64 at = i * PHDR_SIZE;
+        if (field(phdrs, at, 4) != PT_LOAD)
+            continue;
+        Program::Segment segment = { field(phdrs, at + 16, 8), field(phdrs, at + 8, 8),
+                                     field(phdrs, at + 32, 8), field(phdrs, at + 40, 8),
+                                     (field(phdrs, at + 4, 4) & PF_X) != 0 };
+        if (segment.offset < 0 || segment.fileSize < 0 || segment.fileSize > segment.memSize
+            || segment.offset > fileSize - segment.fileSize)
+        {
+            std::cerr << fileName << " has a segment that isn't in the file\n";
+            return false;
+        }
+        if (segment.address < 0 || segment.memSize > memSize - segment.address)
+        {
+            std::cerr << fileName << " needs memory up to " << segment.address + segment.memSize
+                      << ", try a bigger --mem-size\n";
+            return false;
+        }
+        program.segments.push_back(segment);
+    }
+    return true;
+}
+
+// Name the program's code for the profiler, from the symbol table of an
+// ELF file or, if listing is set, from a disassembly like wb_dis.S or
+// objdump -d output, where "<address> <name>:" lines start each function.
+// Says what's wrong and returns false if the file can't be read.
+bool ReadSymbols(const char* fileName, bool listing, Profiler& profiler)
+{
+    std::ifstream fin(fileName, std::ios::binary);
+    if (!fin.is_open())
+    {
+        std::cerr << "Could not open " << fileName << '\n';
+        return false;
+    }
+    std::vector<char> file((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    i64 fileSize = static_cast<i64>(file.size());
+
+    if (fileSize < 64 || std::memcmp(file.data(), "\x7f" "ELF", 4) != 0)
+    {
+        if (!listing)
+            return true;
+        std::istringstream in(std::string(file.begin(), file.end()));
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream words(line);
+            std::string address, name;
+            if (!(words >> address >> name) || name.size() < 4 || name.front() != '<'
+                || name.compare(name.size() - 2, 2, ">:") != 0
+                || address.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+                continue;
+            profiler.AddSymbol(std::stoll(address, nullptr, 16), name.substr(1, name.size() - 3));
+        }
+        return true;
+    }
+
+    // little-endian fields, 0 past the end of the file
+    auto field = [&](i64 at, i64 numBytes)
+    {
+        u64 value = 0;
+        if (at >= 0 && at <= fileSize - numBytes)
+            std::memcpy(&value, file.data() + at, numBytes);
+        return static_cast<i64>(value);
+    };
+    // SHT_SYMTAB, with the names in the string table it links to. Only
+    // code and plain labels that are defined somewhere count, not the
+    // assembler's local ($x, .L) ones.
+    const i64 SHDR_SIZE = 64, SYM_SIZE = 24, SHT_SYMTAB = 2, STT_NOTYPE = 0, STT_FUNC = 2, SHN_LORESERVE = 0xff00;
+    i64 shoff = field(40, 8);
+    i64 shnum = field(60, 2);
+    if (shnum > 0 && field(58, 2) != SHDR_SIZE)
+    {
+        std::cerr << fileName << " has broken section headers\n";
+        return false;
+    }
+    for (i64 i = 0; i < shnum; ++i)
+    {
+        i64 section = shoff + i * SHDR_SIZE;
+        if (field(section + 4, 4) != SHT_SYMTAB)
+            continue;
+        i64 offset = field(section + 24, 8);
+        i64 size = field(section + 32, 8);
+        i64 strings = shoff + field(section + 40, 4) * SHDR_SIZE;
+        i64 stringsOffset = field(strings + 24, 8);
+        i64 stringsSize = field(strings + 32, 8);
+        if (offset < 0 || size < 0 || offset > fileSize - size
+            || stringsOffset < 0 || stringsSize < 0 || stringsOffset > fileSize - stringsSize)
+        {
+            std::cerr << fileName << " has a symbol table that isn't in the file\n";
+            return false;
+        }
+        for (i64 at = offset; at + SYM_SIZE <= offset + size; at += SYM_SIZE)
+        {
+            i64 name = field(at, 4);
+            i64 type = field(at + 4, 1) & 0xf;
+            i64 index = field(at + 6, 2);
+            if ((type != STT_NOTYPE && type != STT_FUNC) || index == 0 || index >= SHN_LORESERVE
+                || name == 0 || name >= stringsSize)
+                continue;
+            const char* start = file.data() + stringsOffset + name;
+            std::string symbol(start, strnlen(start, stringsSize - name));
+            if (symbol[0] != '$' && symbol.compare(0, 2, ".L") != 0)
+                profiler.AddSymbol(field(at + 8, 8), symbol);
+        }
+    }
+    return true;
+}
 
-// (2) offset the program counter (+4 for all instructions except BRANCH, JAL, and JALR) 
-    switch (_DO.op)
+// Print a trace from --trace the way the stages' operator<<s print them,
+// along with what each instruction wrote back. Decode and Execute are run
+// again on the registers the trace has built up, Memory shows what was
+// loaded, and instructions that only touch the registers are replayed to
+// find out what they wrote and where they went. Says what's wrong and
+// returns false if the file isn't a trace or is cut short.
+bool DecodeTrace(const char* fileName, std::ostream& out)
+{
+    std::ifstream fin(fileName, std::ios::binary);
+    char magic[sizeof(TraceWriter::MAGIC)];
+    i64 regs[32];
+    if (!fin.read(magic, sizeof(magic)) || std::memcmp(magic, TraceWriter::MAGIC, sizeof(magic)) != 0
+        || !fin.read(reinterpret_cast<char*>(regs), sizeof(regs)))
     {
-    case JALR:
-    case JAL:
-        // new pc calculate in execute
-        SetPC(_MO.value);
-        break;
-    case BRANCH:
-        // add offset to pc if condition is true, other wise add 4
-        if ((_DO.funct3 == 0b000 && _EO.z == 1) || // BEQ
-            (_DO.funct3 == 0b001 && _EO.z == 0) || // BNE
-            (_DO.funct3 == 0b100 && _EO.n == 1) || // BLT
-            (_DO.funct3 == 0b101 && _EO.n == 0))   // BGE
-            SetPC(GetPC() + _DO.offset);
-        else   
-            SetPC(GetPC()+4);
-        break;
-    default:
-        // every other instruction
-        SetPC(GetPC()+4);
+        std::cerr << fileName << " is not a trace\n";
+        return false;
     }
 
-// (3) talk to the operating system (for SYSTEM instructions)
-    // return true to go to next instruction
-    // return false to quit program
-    // check if there are any environment calls
-    if (_DO.op == SYSTEM)
+    // a machine to decode and execute on, which never touches its memory
+    PagedMemory memory(PagedMemory::PAGE_SIZE, false);
+    Machine mach(memory);
+    mach.SetDecodeCache(false);
+    for (i32 r = 0; r < 32; ++r)
+        mach.SetXReg(r, regs[r]);
+
+    i64 expected = 0;
+    std::vector<u32> words(1 << TraceWriter::WORD_BITS, 0);
+    i64 value = 0;
+    std::vector<u8> stored;
+    std::vector<u8> raw;
+    u8 compression;
+    u32 sizes[2];
+    while (fin.read(reinterpret_cast<char*>(&compression), 1))
     {
-        // look a the a7 register (x17)
-        switch (GetXReg(17))
-        {
-        case 0: // quit the program
-            return false; 
-        case 1: // getchar
-            SetXReg(10, getchar() & 0xff); // store a char in reg a0 (x10)
+        if (!fin.read(reinterpret_cast<char*>(sizes), sizeof(sizes)))
             break;
-        case 2: // putchar
-            putchar(static_cast<char>(GetXReg(10)));
+        stored.resize(sizes[1]);
+        if (!fin.read(reinterpret_cast<char*>(stored.data()), sizes[1]))
             break;
+        if (compression == TraceWriter::LZ)
+        {
+            if (!TraceWriter::Decompress(stored.data(), sizes[1], sizes[0], raw))
+                break;
+        }
+        else
+            raw.swap(stored);
+
+        const u8* at = raw.data();
+        const u8* end = at + raw.size();
+        bool broken = false;
+        auto varint = [&]()
+        {
+            u64 value = 0;
+            for (i32 shift = 0; ; shift += 7)
+            {
+                if (at == end || shift > 63)
+                {
+                    broken = true;
+                    return static_cast<i64>(0);
+                }
+                u8 byte = *at++;
+                value |= static_cast<u64>(byte & 0x7f) << shift;
+                if (byte < 0x80)
+                    return TraceWriter::Unzigzag(value);
+            }
+        };
+        while (at < end && !broken)
+        {
+            u8 flags = *at++;
+            i64 pc = expected + (flags & TraceWriter::MOVED ? varint() : 0);
+            u32& word = words[(pc >> 2) & ((1 << TraceWriter::WORD_BITS) - 1)];
+            if (flags & TraceWriter::NEW_WORD)
+            {
+                if (end - at < 4)
+                    break;
+                std::memcpy(&word, at, 4);
+                at += 4;
+            }
+            if (flags & TraceWriter::VALUE)
+                value += varint();
+            if (broken)
+                break;
+
+            mach.SetPC(pc);
+            mach.DebugFetchOut().instruction = word;
+            mach.Decode();
+            mach.Execute();
+            const Machine::DecodeOut& dec = mach.DebugDecodeOut();
+            Machine::MemoryOut& mo = mach.DebugMemoryOut();
+            // Memory leaves the last value there for stores
+            if (dec.op == Machine::LOAD || dec.op == Machine::AMO || (dec.op == Machine::SYSTEM && dec.funct3 != 0))
+                mo.value = value;
+            else if (dec.op == Machine::SYSTEM || dec.op == Machine::MISC_MEM)
+                mo.value = 0;
+            else if (dec.op != Machine::STORE)
+                mo.value = mach.DebugExecuteOut().result;
+
+            out << "PC = " << pc << '\n' << mach.DebugFetchOut() << '\n' << dec << '\n'
+                << mach.DebugExecuteOut() << '\n' << mo << '\n';
+            u32 rd = dec.op == Machine::SYSTEM && dec.funct3 == 0 ? 10 : dec.rd;
+            i64 old = mach.GetXReg(rd);
+            if (mach.Replay(word))
+                expected = mach.GetPC();
+            else
+            {
+                expected = pc + 4;
+                if (flags & TraceWriter::VALUE)
+                    mach.SetXReg(rd, value);
+            }
+            if (rd != 0 && mach.GetXReg(rd) != old)
+                out << "Writeback: " << rd << " = " << mach.GetXReg(rd) << '\n';
+            out << '\n';
+        }
+        if (at != end)
+        {
+            std::cerr << fileName << " has a broken record\n";
+            return false;
         }
     }
-    return true; // go to next instruction
+    if (!fin.eof())
+    {
+        std::cerr << fileName << " is cut short\n";
+        return false;
+    }
+    return true;
 }
 
-Machine::FetchOut& Machine::DebugFetchOut()
-{
-    return _FO;
-}
-Machine::DecodeOut& Machine::DebugDecodeOut()
+// copy the program into memory through an ifstream
+bool ReadImage(const char* fileName, const Program& program, PagedMemory& memory)
 {
-    return _DO;
-}
-Machine::ExecuteOut& Machine::DebugExecuteOut()
-{
-    return _EO;
+    std::ifstream fin(fileName, std::ios::binary);
+    fin.seekg(0, fin.end);
+    std::vector<char> file(static_cast<i64>(fin.tellg()));
+    fin.seekg(0, fin.beg);
+    if (!fin.read(file.data(), file.size()))
+        return false;
+    LoadProgram(program, file.data(), memory);
+    return true;
 }
-Machine::MemoryOut& Machine::DebugMemoryOut()
+
+// map the program into guarded memory without copying it, returns false
+// if that can't be done and it has to be read instead
+bool MapImage(const char* fileName, const Program& program, PagedMemory& memory)
 {
-    return _MO;
+#if MACHINE_GUARD
+    // mmap works in whole pages, so no two segments can share one
+    const i64 PAGE_SIZE = PagedMemory::PAGE_SIZE;
+    std::vector<Program::Segment> sorted = program.segments;
+    std::sort(sorted.begin(), sorted.end(), 
+              [](const Program::Segment& a, const Program::Segment& b) { return a.address < b.address; });
+    for (size_t i = 1; i < sorted.size(); ++i)
+    {
+        const Program::Segment& last = sorted[i - 1];
+        if ((last.address + last.memSize + PAGE_SIZE - 1) / PAGE_SIZE > sorted[i].address / PAGE_SIZE)
+            return false;
+    }
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1)
+        return false;
+    // the mappings hold on to the file by themselves
+    bool mapped = true;
+    for (const Program::Segment& segment : program.segments)
+        mapped = mapped && memory.MapFile(segment.address, fd, segment.offset, segment.fileSize);
+    close(fd);
+    return mapped;
+#else
+    (void)fileName;
+    (void)program;
+    (void)memory;
+    return false;
+#endif
 }
 
-template <typename T>
-T Machine::MemoryRead(i64 address) const
+// time getting the program into a fresh guarded memory reps times, reading
+// it in versus mapping it (try a large image to see the difference), and
+// then pre-decoding its code
+void BenchmarkLoad(const char* fileName, const Program& program, const Layout& layout, i32 reps)
 {
-    // address cannot be negative
-    // _memory has addresses [0, _memorySize-1] (inclusive)
-    // the max value of address is _memorySize - sizeof(T) (number of bytes in T)
-
-    // example: T = char: max address = MEM_SIZE-1  
-    //          T =  i64: max address = MEM_SIZE-8  
+    struct Config { const char* name; bool (*load)(const char*, const Program&, PagedMemory&); };
+    const Config configs[] = {
+        { "read", &ReadImage },
+        { "mmap", &MapImage  },
+    };
 
-    i64 numBytes = static_cast<i64>(sizeof(T));
-    if (address < 0 || address > _memorySize-numBytes)
+    for (const Config& config : configs)
     {
-        std::cerr << "[MemoryRead]: address " << address << " would access undefined memory\n";
-        return T(); // 0
+        bool ok = true;
+        auto start = std::chrono::steady_clock::now();
+        for (i32 i = 0; i < reps && ok; ++i)
+        {
+            PagedMemory memory(layout.memSize, true);
+            ok = config.load(fileName, program, memory);
+        }
+        std::chrono::duration<double, std::micro> usecs = std::chrono::steady_clock::now() - start;
+        if (!ok)
+            std::cerr << config.name << ": not supported here\n";
+        else
+            std::cerr << config.name << ": " << usecs.count() / reps << " us per load\n";
     }
-    return *reinterpret_cast<T*>(_memory + address);
+
+    // then decoding the code up front
+    PagedMemory memory(layout.memSize, true);
+    if (!ReadImage(fileName, program, memory))
+        return;
+    // one image throughout, so its arrays are only allocated the first time
+    Machine::DecodedImage image;
+    PredecodeProgram(program, memory, image);
+    i64 words = image.words.size();
+    auto start = std::chrono::steady_clock::now();
+    for (i32 i = 0; i < reps; ++i)
+        PredecodeProgram(program, memory, image);
+    std::chrono::duration<double, std::micro> usecs = std::chrono::steady_clock::now() - start;
+    std::cerr << "predecode: " << usecs.count() / reps << " us per load, " << words << " words, "
+              << static_cast<i64>(words * 4 * reps / usecs.count()) << " MB/s\n";
 }
 
-template <typename T>
-void Machine::MemoryWrite(i64 address, T value)
+// Run the program once for each line of inputFile, given that line as its
+// input, and write one line per instance to out: its number, exit code,
+// instruction count and output, tab separated, with the output escaped.
+// A summary goes to stderr.
+bool RunBatch(const char* image, const Program& program, const Layout& layout, Engine engine,
+              const char* inputFile, i32 threads, std::ostream& out)
 {
-    // address cannot be negative
-    // _memory has addresses [0, _memorySize-1] (inclusive)
-    // the max value of address is _memorySize - sizeof(T) (number of bytes in T)
+    std::ifstream fin(inputFile);
+    if (!fin)
+    {
+        std::cerr << "Could not read " << inputFile << '\n';
+        return false;
+    }
+    std::vector<std::string> inputs;
+    for (std::string line; std::getline(fin, line); )
+        inputs.push_back(line + '\n');
 
-    i64 numBytes = static_cast<i64>(sizeof(T));
-    if (address < 0 || address > _memorySize-numBytes)
+    auto start = std::chrono::steady_clock::now();
+    Batch batch(image, program, layout, engine);
+    std::vector<Batch::Result> results = batch.Run(inputs, threads);
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+    i64 instructions = 0;
+    for (size_t i = 0; i < results.size(); ++i)
     {
-        std::cerr << "[MemoryWrite]: address " << address << " would access undefined memory\n";
-        return;
+        const Batch::Result& r = results[i];
+        instructions += r.instructions;
+        out << i << '\t' << r.exitCode << '\t' << r.instructions << '\t';
+        for (char c : r.output)
+        {
+            switch (c)
+            {
+            case '\n': out << "\\n"; break;
+            case '\t': out << "\\t"; break;
+            case '\\': out << "\\\\"; break;
+            default:
+                if (static_cast<unsigned char>(c) < ' ' || static_cast<unsigned char>(c) >= 0x7f)
+                    out << "\\x" << std::hex << std::setw(2) << std::setfill('0') 
+                        << (static_cast<u32>(c) & 0xff) << std::dec << std::setfill(' ');
+                else
+                    out << c;
+            }
+        }
+        out << '\n';
     }
-    *reinterpret_cast<T*>(_memory + address) = value;
+    std::cerr << results.size() << " instances on " << threads << " threads: "
+              << instructions << " instructions in " << secs.count() << " s, "
+              << static_cast<i64>(instructions / secs.count()) << " inst/s, "
+              << static_cast<i64>(results.size() / secs.count()) << " instances/s\n";
+    return static_cast<bool>(out);
 }
 
-i64 Machine::SignExtend(u64 value, u32 index) const
+// read a size like 4096, 0x1000, 256K, 64M or 4G
+i64 ParseSize(const std::string& text)
 {
-    if ((value >> index) & 1) 
+    size_t end = 0;
+    i64 value = std::stoll(text, &end, 0);
+    switch (end < text.size() ? text[end] : ' ')
     {
-        // Sign bit is 1
-        return value | (-1ull << index);
+    case 'K': case 'k':
+        return value << 10;
+    case 'M': case 'm':
+        return value << 20;
+    case 'G': case 'g':
+        return value << 30;
     }
-    else 
-    {
-        // Sign bit is 0
-        return value & ~(-1ull << index);
-    }  
+    return value;
 }
 
-void Machine::DecodeR()
-{
-    _DO.rd     = (_FO.instruction >> 7)  & 0x1f;
-    _DO.funct3 = (_FO.instruction >> 12) & 0x7;
-    _DO.funct7 = (_FO.instruction >> 25) & 0x3f;
-    _DO.offset = 0ll;
-    _DO.leftVal  = GetXReg(_FO.instruction >> 15);
-    _DO.rightVal = GetXReg(_FO.instruction >> 20);
-}
-void Machine::DecodeI()
-{
-    _DO.rd     = (_FO.instruction >> 7)  & 0x1f;
-    _DO.funct3 = (_FO.instruction >> 12) & 0x7;
-    _DO.funct7 = 0;
-    _DO.offset = 0ll;
-    _DO.leftVal  = GetXReg(_FO.instruction >> 15);
-    _DO.rightVal = SignExtend((_FO.instruction >> 20) & 0xfff, 11u);
-}
-void Machine::DecodeS()
-{
-    _DO.rd     = 0;
-    _DO.funct3 = (_FO.instruction >> 12) & 0x7;
-    _DO.funct7 = 0;
-    _DO.offset = SignExtend(((_FO.instruction >> 7)  & 0x1f) |
-                           (((_FO.instruction >> 25) & 0x7f) << 5), 11u);
-    _DO.leftVal  = GetXReg(_FO.instruction >> 15);
-    _DO.rightVal = GetXReg(_FO.instruction >> 20);
-}
-void Machine::DecodeB()
-{
-    _DO.rd     = 0;
-    _DO.funct3 = (_FO.instruction >> 12) & 0x7;
-    _DO.funct7 = 0;
-    _DO.offset = SignExtend((((_FO.instruction >> 31) & 1)    << 12) |
-                            (((_FO.instruction >> 25) & 0x3f) << 5)  |
-                            (((_FO.instruction >> 8)  & 0xf)  << 1)  | 
-                            (((_FO.instruction >> 7)  & 1)    << 11), 12u);
-    _DO.leftVal  = GetXReg(_FO.instruction >> 15); // get_xreg truncates for us
-    _DO.rightVal = GetXReg(_FO.instruction >> 20);
-}
-void Machine::DecodeU()
-{
-    _DO.rd     = (_FO.instruction >> 7) & 0x1f;
-    _DO.funct3 = 0;
-    _DO.funct7 = 0;
-    _DO.offset = 0ll;
-    _DO.leftVal  = 0ll;
-    _DO.rightVal = SignExtend((((_FO.instruction >> 12) & 0xf'ffff) << 12), 31u);
-}
-void Machine::DecodeJ()
-{
-    _DO.rd     = (_FO.instruction >> 7) & 0x1f;
-    _DO.funct3 = 0;
-    _DO.funct7 = 0;
-    _DO.offset = 0ll;
-    _DO.leftVal  = 0ll;
-    _DO.rightVal = SignExtend((((_FO.instruction >> 31) & 1)     << 20) | 
-                              (((_FO.instruction >> 21) & 0x3ff) << 1)  |
-                              (((_FO.instruction >> 20) & 1)     << 11) |
-                              (((_FO.instruction >> 12) & 0xff)  << 12), 20u);
+// Read a cache like 32K,8,64,lru,wb: size, ways, line size, replacement
+// and write policy, leaving whatever isn't given as it is. A size of 0
+// leaves the cache out.
+bool ParseCache(const std::string& text, Caches::Config& config)
+{
+    std::istringstream in(text);
+    std::string field;
+    for (i32 i = 0; std::getline(in, field, ','); ++i)
+    {
+        if (field.empty())
+            return false;
+        switch (i)
+        {
+        case 0: config.size = ParseSize(field);     break;
+        case 1: config.ways = std::stoll(field);     break;
+        case 2: config.lineSize = ParseSize(field); break;
+        case 3:
+            if (field == "lru")
+                config.replacement = Caches::LRU;
+            else if (field == "plru")
+                config.replacement = Caches::PLRU;
+            else if (field == "random")
+                config.replacement = Caches::RANDOM;
+            else
+                return false;
+            break;
+        case 4:
+            if (field != "wb" && field != "wt")
+                return false;
+            config.writeBack = field == "wb";
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
 }
 
-Machine::ExecuteOut Machine::ALU(Machine::Alu cmd, i64 left, i64 right) const
+int main(int argc, char* argv[])
 {
-    ExecuteOut ret;
+    const char* fileName = nullptr;
+    bool decodeCache = true;
+    Engine engine = FAST;
+    bool stats = false;
+    bool forwarding = true;
+    BranchPredictor::Scheme predictor = BranchPredictor::NOT_TAKEN;
+    i32 rasEntries = 0;
+    bool caches = false;
+    i64 profileInterval = 0;
+    const char* profileOut = nullptr;
+    const char* symbolsFile = nullptr;
+    const char* countersOut = nullptr;
+    const char* traceFile = nullptr;
+    TraceWriter::Compression traceCompression = TraceWriter::LZ;
+    const char* decodeTrace = nullptr;
+    Caches::Config l1i = Caches::DEFAULT_L1I;
+    Caches::Config l1d = Caches::DEFAULT_L1D;
+    Caches::Config l2 = Caches::DEFAULT_L2;
+    bool diffTest = false;
+    i32 benchReps = 0;
+    i32 benchLoadReps = 0;
+    i64 benchHarts = 0;
+    const char* batchFile = nullptr;
+    const char* batchOut = nullptr;
+    i32 threads = std::max(1u, std::thread::hardware_concurrency());
+    bool mapImage = true;
+    i64 hartCount = 1;
+    Layout layout = { 1 << 18, -1, true }; // 256 KiB, stack at the top
 
-    // perform the appropriate operation 
-    // store in ExecuteOut
-    switch (cmd) 
+    for (i32 i = 1; i < argc; ++i)
     {
-    case NO_OP:
-        ret.result = 0;
-        break;
-    case ADD:
-        ret.result = left + right;
-        break;
-    case SUB:
-        ret.result = left - right;
-        break;
-    case MUL:
-        ret.result = left * right;
-        break;
-    case DIV:
-        ret.result = left / right;
-        break;
-    case REM:
-        ret.result = left % right;
-        break;
-    case AND:
-        ret.result = left & right;
-        break;
-    case OR:
-        ret.result = left | right;
-        break;
-    case XOR:
-        ret.result = left ^ right;
-        break;
-    case NOT:
-        ret.result = ~right;
-        break;
-    case SRL:
-        ret.result = static_cast<u64>(left) >> right;
-        break;
-    case SLL:
-        ret.result = left << right;
-        break;
-    case SRA:
-        ret.result = left >> right;
-        break;
+        std::string arg = argv[i];
+        if (arg == "--no-decode-cache")
+            decodeCache = false;
+        else if (arg == "--engine" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            if (name == "stage")
+                engine = STAGE;
+            else if (name == "fast")
+                engine = FAST;
+            else if (name == "block")
+                engine = BLOCK;
+            else if (name == "jit")
+                engine = JIT;
+            else if (name == "lockstep")
+                engine = LOCKSTEP;
+            else if (name == "pipeline")
+                engine = PIPELINE;
+            else
+            {
+                std::cerr << "Unknown engine " << name << '\n';
+                return 1;
+            }
+        }
+        else if (arg == "--stats")
+            stats = true;
+        else if (arg == "--no-forwarding")
+            forwarding = false;
+        else if (arg == "--predictor" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            if (name == "not-taken")
+                predictor = BranchPredictor::NOT_TAKEN;
+            else if (name == "static")
+                predictor = BranchPredictor::STATIC;
+            else if (name == "bimodal")
+                predictor = BranchPredictor::BIMODAL;
+            else if (name == "gshare")
+                predictor = BranchPredictor::GSHARE;
+            else if (name == "tage")
+                predictor = BranchPredictor::TAGE;
+            else
+            {
+                std::cerr << "Unknown predictor " << name << '\n';
+                return 1;
+            }
+        }
+        else if (arg == "--ras" && i + 1 < argc)
+            rasEntries = std::max(0, std::stoi(argv[++i]));
+        else if (arg == "--cache")
+            caches = true;
+        else if ((arg == "--l1i" || arg == "--l1d" || arg == "--l2") && i + 1 < argc)
+        {
+            Caches::Config& config = arg == "--l1i" ? l1i : arg == "--l1d" ? l1d : l2;
+            if (!ParseCache(argv[++i], config))
+            {
+                std::cerr << "Bad cache " << argv[i] << ", expected SIZE[,WAYS[,LINE[,lru|plru|random[,wb|wt]]]]\n";
+                return 1;
+            }
+            caches = true;
+        }
+        else if (arg == "--profile" && i + 1 < argc)
+            profileInterval = std::max(1ll, std::stoll(argv[++i]));
+        else if (arg == "--profile-out" && i + 1 < argc)
+        {
+            profileOut = argv[++i];
+            if (profileInterval == 0)
+                profileInterval = 1000;
+        }
+        else if (arg == "--symbols" && i + 1 < argc)
+            symbolsFile = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            traceFile = argv[++i];
+        else if (arg == "--trace-compression" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            if (name != "none" && name != "lz")
+            {
+                std::cerr << "Unknown compression " << name << '\n';
+                return 1;
+            }
+            traceCompression = name == "lz" ? TraceWriter::LZ : TraceWriter::NONE;
+        }
+        else if (arg == "--decode-trace" && i + 1 < argc)
+            decodeTrace = argv[++i];
+        else if (arg == "--counters" && i + 1 < argc)
+        {
+            countersOut = argv[++i];
+            if (!MACHINE_COUNTERS)
+            {
+                std::cerr << "This build has no counters, it was built with MACHINE_COUNTERS 0\n";
+                return 1;
+            }
+        }
+        else if (arg == "--difftest")
+            diffTest = true;
+        else if (arg == "--mem-size" && i + 1 < argc)
+            layout.memSize = ParseSize(argv[++i]);
+        else if (arg == "--memory" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            if (name != "checked" && name != "guarded")
+            {
+                std::cerr << "Unknown memory " << name << '\n';
+                return 1;
+            }
+            layout.guarded = name == "guarded";
+        }
+        else if (arg == "--stack" && i + 1 < argc)
+            layout.stackTop = ParseSize(argv[++i]);
+        else if (arg == "--load" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            if (name != "read" && name != "mmap")
+            {
+                std::cerr << "Unknown load " << name << '\n';
+                return 1;
+            }
+            mapImage = name == "mmap";
+        }
+        else if (arg == "--harts" && i + 1 < argc)
+            hartCount = std::stoll(argv[++i]);
+        else if (arg == "--bench" && i + 1 < argc)
+            benchReps = std::stoi(argv[++i]);
+        else if (arg == "--batch" && i + 1 < argc)
+            batchFile = argv[++i];
+        else if (arg == "--batch-out" && i + 1 < argc)
+            batchOut = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--bench-harts" && i + 1 < argc)
+            benchHarts = std::stoll(argv[++i]);
+        else if (arg == "--bench-load" && i + 1 < argc)
+            benchLoadReps = std::stoi(argv[++i]);
+        else if (fileName == nullptr && arg[0] != '-')
+            fileName = argv[i];
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--engine stage|fast|block|jit|lockstep|pipeline] [--stats] [--no-forwarding]"
+                      << " [--predictor not-taken|static|bimodal|gshare|tage] [--ras N]"
+                      << " [--cache] [--l1i CACHE] [--l1d CACHE] [--l2 CACHE] [--no-decode-cache]"
+                      << " [--profile N] [--profile-out FILE] [--symbols FILE] [--counters FILE]"
+                      << " [--trace FILE] [--trace-compression none|lz] [--decode-trace FILE]"
+                      << " [--memory checked|guarded] [--mem-size SIZE] [--stack ADDR] [--load read|mmap]"
+                      << " [--harts N] [--batch INPUTS] [--batch-out FILE] [--threads N] [--bench N] [--bench-load N] [--bench-harts N] [--difftest] file.bin\n";
+            return 1;
+        }
     }
 
-    // Now that we have the result, determine the flags.
-    u8 sign_left   = (left  >> 63) & 1;
-    u8 sign_right  = (right >> 63) & 1;
-    u8 sign_result = (ret.result >> 63) & 1;
-
-    ret.z = !ret.result;
-    ret.n = sign_result;
-    ret.v = (~sign_left & ~sign_right &  sign_result) |
-            ( sign_left &  sign_right & ~sign_result);
-    ret.c = (ret.result > left) || (ret.result > right);
-
-    return ret;
-}
+    if (decodeTrace != nullptr)
+        return DecodeTrace(decodeTrace, std::cout) ? 0 : 1;
 
-int main(int argc, char* argv[])
-{
     // check if a file name is provided
-    if (argc != 2) 
+    if (fileName == nullptr) 
     {
         std::cerr << "Provide a file name\n";
         return 1;
     }
-
-    // open binary file and check if opened 
-    std::ifstream fin(argv[1], std::ios::binary);
-    if (!fin.is_open())
+    if (caches)
+    {
+        for (const Caches::Config* config : { &l1i, &l1d, &l2 })
+        {
+            if (const char* problem = Caches::Check(*config))
+            {
+                std::cerr << "Bad cache: " << problem << '\n';
+                return 1;
+            }
+        }
+        if (engine != STAGE && engine != FAST && engine != PIPELINE)
+        {
+            std::cerr << "The caches only see --engine stage, fast or pipeline\n";
+            return 1;
+        }
+    }
+    if (profileInterval > 0 && engine != STAGE && engine != FAST && engine != PIPELINE)
     {
-        std::cerr << "Could not open " << argv[1] << '\n';
+        std::cerr << "The profiler only sees --engine stage, fast or pipeline\n";
         return 1;
     }
-
-    constexpr i64 MEM_SIZE = 1 << 18; // 2^18
-    
-    // get size of file by pointing to end and getting position
-    fin.seekg(0, fin.end);
-    int fileSize = fin.tellg();
-    // std::cout << "fileSize = " << fileSize << '\n';
-
-    // make sure the file size doesn't exceed the memory size
-    if (fileSize > MEM_SIZE)
+    if (countersOut != nullptr && engine != STAGE && engine != FAST && engine != PIPELINE)
     {
-        std::cerr << "File is too large\n";
+        std::cerr << "The counters only see --engine stage, fast or pipeline\n";
         return 1;
     }
-
-    // each instruction has to be four bytes 
-    if (fileSize % 4 != 0)
+    if (traceFile != nullptr && engine != STAGE && engine != FAST && engine != PIPELINE)
     {
-        std::cerr << argv[1] << " needs a multiple of four bytes\n";
+        std::cerr << "Only --engine stage, fast or pipeline can be traced\n";
         return 1;
     }
 
-    // go to beginning of file
-    fin.seekg(0, fin.beg);
+    // the address space is only paged in as it is used, so it can be big
+    PagedMemory memory(layout.memSize, layout.guarded);
+    layout.memSize = memory.Size(); // rounded up to whole pages
+    if (layout.stackTop == -1)
+        layout.stackTop = layout.memSize;
 
-    // read bytes from file into memory
-    char* memory = new char[MEM_SIZE]; 
-    fin.read(memory, fileSize);
-    fin.close();
+    Program program;
+    if (!ReadProgram(fileName, layout.memSize, program))
+        return 1;
 
-    // create the Machine using the allocated memory and debug
-    Machine mach(memory, MEM_SIZE);
-    while (mach.GetPC() < fileSize)
+    if (benchLoadReps > 0)
     {
-        // uncomment for debug
-        // std::cout << "PC = " << mach.GetPC() << '\n';
-        mach.Fetch();
-        // std::cout << mach.DebugFetchOut() << '\n';
-        mach.Decode();
-        // std::cout << mach.DebugDecodeOut() << '\n';
-        mach.Execute();
-        // std::cout << mach.DebugExecuteOut() << '\n';
-        mach.Memory();
-        // std::cout << mach.DebugMemoryOut() << '\n';
-        if (!mach.WriteBack())
-            break;
-        // std::cout << '\n';
+        BenchmarkLoad(fileName, program, layout, benchLoadReps);
+        return 0;
+    }
+
+    if (diffTest || benchReps > 0 || benchHarts > 0 || batchFile != nullptr)
+    {
+        // these make lots of machines, so keep a copy of the file around
+        std::ifstream fin(fileName, std::ios::binary);
+        std::vector<char> file((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+        if (diffTest)
+            return DiffTest(file.data(), program, layout) ? 0 : 1;
+        if (batchFile != nullptr)
+        {
+            if (batchOut == nullptr)
+                return RunBatch(file.data(), program, layout, engine, batchFile, threads, std::cout) ? 0 : 1;
+            std::ofstream fout(batchOut);
+            return RunBatch(file.data(), program, layout, engine, batchFile, threads, fout) ? 0 : 1;
+        }
+        if (benchHarts > 0)
+        {
+            BenchmarkHarts(file.data(), program, layout, engine, benchHarts);
+            return 0;
+        }
+        Benchmark(file.data(), program, layout, benchReps);
+        return 0;
+    }
+
+    // map the file straight into guarded memory if possible, otherwise read it in
+    if (!(mapImage && MapImage(fileName, program, memory)) && !ReadImage(fileName, program, memory))
+    {
+        std::cerr << "Could not read " << fileName << '\n';
+        return 1;
     }
 
-    // cleanup
-    delete[] memory;
+    // create the Machine using the paged memory and debug
+    // it is hart 0 and can start the rest
+    // decode all the code up front, for every hart
+    Machine::DecodedImage decoded;
+    if (decodeCache)
+        PredecodeProgram(program, memory, decoded);
+    Harts harts(memory, engine, program.endPC, decodeCache, hartCount);
+    Machine mach(memory);
+    mach.SetHart(0, &harts);
+    mach.SetPC(program.entry);
+    mach.SetXReg(2, layout.stackTop);
+    mach.SetDecodeCache(decodeCache);
+    if (decodeCache)
+    {
+        mach.SetDecodedImage(&decoded);
+        harts.SetDecodedImage(&decoded);
+    }
+    mach.SetForwarding(forwarding);
+    mach.SetPredictor(predictor, rasEntries);
+    if (caches)
+        mach.SetCaches(l1i, l1d, l2);
+    // an ELF program names itself, unless --symbols says otherwise
+    std::unique_ptr<Profiler> profiler;
+    if (profileInterval > 0)
+    {
+        profiler.reset(new Profiler(profileInterval, program.entry));
+        if (!ReadSymbols(symbolsFile != nullptr ? symbolsFile : fileName, symbolsFile != nullptr, *profiler))
+            return 1;
+        mach.SetProfiler(profiler.get());
+    }
+#if MACHINE_COUNTERS
+    mach.SetCounters(countersOut != nullptr);
+#endif
+    std::unique_ptr<TraceWriter> trace;
+    if (traceFile != nullptr)
+    {
+        i64 regs[32];
+        for (i32 r = 0; r < 32; ++r)
+            regs[r] = mach.GetXReg(r);
+        trace.reset(new TraceWriter(traceFile, traceCompression, regs));
+        mach.SetTrace(trace.get());
+    }
+    i64 instructions = Run(mach, program.endPC, engine);
+    if (trace && !trace->Finish())
+    {
+        std::cerr << "Could not write " << traceFile << '\n';
+        return 1;
+    }
+    if (stats)
+    {
+        std::cerr << "hart 0            : " << instructions << " instructions\n";
+        harts.PrintStats(std::cerr);
+        std::cerr << "memory            : " << memory.ResidentPages() << " pages resident ("
+                  << (memory.ResidentPages() * PagedMemory::PAGE_SIZE >> 10) << " KiB of a "
+                  << (memory.Size() >> 10) << " KiB address space)\n";
+        if (engine == BLOCK || engine == JIT)
+            mach.PrintBlockStats(std::cerr);
+        if (engine == PIPELINE)
+            mach.PrintPipelineStats(std::cerr);
+        mach.PrintCacheStats(std::cerr);
+    }
+    if (profiler)
+    {
+        profiler->PrintFlat(std::cerr, 10);
+        if (profileOut != nullptr)
+        {
+            std::ofstream fout(profileOut);
+            profiler->WriteCollapsed(fout);
+            if (!fout)
+            {
+                std::cerr << "Could not write " << profileOut << '\n';
+                return 1;
+            }
+        }
+    }
+#if MACHINE_COUNTERS
+    if (countersOut != nullptr)
+    {
+        std::ofstream fout(countersOut);
+        mach.WriteCounters(fout);
+        if (!fout)
+        {
+            std::cerr << "Could not write " << countersOut << '\n';
+            return 1;
+        }
+    }
+#endif
 
     return 0;
-}
\ No newline at end of file
+}